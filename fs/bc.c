@@ -1,6 +1,31 @@
 #include <inc/lib.h>
 #include "fs.h"
 
+// Whether file_readahead reads ahead, and cache hit counters.
+bool bc_readahead = 1;
+struct Fsret_cachestat bc_stats;
+
+// The cache holds at most bc_capacity blocks, not counting the
+// superblock and the bitmap, which stay mapped for good.  The other
+// cached blocks are listed in bc_slots[0..bc_nslots).  To make room,
+// a CLOCK hand sweeps the list: a block whose PTE_A is set gets a
+// second chance and has PTE_A cleared; the first block found without
+// it is written back if dirty and unmapped.
+uint32_t bc_capacity = BC_CAPACITY;
+static uint32_t bc_slots[BC_MAXCAPACITY];
+static uint32_t bc_nslots;
+static uint32_t bc_hand;
+
+// Cached blocks are mapped read-only until written.  The first write
+// faults, and bc_pgfault sets the block's bit here and maps it
+// writable; writing the block back clears the bit and maps it
+// read-only again.  So sync need only scan this bitmap, a word at a
+// time, instead of every block's PTE.
+#define BC_PTE_CLEAN	(PTE_P | PTE_U)
+#define BC_PTE_DIRTY	(PTE_P | PTE_U | PTE_W)
+
+static uint32_t bc_dirty[DISKSIZE / BLKSIZE / 32];
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -17,6 +42,29 @@ va_is_mapped(void *va)
 	return (uvpd[PDX(va)] & PTE_U) && (uvpt[PGNUM(va)] & PTE_U);
 }
 
+// Is this block in the dirty set?
+bool
+bc_is_dirty(uint32_t blockno)
+{
+	return (bc_dirty[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+static void
+bc_set_dirty(uint32_t blockno)
+{
+	if (!bc_is_dirty(blockno))
+		bc_stats.ret_dirty++;
+	bc_dirty[blockno / 32] |= 1 << (blockno % 32);
+}
+
+static void
+bc_clear_dirty(uint32_t blockno)
+{
+	if (bc_is_dirty(blockno))
+		bc_stats.ret_dirty--;
+	bc_dirty[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
 // Is this virtual address dirty?
 bool
 va_is_dirty(void *va)
@@ -24,13 +72,112 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Has this virtual address been used since PTE_A was last cleared?
+bool
+va_is_accessed(void *va)
+{
+	return (uvpt[PGNUM(va)] & PTE_A) != 0;
+}
+
+// Is blockno the superblock or part of the bitmap, and so never
+// evicted?
+static bool
+bc_pinned(uint32_t blockno)
+{
+	if (!super)
+		return blockno <= 1;
+	return blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Evict one block from the cache.
+static void
+bc_evict(void)
+{
+	void *va;
+	int r;
+
+	while (1) {
+		if (bc_hand >= bc_nslots)
+			bc_hand = 0;
+		va = diskaddr(bc_slots[bc_hand]);
+		if (va_is_mapped(va) && va_is_accessed(va)) {
+			// Remapping clears PTE_A, and so does writing a
+			// dirty block back.
+			if (bc_is_dirty(bc_slots[bc_hand]))
+				flush_block(va);
+			else if ((r = sys_page_map(0, va, 0, va,
+						   uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("in bc_evict, sys_page_map: %e", r);
+			bc_hand++;
+			continue;
+		}
+		if (va_is_mapped(va)) {
+			flush_block(va);
+			// Clients that readmap'd the page keep it; the slot
+			// gets a fresh page when the block is next loaded.
+			if ((r = sys_page_unmap(0, va)) < 0)
+				panic("in bc_evict, sys_page_unmap: %e", r);
+			bc_stats.ret_evictions++;
+		}
+		bc_slots[bc_hand] = bc_slots[--bc_nslots];
+		return;
+	}
+}
+
+// Make room for blockno, which is about to be cached, and list it.
+static void
+bc_insert(uint32_t blockno)
+{
+	if (bc_pinned(blockno))
+		return;
+	while (bc_nslots >= bc_capacity)
+		bc_evict();
+	bc_slots[bc_nslots++] = blockno;
+	bc_stats.ret_cached = bc_nslots;
+}
+
+// Set the cache capacity to n blocks, evicting blocks to fit.
+void
+bc_set_capacity(uint32_t n)
+{
+	// A readahead or vectored load must fit with room to spare.
+	bc_capacity = MIN(MAX(n, 2 * BLK_MAXIOV), BC_MAXCAPACITY);
+	while (bc_nslots > bc_capacity)
+		bc_evict();
+	bc_stats.ret_cached = bc_nslots;
+}
+
+// readmap hands clients the cache's own pages.  Before the server
+// changes a block in place, give it a fresh copy at va, mapped with
+// perm, if anyone else still maps the page, so that they keep the
+// data they were given.  Returns 1 if it made a copy, 0 if the page
+// was ours alone.
+static int
+bc_unshare(void *va, int perm)
+{
+	int r;
+
+	if (pageref(va) <= 1)
+		return 0;
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_alloc: %e", r);
+	memmove(PFTEMP, va, BLKSIZE);
+	if ((r = sys_page_map(0, PFTEMP, 0, va, perm)) < 0)
+		panic("in bc_unshare, sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, PFTEMP)) < 0)
+		panic("in bc_unshare, sys_page_unmap: %e", r);
+	return 1;
+}
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, and mark a cached block dirty when it is
+// first written.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	bool write = (utf->utf_err & FEC_WR) != 0;
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -42,22 +189,39 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	addr = ROUNDDOWN(addr, PGSIZE);
+	if (va_is_mapped(addr)) {
+		if (!write)
+			panic("page fault in FS: eip %08x, va %08x, err %04x",
+			      utf->utf_eip, utf->utf_fault_va, utf->utf_err);
+		bc_set_dirty(blockno);
+		if (!bc_unshare(addr, BC_PTE_DIRTY) &&
+		    (r = sys_page_map(0, addr, 0, addr, BC_PTE_DIRTY)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary.
 	// Hint: use sys_blk_read.
 	//
 	// LAB 5: you code here:
-	if ((r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), PTE_SYSCALL)) < 0) {
+	bc_stats.ret_misses++;
+	bc_insert(blockno);
+	if ((r = sys_page_alloc(0, addr, PTE_SYSCALL)) < 0) {
 		panic("problem allocating page: %e\n", r);
 	}
 	if ((r = sys_blk_read(((uint32_t) diskaddr(blockno) - DISKMAP) / SECTSIZE, 
 			diskaddr(blockno), BLKSECTS)) < 0) {
 		panic("user not authorized to access fault va. Error %e\n", r);
 	}
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, PTE_SYSCALL)) < 0)
+	// Map the block read-only, so that the first write to it is
+	// noticed, unless this fault was that write.
+	if (write)
+		bc_set_dirty(blockno);
+	if ((r = sys_page_map(0, addr, 0, addr,
+			      write ? BC_PTE_DIRTY : BC_PTE_CLEAN)) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
 
 	// Check that the block we read was allocated. (exercise for
@@ -67,13 +231,37 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Cache blockno, which was just allocated, as a block of zeros without
+// reading it from disk.  It is dirty until written back.
+void
+bc_zero(uint32_t blockno)
+{
+	void *va = diskaddr(blockno);
+	int r;
+
+	if (va_is_mapped(va) && pageref(va) <= 1) {
+		memset(va, 0, BLKSIZE);
+		return;
+	}
+	// A page clients still map is left to them: the block may have
+	// belonged to a file they read, and now belongs to another.
+	if (va_is_mapped(va)) {
+		if ((r = sys_page_alloc(0, va, BC_PTE_DIRTY)) < 0)
+			panic("in bc_zero, sys_page_alloc: %e", r);
+		bc_set_dirty(blockno);
+		return;
+	}
+	bc_insert(blockno);
+	// The kernel hands out zeroed pages.
+	if ((r = sys_page_alloc(0, va, BC_PTE_DIRTY)) < 0)
+		panic("in bc_zero, sys_page_alloc: %e", r);
+	bc_set_dirty(blockno);
+}
+
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// necessary, then map it read-only and mark it clean.
 // If the block is not in the block cache or is not dirty, does
 // nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and sys_blk_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
 void
 flush_block(void *addr)
 {
@@ -84,18 +272,127 @@ flush_block(void *addr)
 
 	// LAB 5: Your code here.
 	void *blk_addr = diskaddr(blockno);
-	if (va_is_mapped(blk_addr) && va_is_dirty(blk_addr)) {
+	if (bc_is_dirty(blockno)) {
 		// block is active and has been written to: valid
 		if (sys_blk_write(((uint32_t) blk_addr - DISKMAP) / SECTSIZE,
 				blk_addr, BLKSECTS) < 0) {
 			panic("user not authorized to access addr\n");
 		}
 		int r;
-		if ((r = sys_page_map(0, blk_addr, 0, blk_addr, 
-				uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0) {
+		if ((r = sys_page_map(0, blk_addr, 0, blk_addr,
+				BC_PTE_CLEAN)) < 0) {
 			panic("in flush_block, sys_page_map: %e\n", r);
 		}
+		bc_clear_dirty(blockno);
+	}
+}
+
+// Read the blocks among [blockno, blockno + n) that are not already
+// cached into the block cache, each run of them with one disk command,
+// and return how many that was.  The pages must be writable for the
+// device to fill them, and are mapped read-only once it has.
+uint32_t
+bc_load(uint32_t blockno, uint32_t n)
+{
+	void *bufs[BLK_MAXIOV];
+	uint32_t end, run, i, nread = 0;
+	int r;
+
+	end = super ? MIN(blockno + n, super->s_nblocks) : blockno + n;
+	while (blockno < end) {
+		for (run = 0; blockno + run < end && run < BLK_MAXIOV &&
+			     !va_is_mapped(diskaddr(blockno + run)); run++) {
+			bufs[run] = diskaddr(blockno + run);
+			bc_insert(blockno + run);
+			if ((r = sys_page_alloc(0, bufs[run], PTE_SYSCALL)) < 0)
+				panic("in bc_load, sys_page_alloc: %e", r);
+			// Touch the page to set PTE_A, so that making room
+			// for the rest of the run cannot evict it before
+			// it is read.
+			(void) *(volatile char *) bufs[run];
+		}
+		if (run == 0) {
+			blockno++;
+			continue;
+		}
+		if ((r = sys_blk_readv(blockno * BLKSECTS, bufs, run)) < 0)
+			panic("in bc_load, sys_blk_readv: %e", r);
+		for (i = 0; i < run; i++)
+			if ((r = sys_page_map(0, bufs[i], 0, bufs[i],
+					      BC_PTE_CLEAN)) < 0)
+				panic("in bc_load, sys_page_map: %e", r);
+		blockno += run;
+		nread += run;
 	}
+	return nread;
+}
+
+// Write the dirty cached blocks among [blockno, blockno + n) out to
+// disk, each run of consecutive dirty blocks with one disk command,
+// and mark them clean.
+void
+flush_blocks(uint32_t blockno, uint32_t n)
+{
+	void *bufs[BLK_MAXIOV];
+	uint32_t end, run, i;
+	int r;
+
+	end = super ? MIN(blockno + n, super->s_nblocks) : blockno + n;
+	while (blockno < end) {
+		for (run = 0; blockno + run < end && run < BLK_MAXIOV &&
+			     bc_is_dirty(blockno + run); run++)
+			bufs[run] = diskaddr(blockno + run);
+		if (run == 0) {
+			blockno++;
+			continue;
+		}
+		if ((r = sys_blk_writev(blockno * BLKSECTS,
+					(const void *const *) bufs, run)) < 0)
+			panic("in flush_blocks, sys_blk_writev: %e", r);
+		for (i = 0; i < run; i++) {
+			if ((r = sys_page_map(0, bufs[i], 0, bufs[i],
+					      BC_PTE_CLEAN)) < 0)
+				panic("in flush_blocks, sys_page_map: %e", r);
+			bc_clear_dirty(blockno + i);
+		}
+		blockno += run;
+	}
+}
+
+// Write back every dirty block, finding them a bitmap word at a time
+// and each run of consecutive ones with one disk command.
+void
+bc_sync(void)
+{
+	uint32_t w, nwords, blockno, n;
+
+	nwords = super ? (super->s_nblocks + 31) / 32 : ARRAY_SIZE(bc_dirty);
+	for (w = 0; w < nwords && bc_stats.ret_dirty > 0; w++)
+		while (bc_dirty[w]) {
+			blockno = w * 32 + __builtin_ctz(bc_dirty[w]);
+			for (n = 1; blockno + n < nwords * 32 &&
+				     bc_is_dirty(blockno + n); n++)
+				;
+			flush_blocks(blockno, n);
+		}
+}
+
+// Write back every dirty block, then evict every cached block but the
+// superblock and the bitmap, so that the next reads go to disk.
+void
+bc_drop(void)
+{
+	uint32_t blockno, nmeta;
+	int r;
+
+	bc_sync();
+	nmeta = 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	for (blockno = nmeta; blockno < super->s_nblocks; blockno++)
+		if (va_is_mapped(diskaddr(blockno)) &&
+		    (r = sys_page_unmap(0, diskaddr(blockno))) < 0)
+			panic("in bc_drop, sys_page_unmap: %e", r);
+	bc_nslots = bc_hand = 0;
+	bc_stats.ret_cached = 0;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -10,6 +10,8 @@
 void
 check_super(void)
 {
+	if (super->s_magic == FS_MAGIC_BLKMAP)
+		panic("file system uses block maps; convert it with fsformat -c");
 	if (super->s_magic != FS_MAGIC)
 		panic("bad file system magic number");
 
@@ -45,48 +47,91 @@ free_block(uint32_t blockno)
 	bitmap[blockno / 32] |= BIT(blockno % 32);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Where the search for a free block starts: the bitmap word after
+// the last allocation, so that allocations move through the disk
+// instead of rescanning its full start every time.
+static uint32_t alloc_hint;
+
+// Find a free block, scanning the bitmap a word at a time from
+// alloc_hint.  Return its number, or -E_NO_DISK if there is none.
+static int
+find_free_block(void)
+{
+	uint32_t nwords, w, i, blockno;
+
+	nwords = (super->s_nblocks + 31) / 32;
+	for (i = 0; i < nwords; i++) {
+		w = (alloc_hint + i) % nwords;
+		if (bitmap[w] == 0)
+			continue;
+		// The bits past the end of the disk are set too.
+		blockno = w * 32 + __builtin_ctz(bitmap[w]);
+		if (blockno < super->s_nblocks)
+			return blockno;
+	}
+	return -E_NO_DISK;
+}
+
+// Allocate a run of up to n blocks that are consecutive on disk:
+// starting at goal if that block is free, so that a file that grows
+// stays in one extent, and otherwise at the first free block
+// find_free_block finds.  Set *pstart to the first block of the run
+// and return its length, or -E_NO_DISK if the disk is full.
+//
+// The changed bitmap words are not written out here; they are dirty
+// in the block cache and go out with the next sync or write-back.
+int
+alloc_blocks(uint32_t goal, uint32_t n, uint32_t *pstart)
+{
+	uint32_t start, len, b;
+	int r;
+
+	if (block_is_free(goal))
+		start = goal;
+	else if ((r = find_free_block()) < 0)
+		return r;
+	else
+		start = r;
+	for (len = 0; len < n; ) {
+		b = start + len;
+		// Take a whole word at a time where it is all free.
+		if (b % 32 == 0 && n - len >= 32 && bitmap[b / 32] == ~0U &&
+		    b + 32 <= super->s_nblocks) {
+			bitmap[b / 32] = 0;
+			len += 32;
+		} else if (block_is_free(b)) {
+			bitmap[b / 32] &= ~BIT(b % 32);
+			len++;
+		} else
+			break;
+	}
+	alloc_hint = (start + len) / 32;
+	*pstart = start;
+	return len;
+}
+
+// Write out the dirty bitmap blocks.  Metadata that points at newly
+// allocated blocks must not reach disk before the bitmap marks them
+// in use, or a crash in between lets them be allocated twice.
+static void
+bitmap_flush(void)
+{
+	flush_blocks(2, (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+}
+
+// Allocate a block.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-
-	// LAB 5: Your code here.
-	uint32_t *bitmap_searcher = bitmap;
-	uint32_t counter = 0;
-	uint32_t num_fs_blocks = super->s_nblocks;
-	while (counter < num_fs_blocks) {
-		if (*bitmap_searcher > 0) {
-			// some bit set: a block is free
-			uint32_t i;
-			for (i = 0; i < 32; i++) {
-				if (counter + i >= num_fs_blocks) {
-					return -E_NO_DISK;
-				}
-				if (*bitmap_searcher & BIT(i)) {
-					// ith bit from right is set: free block found
-					*bitmap_searcher &= (~BIT(i));
-					flush_block(bitmap_searcher);
-					return counter + i;
-				}
-			}
-			panic("should have found free block\n");
-		} else {
-			counter += 32;
-			bitmap_searcher++;
-		}
-	}
+	uint32_t blockno;
+	int r;
 
-	return -E_NO_DISK;
+	if ((r = alloc_blocks(0, 1, &blockno)) < 0)
+		return r;
+	return blockno;
 }
 
 // Validate the file system bitmap.
@@ -130,90 +175,368 @@ fs_init(void)
 	
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// Allocate a zeroed block for file metadata and store its number in
+// *pblockno.
+static int
+file_alloc_meta(uint32_t *pblockno)
+{
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	bc_zero(r);
+	*pblockno = r;
+	return 0;
+}
+
+// Set *pext to point to the i'th extent of file f, which lives in the
+// File, its extent block, or one of the extent blocks its
+// double-indirect block lists.  When 'alloc' is set, allocate the
+// extent block or double-indirect block that holds it if necessary.
 //
 // Returns:
-//	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
-//		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	0 on success.
+//	-E_NOT_FOUND if an extent block is missing and alloc was 0.
+//	-E_NO_DISK if there's no space on the disk for an extent block.
+//	-E_INVAL if i is out of range (it's >= MAXEXTENTS).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
-file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
+file_extent(struct File *f, uint32_t i, struct Extent **pext, bool alloc)
 {
-	// LAB 5: Your code here.
-	uint32_t blockno;
-	if (filebno >= NDIRECT + NINDIRECT) {
-		// filebno too big
-		return -E_INVAL;
-	}
+	uint32_t *pblockno, blockno;
+	int r;
 
-	if (filebno < NDIRECT) {
-		// filebno in main File block
-		if (ppdiskbno) {
-			*ppdiskbno = f->f_direct + filebno;
-		}
+	if (i < NEXTENT) {
+		*pext = &f->f_extents[i];
+		return 0;
+	}
+	i -= NEXTENT;
+	// struct File is packed, so its block numbers are read into and
+	// stored back from a local rather than passed by address.
+	if (i < BLKEXTENTS) {
+		blockno = f->f_indirect;
+		pblockno = &blockno;
 	} else {
-		// NDIRECT <= filebno < NDIRECT + NINDIRECT: working with inds
-		if (!f->f_indirect) {
-			if (!alloc) {
+		i -= BLKEXTENTS;
+		if (i >= NDINDIRECT * BLKEXTENTS)
+			return -E_INVAL;
+		if (!f->f_dindirect) {
+			if (!alloc)
 				return -E_NOT_FOUND;
-			}
+			if ((r = file_alloc_meta(&blockno)) < 0)
+				return r;
+			f->f_dindirect = blockno;
+		}
+		pblockno = (uint32_t *) diskaddr(f->f_dindirect) + i / BLKEXTENTS;
+		i %= BLKEXTENTS;
+	}
+	if (!*pblockno) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = file_alloc_meta(pblockno)) < 0)
+			return r;
+		if (pblockno == &blockno)
+			f->f_indirect = blockno;
+	}
+	*pext = (struct Extent *) diskaddr(*pblockno) + i;
+	return 0;
+}
 
-			int new_block_no;
-			if ((new_block_no = alloc_block()) < 0) {
-				// allocation failed: return -E_NO_DISK
-				return new_block_no;
-			} else {
-				// indirect block allocation succeeded
-				f->f_indirect = (uint32_t) new_block_no;
-				memset(diskaddr(new_block_no), 0, BLKSIZE);
-			}
+// Find the disk block that holds the filebno'th block of file f.
+// Set *pdiskbno to it and, if prun is not null, *prun to the number
+// of blocks of the file from there on that follow it on disk.
+//
+// Returns 0 on success, -E_NOT_FOUND if the file has fewer blocks.
+static int
+file_map(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *prun)
+{
+	struct Extent *e;
+	uint32_t i;
+	int r;
+
+	if (filebno >= f->f_nblocks)
+		return -E_NOT_FOUND;
+	for (i = 0; i < f->f_nextents; i++) {
+		if ((r = file_extent(f, i, &e, 0)) < 0)
+			return r;
+		if (filebno < e->e_len) {
+			*pdiskbno = e->e_start + filebno;
+			if (prun)
+				*prun = e->e_len - filebno;
+			return 0;
 		}
-		if (ppdiskbno) {
-			*ppdiskbno = (uint32_t *) (diskaddr(f->f_indirect) +
-					sizeof(uint32_t) * (filebno - NDIRECT));
+		filebno -= e->e_len;
+	}
+	return -E_NOT_FOUND;
+}
+
+// Grow file f's block map to nblocks zeroed blocks, allocating them
+// in as few runs as the free space allows.  Each run starts right
+// after the last extent if that block is free, and so only lengthens
+// it.
+static int
+file_extend(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e = NULL;
+	uint32_t goal = 0, start, i;
+	int r, n;
+
+	if (nblocks > MAXFILESIZE / BLKSIZE)
+		return -E_INVAL;
+	if (f->f_nextents > 0) {
+		if ((r = file_extent(f, f->f_nextents - 1, &e, 0)) < 0)
+			return r;
+		goal = e->e_start + e->e_len;
+	}
+	while (f->f_nblocks < nblocks) {
+		if ((n = alloc_blocks(goal, nblocks - f->f_nblocks, &start)) < 0)
+			return n;
+		if (!e || start != goal) {
+			if ((r = file_extent(f, f->f_nextents, &e, 1)) < 0) {
+				for (i = 0; i < n; i++)
+					free_block(start + i);
+				return r;
+			}
+			e->e_start = start;
+			e->e_len = 0;
+			f->f_nextents++;
 		}
+		for (i = 0; i < n; i++)
+			bc_zero(start + i);
+		e->e_len += n;
+		f->f_nblocks += n;
+		goal = start + n;
 	}
 	return 0;
 }
 
+// Shrink file f's block map to nblocks blocks, freeing the rest, and
+// free the extent blocks that no longer hold extents.
+static void
+file_truncate_blocks(struct File *f, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t *dind, n, i;
+	int r;
+
+	while (f->f_nblocks > nblocks) {
+		if ((r = file_extent(f, f->f_nextents - 1, &e, 0)) < 0)
+			panic("file_truncate_blocks: %e", r);
+		n = MIN(e->e_len, f->f_nblocks - nblocks);
+		for (i = 0; i < n; i++)
+			free_block(e->e_start + e->e_len - 1 - i);
+		e->e_len -= n;
+		f->f_nblocks -= n;
+		if (e->e_len == 0)
+			f->f_nextents--;
+	}
+
+	if (f->f_dindirect) {
+		dind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NDINDIRECT; i++)
+			if (dind[i] && NEXTENT + BLKEXTENTS + i * BLKEXTENTS >= f->f_nextents) {
+				free_block(dind[i]);
+				dind[i] = 0;
+			}
+		if (f->f_nextents <= NEXTENT + BLKEXTENTS) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+	}
+	if (f->f_nextents <= NEXTENT && f->f_indirect) {
+		free_block(f->f_indirect);
+		f->f_indirect = 0;
+	}
+}
+
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped, growing the file's block map to
+// reach it if necessary.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-	// LAB 5: Your code here.
-	uint32_t *ppdiskbno;
+	uint32_t diskbno;
 	int r;
-	if ((r = file_block_walk(f, filebno, &ppdiskbno, 1)) < 0) {
+
+	if (filebno >= f->f_nblocks &&
+	    (r = file_extend(f, filebno + 1)) < 0)
+		return r;
+	if ((r = file_map(f, filebno, &diskbno, NULL)) < 0)
+		return r;
+	*blk = (char *) diskaddr(diskbno);
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// Set *pf to point at entry ent of directory dir.
+static int
+dir_entry(struct File *dir, uint32_t ent, struct File **pf)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(dir, ent / BLKFILES, &blk)) < 0)
 		return r;
+	*pf = (struct File *) blk + ent % BLKFILES;
+	return 0;
+}
+
+// Set *pslot to point at slot i of directory index di.
+static int
+dir_index_slot(struct DirIndex *di, uint32_t i, struct DirSlot **pslot)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(&di->di_table, i / BLKDIRSLOTS, &blk)) < 0)
+		return r;
+	*pslot = (struct DirSlot *) blk + i % BLKDIRSLOTS;
+	return 0;
+}
+
+// Record in di that entry ent is named name.  There must be a free
+// slot.
+static int
+dir_index_put(struct DirIndex *di, const char *name, uint32_t ent)
+{
+	struct DirSlot *slot;
+	uint32_t h = dir_hash(name), i;
+	int r;
+
+	for (i = h; ; i++) {
+		if ((r = dir_index_slot(di, i & (di->di_nslots - 1), &slot)) < 0)
+			return r;
+		if (slot->ds_ent == 0 || slot->ds_ent == DIRSLOT_DELETED)
+			break;
 	}
-	if (!*ppdiskbno) {
-		if ((r = alloc_block()) < 0) {
+	if (slot->ds_ent == DIRSLOT_DELETED)
+		di->di_ndeleted--;
+	slot->ds_hash = h;
+	slot->ds_ent = ent + 1;
+	di->di_nused++;
+	return 0;
+}
+
+// Find the entry named name through dir's index di.  Set *file to it
+// and, if pslot is not null, *pslot to its slot.
+static int
+dir_index_lookup(struct File *dir, struct DirIndex *di, const char *name,
+		 struct File **file, struct DirSlot **pslot)
+{
+	struct DirSlot *slot;
+	struct File *f;
+	uint32_t h = dir_hash(name), i;
+	int r;
+
+	for (i = 0; i < di->di_nslots; i++) {
+		if ((r = dir_index_slot(di, (h + i) & (di->di_nslots - 1), &slot)) < 0)
 			return r;
+		if (slot->ds_ent == 0)
+			break;
+		if (slot->ds_ent == DIRSLOT_DELETED || slot->ds_hash != h)
+			continue;
+		if ((r = dir_entry(dir, slot->ds_ent - 1, &f)) < 0)
+			return r;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			if (pslot)
+				*pslot = slot;
+			return 0;
 		}
-		*ppdiskbno = (uint32_t) r;
 	}
-	*blk = (char *) diskaddr(*ppdiskbno);
+	return -E_NOT_FOUND;
+}
+
+// Free dir's index.
+static void
+dir_index_free(struct File *dir)
+{
+	struct DirIndex *di;
+
+	if (!dir->f_dirindex)
+		return;
+	di = diskaddr(dir->f_dirindex);
+	file_truncate_blocks(&di->di_table, 0);
+	free_block(dir->f_dirindex);
+	dir->f_dirindex = 0;
+}
+
+// (Re)build dir's index from its entries, with room for twice as many
+// names as dir has entries.
+static int
+dir_index_build(struct File *dir)
+{
+	struct DirIndex *di;
+	struct File *f;
+	uint32_t nents, nslots, ent, blockno;
+	int r;
+
+	nents = dir->f_size / sizeof(struct File);
+	for (nslots = BLKDIRSLOTS; nslots < 2 * nents; nslots *= 2)
+		;
+	// dir is packed: allocate through a local (see file_extent).
+	if (!dir->f_dirindex) {
+		if ((r = file_alloc_meta(&blockno)) < 0)
+			return r;
+		dir->f_dirindex = blockno;
+	}
+	di = diskaddr(dir->f_dirindex);
+	file_truncate_blocks(&di->di_table, 0);
+	if ((r = file_extend(&di->di_table, nslots / BLKDIRSLOTS)) < 0)
+		goto fail;
+	di->di_table.f_size = nslots * sizeof(struct DirSlot);
+	di->di_nslots = nslots;
+	di->di_nused = di->di_ndeleted = 0;
+	di->di_hint = nents;
+	for (ent = 0; ent < nents; ent++) {
+		if ((r = dir_entry(dir, ent, &f)) < 0)
+			goto fail;
+		if (f->f_name[0] == '\0')
+			di->di_hint = MIN(di->di_hint, ent);
+		else if ((r = dir_index_put(di, f->f_name, ent)) < 0)
+			goto fail;
+	}
 	return 0;
+
+fail:
+	dir_index_free(dir);
+	return r;
+}
+
+// Add entry ent, which was just named, to dir's index, if it has one.
+// The index is rebuilt bigger once it is three-quarters full.
+static int
+dir_index_add(struct File *dir, uint32_t ent)
+{
+	struct DirIndex *di;
+	struct File *f;
+	int r;
+
+	if (!dir->f_dirindex)
+		return 0;
+	di = diskaddr(dir->f_dirindex);
+	if ((di->di_nused + di->di_ndeleted + 1) * 4 > di->di_nslots * 3)
+		return dir_index_build(dir);
+	if ((r = dir_entry(dir, ent, &f)) < 0)
+		return r;
+	return dir_index_put(di, f->f_name, ent);
 }
 
+// --------------------------------------------------------------
+// Directories
+// --------------------------------------------------------------
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// A directory big enough to need an index gets one here; it then
+// takes a few probes of the index instead of a scan.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -230,6 +553,14 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
+	// Index a big directory the first time it is searched; without
+	// the disk space for an index, scan it.
+	if (!dir->f_dirindex && nblock >= DIRINDEX_MINBLKS)
+		dir_index_build(dir);
+	if (dir->f_dirindex)
+		return dir_index_lookup(dir, diskaddr(dir->f_dirindex),
+					name, file, NULL);
+
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
@@ -243,36 +574,134 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pent to
+// its entry number.  The caller is responsible for filling in the
+// File fields.  An indexed directory starts looking at di_hint.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pent)
 {
+	struct DirIndex *di = NULL;
 	int r;
-	uint32_t nblock, i, j;
-	char *blk;
+	uint32_t nents, ent;
+	char *blk = NULL;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	nents = dir->f_size / sizeof(struct File);
+	ent = 0;
+	if (dir->f_dirindex) {
+		di = diskaddr(dir->f_dirindex);
+		ent = di->di_hint;
+	}
+	for (; ent < nents; ent++) {
+		if (!blk || ent % BLKFILES == 0) {
+			if ((r = file_get_block(dir, ent / BLKFILES, &blk)) < 0)
+				return r;
+		}
+		f = (struct File*) blk + ent % BLKFILES;
+		if (f->f_name[0] == '\0')
+			break;
+	}
+	if (ent == nents) {
+		dir->f_size += BLKSIZE;
+		if ((r = dir_entry(dir, ent, &f)) < 0) {
+			dir->f_size -= BLKSIZE;
 			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+		}
 	}
-	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
-		return r;
-	f = (struct File*) blk;
-	*file = &f[0];
+	if (di)
+		di->di_hint = ent + 1;
+	*file = f;
+	*pent = ent;
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Path lookup cache
+// --------------------------------------------------------------
+
+// Names looked up in directories, hashed on the directory and name
+// into DCACHE_SIZE slots; a new name replaces whatever was in its
+// slot.  A name can be cached as missing (d_file is null), so that
+// looking for a file that is not there again, as the shell does
+// when it searches for commands, need not search the directory again.
+// Files never move, so a cached File stays valid until it is
+// removed, which updates the cache.
+#define DCACHE_SIZE	256
+
+struct Dentry {
+	struct File *d_dir;		// directory, null if slot is free
+	struct File *d_file;		// the file, null if there is none
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[DCACHE_SIZE];
+bool dcache_enabled = 1;
+struct Fsret_dcachestat dcache_stats;
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	uint32_t h = dir_hash(name) + (uint32_t) dir / sizeof(struct File) * 2654435761U;
+
+	return &dcache[h % DCACHE_SIZE];
+}
+
+// If name in dir is cached, set *pf to its File, or null if there is
+// no such file, and return 1.  Otherwise return 0.
+static bool
+dcache_lookup(struct File *dir, const char *name, struct File **pf)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	if (!dcache_enabled || d->d_dir != dir || strcmp(d->d_name, name) != 0) {
+		dcache_stats.ret_misses++;
+		return 0;
+	}
+	if (d->d_file)
+		dcache_stats.ret_hits++;
+	else
+		dcache_stats.ret_neghits++;
+	*pf = d->d_file;
+	return 1;
+}
+
+// Cache that name in dir is f, or that there is no such file if f is
+// null.  This goes on while the cache is off, so that it is right
+// when turned back on.
+static void
+dcache_enter(struct File *dir, const char *name, struct File *f)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	if (!d->d_dir)
+		dcache_stats.ret_entries++;
+	d->d_dir = dir;
+	d->d_file = f;
+	strcpy(d->d_name, name);
+}
+
+// Forget every name cached in dir, which is going away.
+static void
+dcache_forget_dir(struct File *dir)
+{
+	int i;
+
+	for (i = 0; i < DCACHE_SIZE; i++)
+		if (dcache[i].d_dir == dir) {
+			dcache[i].d_dir = NULL;
+			dcache_stats.ret_entries--;
+		}
+}
+
+// Empty the cache and zero its counters.
+void
+dcache_flush(void)
+{
+	memset(dcache, 0, sizeof(dcache));
+	memset(&dcache_stats, 0, sizeof(dcache_stats));
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -320,7 +749,13 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (!FTYPE_ISDIR(dir->f_type))
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if (dcache_lookup(dir, name, &f))
+			r = f ? 0 : -E_NOT_FOUND;
+		else if ((r = dir_lookup(dir, name, &f)) == 0)
+			dcache_enter(dir, name, f);
+		else if (r == -E_NOT_FOUND)
+			dcache_enter(dir, name, NULL);
+		if (r < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -349,16 +784,22 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t ent;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &ent)) < 0)
 		return r;
 
 	strcpy(f->f_name, name);
+	if ((r = dir_index_add(dir, ent)) < 0) {
+		f->f_name[0] = '\0';
+		return r;
+	}
+	dcache_enter(dir, name, f);
 	*pf = f;
 	file_flush(dir);
 	return 0;
@@ -372,12 +813,128 @@ file_open(const char *path, struct File **pf)
 	return walk_path(path, 0, pf, 0);
 }
 
+// A File's inode number is its position on disk, counted in Files.
+// Entries never move, so it lasts as long as the file does.
+uint32_t
+file_ino(struct File *f)
+{
+	return ((uintptr_t) f - DISKMAP) / sizeof(struct File);
+}
+
+// Returns whether directory dir has no entries.
+static bool
+dir_empty(struct File *dir)
+{
+	uint32_t ent, nents = dir->f_size / sizeof(struct File);
+	struct File *f;
+
+	for (ent = 0; ent < nents; ent++)
+		if (dir_entry(dir, ent, &f) < 0 || f->f_name[0] != '\0')
+			return 0;
+	return 1;
+}
+
+// Remove a file, dropping it from its directory's index.  The caller
+// makes sure that nobody has the file open.
+// Returns 0 on success, -E_NOT_EMPTY for a directory with entries.
+int
+file_remove(const char *path)
+{
+	struct DirIndex *di;
+	struct DirSlot *slot;
+	struct File *dir, *f;
+	int r;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_INVAL;
+	if (FTYPE_ISDIR(f->f_type) && !dir_empty(f))
+		return -E_NOT_EMPTY;
+	if (dir->f_dirindex) {
+		di = diskaddr(dir->f_dirindex);
+		if ((r = dir_index_lookup(dir, di, f->f_name, &f, &slot)) < 0)
+			return r;
+		di->di_hint = MIN(di->di_hint, slot->ds_ent - 1);
+		slot->ds_ent = DIRSLOT_DELETED;
+		di->di_nused--;
+		di->di_ndeleted++;
+	}
+
+	dcache_enter(dir, f->f_name, NULL);
+	if (FTYPE_ISDIR(f->f_type))
+		dcache_forget_dir(f);
+	dir_index_free(f);
+	file_truncate_blocks(f, 0);
+	f->f_name[0] = '\0';
+	f->f_size = 0;
+	f->f_gen++;
+	flush_block(f);
+
+	return 0;
+}
+
+// Bring blocks [first, last) of file f into the block cache, reading
+// the part of each extent that falls in the range with as few
+// commands as possible instead of faulting blocks in one at a time.
+// Blocks not yet mapped are skipped.  Returns the number of blocks
+// read from disk.
+static uint32_t
+file_load(struct File *f, uint32_t first, uint32_t last)
+{
+	uint32_t diskbno, run, nread = 0;
+
+	while (first < last && file_map(f, first, &diskbno, &run) == 0) {
+		run = MIN(run, last - first);
+		nread += bc_load(diskbno, run);
+		first += run;
+	}
+	return nread;
+}
+
+// Note a read of count bytes at offset from f by an open file whose
+// readahead state is ra, and, if the open file reads sequentially,
+// keep a window of the blocks that follow in the cache, reading them
+// in as few commands as possible.  Called before the read itself.
+void
+file_readahead(struct File *f, struct Readahead *ra, off_t offset, size_t count)
+{
+	uint32_t first, last, nblocks, start;
+
+	if (count == 0 || offset >= f->f_size)
+		return;
+	first = offset / BLKSIZE;
+	last = (MIN(offset + count, f->f_size) - 1) / BLKSIZE + 1;
+	nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+
+	if (first == ra->ra_next && first > 0)
+		ra->ra_window = MIN(MAX(2 * ra->ra_window, RA_MINWINDOW), RA_MAXWINDOW);
+	else if (first + 1 != ra->ra_next) {
+		// Random access; a read from the start may be the first
+		// of a sequential run.
+		ra->ra_window = first == 0 ? RA_MINWINDOW : 0;
+		ra->ra_end = 0;
+	}
+	ra->ra_next = last;
+	if (!bc_readahead || ra->ra_window == 0)
+		return;
+
+	// Top up once the reader is halfway into what was read ahead.
+	if (ra->ra_end >= last + ra->ra_window / 2)
+		return;
+	start = MAX(ra->ra_end, last);
+	ra->ra_end = MIN(last + ra->ra_window, nblocks);
+	if (start < ra->ra_end)
+		bc_stats.ret_readahead += file_load(f, start, ra->ra_end);
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
+	uint32_t n, nread;
 	int r, bn;
 	off_t pos;
 	char *blk;
@@ -386,6 +943,12 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (count > 0) {
+		n = (offset + count - 1) / BLKSIZE + 1 - offset / BLKSIZE;
+		nread = file_load(f, offset / BLKSIZE, offset / BLKSIZE + n);
+		bc_stats.ret_misses += nread;
+		bc_stats.ret_hits += n - nread;
+	}
 
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
@@ -411,6 +974,7 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	f->f_gen++;
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
@@ -428,88 +992,63 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
-{
-	int r;
-	uint32_t *ptr;
-
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
-		*ptr = 0;
-	}
-	return 0;
-}
-
-// Remove any blocks currently used by file 'f',
-// but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
-// Do not change f->f_size.
-static void
-file_truncate_blocks(struct File *f, off_t newsize)
-{
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
-
-	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
-	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
-
-	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
-	}
-}
-
 // Set the size of file f, truncating or extending as necessary.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	// Blocks f already has go in use on disk before f does; blocks
+	// truncated away go free only after it, with the next write-back.
+	bitmap_flush();
 	if (f->f_size > newsize)
-		file_truncate_blocks(f, newsize);
+		file_truncate_blocks(f, (newsize + BLKSIZE - 1) / BLKSIZE);
 	f->f_size = newsize;
+	f->f_gen++;
 	flush_block(f);
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Flush the contents and metadata of file f out to disk: the dirty
+// blocks of each extent, each run of them with one command, then the
+// bitmap, then the File and its extent blocks.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	struct DirIndex *di;
+	struct Extent *e;
+	uint32_t *dind, i;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	// Nothing to do, and no need to walk the block map.
+	if (bc_stats.ret_dirty == 0)
+		return;
+	for (i = 0; i < f->f_nextents; i++) {
+		if (file_extent(f, i, &e, 0) < 0)
+			break;
+		flush_blocks(e->e_start, e->e_len);
 	}
+	bitmap_flush();
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		dind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NDINDIRECT; i++)
+			if (dind[i])
+				flush_block(diskaddr(dind[i]));
+		flush_block(dind);
+	}
+	if (f->f_dirindex) {
+		di = diskaddr(f->f_dirindex);
+		file_flush(&di->di_table);
+	}
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system, which means writing back the block
+// cache's dirty set.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
@@ -11,28 +11,64 @@
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+// Sequential readahead state, kept per open file.  A reader that
+// picks up where it left off is sequential; each such read doubles
+// the window, up to RA_MAXWINDOW blocks, and any other read resets
+// it.  Blocks up to ra_end are already read ahead.
+#define RA_MINWINDOW	4
+#define RA_MAXWINDOW	BLK_MAXIOV
+
+struct Readahead {
+	uint32_t ra_next;	// file block a sequential read starts at
+	uint32_t ra_window;	// blocks to keep read ahead, 0 if random
+	uint32_t ra_end;	// first file block not yet read ahead
+};
+
+/* Default and largest number of blocks the block cache holds, not
+ * counting the superblock and bitmap. */
+#define BC_CAPACITY	1024
+#define BC_MAXCAPACITY	16384
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
+bool	va_is_accessed(void *va);
+bool	bc_is_dirty(uint32_t blockno);
 physaddr_t physaddr(void *va);
 void	flush_block(void *addr);
+void	flush_blocks(uint32_t blockno, uint32_t n);
+uint32_t bc_load(uint32_t blockno, uint32_t n);
+void	bc_zero(uint32_t blockno);
+void	bc_sync(void);
+void	bc_drop(void);
+void	bc_set_capacity(uint32_t n);
 void	bc_init(void);
+extern bool bc_readahead;
+extern uint32_t bc_capacity;
+extern struct Fsret_cachestat bc_stats;
 
 /* fs.c */
 void	fs_init(void);
+void	dcache_flush(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_readahead(struct File *f, struct Readahead *ra, off_t offset, size_t count);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
+uint32_t	file_ino(struct File *f);
 void	fs_sync(void);
 
+extern bool dcache_enabled;
+extern struct Fsret_dcachestat dcache_stats;
+
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_blocks(uint32_t goal, uint32_t n, uint32_t *pstart);
 
 /* test.c */
 void	fs_test(void);
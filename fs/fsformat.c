@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,6 +34,21 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// The file server maps at most DISKSIZE (fs/fs.h) bytes of disk.
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
+
+// The File of FS_MAGIC_BLKMAP file systems, which map blocks with
+// direct and indirect pointers.  A zero pointer is a hole.
+#define BLKMAP_NDIRECT 10
+
+struct BlkmapFile {
+	char f_name[MAXNAMELEN];
+	off_t f_size;
+	uint32_t f_type;
+	uint32_t f_direct[BLKMAP_NDIRECT];
+	uint32_t f_indirect;
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*BLKMAP_NDIRECT - 4];
+} __attribute__((packed));
 
 struct Dir
 {
@@ -46,7 +62,7 @@ char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
 
-void
+void __attribute__((noreturn))
 panic(const char *fmt, ...)
 {
 	va_list ap;
@@ -131,19 +147,16 @@ finishdisk(void)
 		panic("msync: %s", strerror(errno));
 }
 
+// Files written here are contiguous, so each is a single extent.
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	f->f_nblocks = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+	if (f->f_nblocks > 0) {
+		f->f_nextents = 1;
+		f->f_extents[0].e_start = start;
+		f->f_extents[0].e_len = f->f_nblocks;
 	}
 }
 
@@ -166,6 +179,34 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Build the hash index of a directory whose n entries are at ents,
+// as fs.c would when the directory is first searched.
+void
+indexdir(struct File *dir, struct File *ents, int n)
+{
+	struct DirIndex *di;
+	struct DirSlot *slots;
+	uint32_t nslots, h, i;
+	int j;
+
+	for (nslots = BLKDIRSLOTS; nslots < 2 * dir->f_size / sizeof(struct File); nslots *= 2)
+		;
+	di = alloc(BLKSIZE);
+	slots = alloc(nslots * sizeof *slots);
+	for (j = 0; j < n; j++) {
+		h = dir_hash(ents[j].f_name);
+		for (i = h; slots[i & (nslots - 1)].ds_ent; i++)
+			;
+		slots[i & (nslots - 1)].ds_hash = h;
+		slots[i & (nslots - 1)].ds_ent = j + 1;
+	}
+	di->di_nslots = nslots;
+	di->di_nused = n;
+	di->di_hint = n;
+	finishfile(&di->di_table, blockof(slots), nslots * sizeof *slots);
+	dir->f_dirindex = blockof(di);
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +214,8 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	if (d->f->f_size / BLKSIZE >= DIRINDEX_MINBLKS)
+		indexdir(d->f, start, d->n);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -211,10 +254,145 @@ writefile(struct Dir *dir, const char *name)
 	close(fd);
 }
 
+// Converting a block-mapped file system to extents, in place.
+
+void *
+diskblock(uint32_t blockno)
+{
+	if (blockno == 0 || blockno >= nblocks)
+		panic("bad block number %u", blockno);
+	return diskmap + blockno * BLKSIZE;
+}
+
+// Allocate a free block from the bitmap and zero it.
+uint32_t
+allocfree(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nblocks; i++)
+		if (bitmap[i / 32] & (1U << (i % 32))) {
+			bitmap[i / 32] &= ~(1U << (i % 32));
+			memset(diskblock(i), 0, BLKSIZE);
+			return i;
+		}
+	panic("out of disk blocks");
+}
+
+// Return the i'th extent of f, allocating extent blocks as needed.
+struct Extent *
+extent(struct File *f, uint32_t i)
+{
+	uint32_t *dind;
+
+	if (i < NEXTENT)
+		return &f->f_extents[i];
+	i -= NEXTENT;
+	if (i < BLKEXTENTS) {
+		if (!f->f_indirect)
+			f->f_indirect = allocfree();
+		return (struct Extent *) diskblock(f->f_indirect) + i;
+	}
+	i -= BLKEXTENTS;
+	if (i >= NDINDIRECT * BLKEXTENTS)
+		panic("file %s has too many extents", f->f_name);
+	if (!f->f_dindirect)
+		f->f_dindirect = allocfree();
+	dind = diskblock(f->f_dindirect);
+	if (!dind[i / BLKEXTENTS])
+		dind[i / BLKEXTENTS] = allocfree();
+	return (struct Extent *) diskblock(dind[i / BLKEXTENTS]) + i % BLKEXTENTS;
+}
+
+// Rewrite the block-mapped File f, and if it is a directory the files
+// in it, with extents.  Holes are filled with zeroed blocks, and the
+// indirect block is freed.
+void
+convertfile(struct File *f)
+{
+	struct BlkmapFile old;
+	struct File *ents;
+	struct Extent *e = NULL;
+	uint32_t *blocks, n, i, j;
+
+	memmove(&old, f, sizeof old);
+	n = ROUNDUP((uint32_t) old.f_size, BLKSIZE) / BLKSIZE;
+	if (n > BLKMAP_NDIRECT + BLKSIZE / 4)
+		panic("file %s is too large", old.f_name);
+	if ((blocks = malloc(n * sizeof *blocks)) == NULL && n > 0)
+		panic("out of memory");
+	for (i = 0; i < n; i++) {
+		if (i < BLKMAP_NDIRECT)
+			blocks[i] = old.f_direct[i];
+		else if (old.f_indirect)
+			blocks[i] = ((uint32_t *) diskblock(old.f_indirect))[i - BLKMAP_NDIRECT];
+		else
+			blocks[i] = 0;
+		if (blocks[i] == 0)
+			blocks[i] = allocfree();
+	}
+	if (old.f_indirect)
+		bitmap[old.f_indirect / 32] |= 1U << (old.f_indirect % 32);
+
+	if (FTYPE_ISDIR(old.f_type))
+		for (i = 0; i < n; i++) {
+			ents = diskblock(blocks[i]);
+			for (j = 0; j < BLKFILES; j++)
+				if (ents[j].f_name[0])
+					convertfile(&ents[j]);
+		}
+
+	memset((char *) f + offsetof(struct File, f_nblocks), 0,
+	       sizeof *f - offsetof(struct File, f_nblocks));
+	for (i = 0; i < n; i++) {
+		if (!e || blocks[i] != e->e_start + e->e_len) {
+			e = extent(f, f->f_nextents++);
+			e->e_start = blocks[i];
+			e->e_len = 0;
+		}
+		e->e_len++;
+	}
+	f->f_nblocks = n;
+	free(blocks);
+}
+
+void
+convertdisk(const char *name)
+{
+	int diskfd;
+	struct stat st;
+
+	if ((diskfd = open(name, O_RDWR)) < 0)
+		panic("open %s: %s", name, strerror(errno));
+	if (fstat(diskfd, &st) < 0)
+		panic("stat %s: %s", name, strerror(errno));
+	if ((diskmap = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+			    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
+		panic("mmap %s: %s", name, strerror(errno));
+	close(diskfd);
+
+	super = (struct Super *) (diskmap + BLKSIZE);
+	if (super->s_magic == FS_MAGIC)
+		panic("%s already uses extents", name);
+	if (super->s_magic != FS_MAGIC_BLKMAP)
+		panic("%s: bad file system magic number", name);
+	nblocks = super->s_nblocks;
+	if ((uint64_t) nblocks * BLKSIZE > st.st_size)
+		panic("%s is smaller than its superblock says", name);
+	bitmap = (uint32_t *) (diskmap + 2 * BLKSIZE);
+
+	convertfile(&super->s_root);
+	super->s_magic = FS_MAGIC;
+
+	if (msync(diskmap, nblocks * BLKSIZE, MS_SYNC) < 0)
+		panic("msync: %s", strerror(errno));
+}
+
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n"
+		"       fsformat -c fs.img\n");
 	exit(2);
 }
 
@@ -230,8 +408,16 @@ main(int argc, char **argv)
 	if (argc < 3)
 		usage();
 
+	// Convert a block-mapped image to extents.
+	if (strcmp(argv[1], "-c") == 0) {
+		if (argc != 3)
+			usage();
+		convertdisk(argv[2]);
+		return 0;
+	}
+
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
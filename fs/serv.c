@@ -11,6 +11,8 @@
 
 #define debug 0
 
+#define FLUSH_INTERVAL	(5 * NANOSECONDS_PER_SECOND)
+
 // The file system server maintains three structures
 // for each open file.
 //
@@ -34,6 +36,7 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	struct Readahead o_ra;	// sequential readahead state
 };
 
 // Max number of open files in the file system at once
@@ -77,6 +80,7 @@ openfile_alloc(struct OpenFile **o)
 			opentab[i].o_fileid += MAXOPEN;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
+			memset(&opentab[i].o_ra, 0, sizeof(opentab[i].o_ra));
 			return (*o)->o_fileid;
 		}
 	}
@@ -223,6 +227,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	}
 
 	// read req->req_n bytes from req->req_fileid
+	file_readahead(o->o_file, &o->o_ra, o->o_fd->fd_offset, req->req_n);
 	if ((r = file_read(o->o_file, ret->ret_buf, req->req_n, 
 			o->o_fd->fd_offset)) < 0) {
 		return r;
@@ -234,6 +239,43 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return r;
 }
 
+// Map the block of req->req_fileid at req->req_offset read-only into
+// the client: the page to send back, stored in *pg_store, is the block
+// cache's own, so the data is not copied at all.  Returns the number
+// of bytes of file data in the page, or 0, with no page, at the end
+// of the file.
+int
+serve_readmap(envid_t envid, struct Fsreq_readmap *req,
+	      void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_readmap %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	if (req->req_offset >= o->o_file->f_size)
+		return 0;
+
+	file_readahead(o->o_file, &o->o_ra, req->req_offset, BLKSIZE);
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	// Fault the block in, if it is not cached, so there is a page
+	// to send.  A dirty block is writable in the cache, and written in
+	// place; write it back so that it is read-only again, and the next
+	// write to it faults and copies it (see bc_unshare).
+	(void) *(volatile char *) blk;
+	flush_block(blk);
+	*pg_store = blk;
+	*perm_store = PTE_P | PTE_U;
+	return MIN(BLKSIZE, o->o_file->f_size - req->req_offset);
+}
+
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -285,6 +327,8 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	strcpy(ret->ret_name, o->o_file->f_name);
 	ret->ret_size = o->o_file->f_size;
 	ret->ret_type = o->o_file->f_type;
+	ret->ret_ino = file_ino(o->o_file);
+	ret->ret_gen = o->o_file->f_gen;
 	return 0;
 }
 
@@ -304,6 +348,31 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Remove the file req->req_path.  This request doesn't refer to an
+// open file.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+	struct File *f;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	// An open file's OpenFile points at its File, which the next
+	// file_create may reuse, so leave open files alone.
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+	for (i = 0; i < MAXOPEN; i++)
+		if (pageref(opentab[i].o_fd) > 1 && opentab[i].o_file == f)
+			return -E_BUSY;
+	return file_remove(path);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -312,6 +381,221 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Turn readahead on or off as req->req_readahead says, empty the
+// block cache if req->req_drop is set, resize it if
+// req->req_capacity is set, and return the block cache counters.
+int
+serve_cachestat(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_cachestat *req = &ipc->cachestat;
+	struct Fsret_cachestat *ret = &ipc->cachestatRet;
+
+	if (req->req_readahead >= 0)
+		bc_readahead = req->req_readahead;
+	if (req->req_drop)
+		bc_drop();
+	if (req->req_capacity)
+		bc_set_capacity(req->req_capacity);
+	*ret = bc_stats;
+	ret->ret_capacity = bc_capacity;
+	ret->ret_nblocks = super->s_nblocks;
+	return 0;
+}
+
+// Turn the path lookup cache on or off as req->req_enable says, empty
+// it if req->req_flush is set, and return its counters.
+int
+serve_dcachestat(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_dcachestat *req = &ipc->dcachestat;
+	struct Fsret_dcachestat *ret = &ipc->dcachestatRet;
+
+	if (req->req_flush)
+		dcache_flush();
+	if (req->req_enable >= 0)
+		dcache_enabled = req->req_enable;
+	*ret = dcache_stats;
+	return 0;
+}
+
+// Shared rings (see struct Fsring in inc/fs.h).  Each client's ring
+// page and its data pages are mapped in one slot of the region at
+// RINGVA.  Like an open file, a slot is freed once its client no
+// longer has the ring page mapped.
+
+#define RINGVA		0xE0000000
+#define MAXRINGS	32
+#define RINGSIZE	((1 + FSRING_NBUF) * PGSIZE)
+
+struct RingSlot {
+	envid_t r_env;		// client, or 0 if the slot is free
+	int r_nbuf;		// data pages received so far
+	struct Fsring *r_ring;	// ring page; data pages follow it
+};
+
+struct RingSlot rings[MAXRINGS];
+
+static void
+ring_free(struct RingSlot *rs)
+{
+	int i;
+
+	for (i = 0; i <= rs->r_nbuf; i++)
+		sys_page_unmap(0, (char *) rs->r_ring + i * PGSIZE);
+	rs->r_env = 0;
+}
+
+static struct RingSlot *
+ring_lookup(envid_t envid)
+{
+	int i;
+
+	for (i = 0; i < MAXRINGS; i++)
+		if (rings[i].r_env == envid && pageref(rings[i].r_ring) > 1)
+			return &rings[i];
+	return NULL;
+}
+
+// Carry out one ring request and return its result.
+static int
+ring_do(struct RingSlot *rs, const struct Fsring_sqe *sqe)
+{
+	struct OpenFile *o;
+	struct Fsret_stat *st;
+	char *buf;
+	int r;
+
+	if (sqe->buf >= rs->r_nbuf || sqe->n > PGSIZE || sqe->offset < 0)
+		return -E_INVAL;
+	if ((r = openfile_lookup(rs->r_env, sqe->fileid, &o)) < 0)
+		return r;
+	buf = (char *) rs->r_ring + (1 + sqe->buf) * PGSIZE;
+
+	switch (sqe->op) {
+	case FSRING_READ:
+		file_readahead(o->o_file, &o->o_ra, sqe->offset, sqe->n);
+		return file_read(o->o_file, buf, sqe->n, sqe->offset);
+	case FSRING_WRITE:
+		return file_write(o->o_file, buf, sqe->n, sqe->offset);
+	case FSRING_STAT:
+		st = (struct Fsret_stat *) buf;
+		strcpy(st->ret_name, o->o_file->f_name);
+		st->ret_size = o->o_file->f_size;
+		st->ret_type = o->o_file->f_type;
+		st->ret_ino = file_ino(o->o_file);
+		st->ret_gen = o->o_file->f_gen;
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Carry out everything queued on rs's ring, as long as there is room
+// for the completions.
+static void
+ring_poll(struct RingSlot *rs)
+{
+	struct Fsring *ring = rs->r_ring;
+	struct Fsring_sqe sqe;
+	uint32_t head = ring->sq_head;
+	int r;
+
+	while (1) {
+		while (head != ring->sq_tail &&
+		       ring->cq_tail - ring->cq_head < FSRING_NENT) {
+			// Copy the request so the client cannot change
+			// it under us.
+			sqe = ring->sq[head % FSRING_NENT];
+			r = ring_do(rs, &sqe);
+			ring->cq[ring->cq_tail % FSRING_NENT].tag = sqe.tag;
+			ring->cq[ring->cq_tail % FSRING_NENT].res = r;
+			ring->cq_tail++;
+			ring->sq_head = ++head;
+		}
+		// Publish sq_head before the last look at sq_tail.  The
+		// client stores sq_tail and then loads sq_head, so either
+		// we see its new request or it sees an empty ring and
+		// rings the doorbell.
+		asm volatile("mfence" ::: "memory");
+		if (head == ring->sq_tail ||
+		    ring->cq_tail - ring->cq_head >= FSRING_NENT)
+			break;
+	}
+}
+
+// Serve every ring, and free the slots of clients that have gone.
+static void
+ring_poll_all(void)
+{
+	int i;
+
+	for (i = 0; i < MAXRINGS; i++) {
+		if (!rings[i].r_env)
+			continue;
+		if (pageref(rings[i].r_ring) <= 1)
+			ring_free(&rings[i]);
+		else
+			ring_poll(&rings[i]);
+	}
+}
+
+// Take the request page as envid's ring, replacing any ring envid
+// set up before.
+int
+serve_ring_setup(envid_t envid, union Fsipc *req)
+{
+	struct RingSlot *rs = NULL;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	for (i = 0; i < MAXRINGS; i++) {
+		if (rings[i].r_env &&
+		    (rings[i].r_env == envid || pageref(rings[i].r_ring) <= 1))
+			ring_free(&rings[i]);
+		if (!rings[i].r_env && !rs)
+			rs = &rings[i];
+	}
+	if (!rs)
+		return -E_MAX_OPEN;
+
+	rs->r_ring = (struct Fsring *) (RINGVA + (rs - rings) * RINGSIZE);
+	if ((r = sys_page_map(0, req, 0, rs->r_ring, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	rs->r_env = envid;
+	rs->r_nbuf = 0;
+	return 0;
+}
+
+// Take the request page as the next data page of envid's ring.
+int
+serve_ring_buf(envid_t envid, union Fsipc *req)
+{
+	struct RingSlot *rs;
+	int r;
+
+	if (!(rs = ring_lookup(envid)) || rs->r_nbuf == FSRING_NBUF)
+		return -E_INVAL;
+	if ((r = sys_page_map(0, req, 0, (char *) rs->r_ring +
+			      (1 + rs->r_nbuf) * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	rs->r_nbuf++;
+	return 0;
+}
+
+// Drain envid's ring, so that it has completions to reap.
+int
+serve_ring_wait(envid_t envid, union Fsipc *req)
+{
+	struct RingSlot *rs;
+
+	if (!(rs = ring_lookup(envid)))
+		return -E_INVAL;
+	ring_poll(rs);
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -322,24 +606,95 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
 	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_RING_SETUP] =	serve_ring_setup,
+	[FSREQ_RING_BUF] =	serve_ring_buf,
+	[FSREQ_RING_WAIT] =	serve_ring_wait,
+	[FSREQ_CACHESTAT] =	serve_cachestat,
+	[FSREQ_DCACHESTAT] =	serve_dcachestat,
 };
 
+// Requests small enough to come as inline IPC words instead of a
+// page, and the size of the reply that goes back inline with them.
+static const struct {
+	bool ok;
+	size_t retsize;
+} inline_reqs[] = {
+	[FSREQ_STAT] =		{ 1, sizeof(struct Fsret_stat) },
+	[FSREQ_FLUSH] =		{ 1, 0 },
+	[FSREQ_SET_SIZE] =	{ 1, 0 },
+	[FSREQ_SYNC] =		{ 1, 0 },
+	[FSREQ_RING_WAIT] =	{ 1, 0 },
+	[FSREQ_CACHESTAT] =	{ 1, sizeof(struct Fsret_cachestat) },
+	[FSREQ_DCACHESTAT] =	{ 1, sizeof(struct Fsret_dcachestat) },
+	[FSREQ_READMAP] =	{ 1, 0 },
+};
+
+// Where inline requests are unpacked, and their replies built.
+static union Fsipc inreq;
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
+	int perm, r = 0, reply_perm = 0;
+	uint32_t nwords;
 	void *pg;
+	bool replying = 0;
+
+	static_assert(sizeof(struct Fsret_stat) <= IPC_MAXWORDS * 4);
 
 	while (1) {
+		// Rings only ring the doorbell when they go from empty,
+		// so never block with work left on one.
+		ring_poll_all();
+
+		// Answer the last request, if any, and wait for the next
+		// in a single system call.
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		if (replying)
+			req = ipc_reply_recv(r, pg, reply_perm,
+					     (int32_t *) &whom, fsreq, &perm);
+		else
+			req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		replying = 0;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
+		// A doorbell just gets us to poll the rings; nobody
+		// waits for an answer.
+		if (req == FSREQ_RING_DOORBELL)
+			continue;
+
+		// Neither does the write-back daemon's periodic nudge.
+		if (req == FSREQ_WRITEBACK) {
+			fs_sync();
+			continue;
+		}
+
+		// Small requests come inline; the rest must contain an
+		// argument page.
+		if (!(perm & PTE_P) && req < ARRAY_SIZE(inline_reqs) &&
+		    inline_reqs[req].ok) {
+			nwords = thisenv->env_ipc_nwords;
+			memcpy(&inreq, (void *) thisenv->env_ipc_words, nwords * 4);
+			pg = NULL;
+			reply_perm = 0;
+			if (req == FSREQ_READMAP) {
+				r = serve_readmap(whom, &inreq.readmap, &pg, &reply_perm);
+				replying = 1;
+				continue;
+			}
+			r = handlers[req](whom, &inreq);
+			if (r >= 0 && inline_reqs[req].retsize > 0) {
+				pg = &inreq;
+				reply_perm = IPC_INLINE(ROUNDUP(inline_reqs[req].retsize, 4) / 4);
+			}
+			replying = 1;
+			continue;
+		}
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
@@ -355,18 +710,47 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		// The next request's page replaces fsreq's mapping.
+		reply_perm = perm;
+		replying = 1;
+	}
+}
+
+// The write-back daemon.  Every FLUSH_INTERVAL it nudges the file
+// server to write back its dirty blocks, so that a crash loses at most
+// that much work even if nobody calls sync.  It sleeps in between, and
+// gives up the latency class that fork handed down from the server.
+static void
+flushd(envid_t fsenv)
+{
+	int r;
+
+	binaryname = "fsflushd";
+	if ((r = sys_env_set_priority(0, ENV_SCHED_FAIR, ENV_WEIGHT_DEFAULT)) < 0)
+		panic("fsflushd: sys_env_set_priority: %e", r);
+	while (1) {
+		nanosleep(FLUSH_INTERVAL);
+		ipc_send(fsenv, FSREQ_WRITEBACK, NULL, 0);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	envid_t fsenv = sys_getenvid();
+	int r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// Fork the daemon before the block cache exists, so that the two
+	// of us share no cached blocks copy-on-write.
+	if ((r = fork()) < 0)
+		panic("fork fsflushd: %e", r);
+	if (r == 0)
+		flushd(fsenv);
+
 	serve_init();
 	fs_init();
         fs_test();
@@ -38,6 +38,25 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling classes (env_sched_class)
+enum {
+	ENV_SCHED_FAIR = 0,	// Weighted fair share of the CPU
+	ENV_SCHED_LATENCY,	// Runs ahead of all fair-share environments
+};
+
+// Fair-share weights (env_weight)
+#define ENV_WEIGHT_DEFAULT	1024
+#define ENV_WEIGHT_MAX		(64 * ENV_WEIGHT_DEFAULT)
+
+// Inline IPC messages.  Instead of a page, a sender may pass up to
+// IPC_MAXWORDS words, which are copied into the receiver's
+// env_ipc_words: 'srcva' then points at the words and 'perm' is
+// IPC_INLINE(nwords).  Enough for a struct Fsret_stat.
+#define IPC_MAXWORDS		40
+#define IPC_INLINE_FLAG		0x80000000
+#define IPC_INLINE(nwords)	(IPC_INLINE_FLAG | (nwords))
+#define IPC_INLINE_NWORDS(perm)	((perm) & 0xffff)
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -51,9 +70,15 @@ struct Env {
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
+	envid_t env_alive_id;		// env_id until freed, then 0 (see wait)
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	int env_sched_class;		// ENV_SCHED_*
+	uint32_t env_weight;		// CPU share within ENV_SCHED_FAIR
+	uint64_t env_vruntime;		// Weighted CPU time used (TSC cycles)
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
@@ -66,6 +91,8 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_nwords;	// Number of inline words received
+	uint32_t env_ipc_words[IPC_MAXWORDS];	// Inline words received
 };
 
 #endif // !JOS_INC_ENV_H
@@ -16,6 +16,7 @@ enum {
 
 	E_IPC_NOT_RECV	,	// Attempt to send to env that is not recving
 	E_EOF		,	// Unexpected end of file
+	E_AGAIN		,	// Condition changed; try again
 
 	// File system error codes -- only seen in user-level
 	E_NO_DISK	,	// No free space left on disk
@@ -25,6 +26,8 @@ enum {
 	E_FILE_EXISTS	,	// File already exists
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
+	E_NOT_EMPTY	,	// Directory not empty
+	E_BUSY		,	// File is open
 
 	MAXERROR
 };
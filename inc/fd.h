@@ -41,6 +41,8 @@ struct Stat {
 	char st_name[MAXNAMELEN];
 	off_t st_size;
 	int st_type;
+	uint32_t st_ino;	// files only: which File, and which version
+	uint32_t st_gen;	// of its contents
 	struct Dev *st_dev;
 };
 
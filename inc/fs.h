@@ -14,6 +14,13 @@
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
+#define BLK_MAXIOV	32			// most blocks per disk command
+
+// A finished asynchronous disk command (sys_blk_submit, sys_blk_reap)
+struct blk_done {
+	uint32_t tag;		// as returned by sys_blk_submit
+	int32_t result;		// sectors transferred, or < 0 on error
+};
 
 // Maximum size of a filename (a single path component), including null
 // Must be a multiple of 4
@@ -22,31 +29,89 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN	1024
 
-// Number of block pointers in a File descriptor
-#define NDIRECT		10
-// Number of direct block pointers in an indirect block
-#define NINDIRECT	(BLKSIZE / 4)
+// A file's blocks are a list of extents, each a run of blocks that
+// are consecutive on disk; the file's first block is the first block
+// of the first extent, and so on, with no holes.  The first NEXTENT
+// extents are kept in the File itself, the next BLKEXTENTS in the
+// extent block f_indirect, and the rest in the extent blocks that the
+// double-indirect block f_dindirect lists.
+struct Extent {
+	uint32_t e_start;		// first disk block
+	uint32_t e_len;			// number of blocks
+} __attribute__((packed));
+
+// Number of extents in a File descriptor
+#define NEXTENT		12
+// Number of extents in an extent block
+#define BLKEXTENTS	(BLKSIZE / sizeof(struct Extent))
+// Number of extent blocks a double-indirect block lists
+#define NDINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+#define MAXEXTENTS	(NEXTENT + BLKEXTENTS + NDINDIRECT * BLKEXTENTS)
+#define MAXFILESIZE	(0x7FFFFFFF / BLKSIZE * BLKSIZE)
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	// Block map.  The extents map f_nblocks blocks, at least
+	// enough for f_size bytes.
+	uint32_t f_nblocks;		// blocks mapped
+	uint32_t f_nextents;		// extents in use
+	struct Extent f_extents[NEXTENT]; // first extents
+	uint32_t f_indirect;		// extent block, or 0
+	uint32_t f_dindirect;		// double-indirect block, or 0
 
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	// Directories only.
+	uint32_t f_dirindex;		// index block, or 0
+
+	// Bumped whenever the contents or size change, and kept when the
+	// File is reused, so (inode, generation) names one version of
+	// one file.
+	uint32_t f_gen;
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
+// A directory of DIRINDEX_MINBLKS or more blocks gets a hash index, so
+// that looking a name up need not scan it.  Its f_dirindex block holds
+// a struct DirIndex, whose di_table is a file of di_nslots DirSlots,
+// probed linearly from dir_hash(name).  A slot holds one plus the
+// number of a directory entry, 0 if never used, or DIRSLOT_DELETED
+// if the entry it held was removed.  Entries never move, so neither
+// do the Files open files point to.
+#define DIRINDEX_MINBLKS	4
+
+struct DirSlot {
+	uint32_t ds_hash;		// dir_hash of the entry's name
+	uint32_t ds_ent;		// entry number + 1, 0, or deleted
+};
+
+#define DIRSLOT_DELETED	0xFFFFFFFF
+// Number of slots in an index block
+#define BLKDIRSLOTS	(BLKSIZE / sizeof(struct DirSlot))
+
+struct DirIndex {
+	uint32_t di_nslots;		// slots, a power of 2
+	uint32_t di_nused;		// slots naming an entry
+	uint32_t di_ndeleted;		// DIRSLOT_DELETED slots
+	uint32_t di_hint;		// entries before this are all in use
+	struct File di_table;		// the slots
+};
+
+// FNV-1a
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 // File types
 #define FTYPE_IFMT	0170000
 #define   FTYPE_IFREG	0100000	// regular file
@@ -61,7 +126,10 @@ struct File {
 
 // File system super-block (both in-memory and on-disk)
 
-#define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+#define FS_MAGIC	0x4A0530AF	// related vaguely to 'J\0S!'
+// File systems that map blocks with direct and indirect pointers
+// instead of extents; fsformat -c converts them.
+#define FS_MAGIC_BLKMAP	0x4A0530AE
 
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
@@ -80,7 +148,68 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Shared ring transport; see struct Fsring
+	FSREQ_RING_SETUP,
+	FSREQ_RING_BUF,
+	FSREQ_RING_DOORBELL,
+	FSREQ_RING_WAIT,
+	// Cachestat returns a Fsret_cachestat on the request page
+	FSREQ_CACHESTAT,
+	// Dcachestat returns a Fsret_dcachestat on the request page
+	FSREQ_DCACHESTAT,
+	// Readmap maps a cached file block into the client with the reply
+	FSREQ_READMAP,
+	// Writeback, sent periodically by fsflushd, writes back the
+	// dirty blocks and gets no reply
+	FSREQ_WRITEBACK
+};
+
+// A client may share a ring with the file server to queue many read,
+// write and stat requests at once.  The ring lives in one page, sent
+// with FSREQ_RING_SETUP; FSRING_NBUF data pages follow, one per
+// FSREQ_RING_BUF, and are numbered from 0 in the order sent.  Each
+// request names the data page it reads into, writes from or stats
+// into.  Indexes run freely and are taken mod FSRING_NENT.
+//
+// The client fills sq[sq_tail] and bumps sq_tail; the server takes
+// sq[sq_head], bumps sq_head, and posts a completion at cq[cq_tail].
+// The server drains every ring before it blocks, so a client only
+// needs to send FSREQ_RING_DOORBELL (with ipc_send) when it finds
+// sq_head caught up with the sq_tail it just replaced.  A client that
+// has nothing to reap can make an FSREQ_RING_WAIT call, which returns
+// once the server has drained its ring.
+
+#define FSRING_NENT	64
+#define FSRING_NBUF	16
+
+enum {
+	FSRING_READ = 1,
+	FSRING_WRITE,
+	FSRING_STAT
+};
+
+struct Fsring_sqe {
+	uint32_t op;		// FSRING_*
+	uint32_t fileid;
+	off_t offset;		// file offset to read or write at
+	size_t n;		// bytes to read or write, <= PGSIZE
+	uint32_t buf;		// data page number
+	uint32_t tag;		// copied to the completion
+};
+
+struct Fsring_cqe {
+	uint32_t tag;
+	int32_t res;		// as for the matching FSREQ_*
+};
+
+struct Fsring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct Fsring_sqe sq[FSRING_NENT];
+	struct Fsring_cqe cq[FSRING_NENT];
 };
 
 union Fsipc {
@@ -99,6 +228,10 @@ union Fsipc {
 	struct Fsret_read {
 		char ret_buf[PGSIZE];
 	} readRet;
+	struct Fsreq_readmap {
+		int req_fileid;
+		off_t req_offset;	// a multiple of BLKSIZE
+	} readmap;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
@@ -111,6 +244,8 @@ union Fsipc {
 		char ret_name[MAXNAMELEN];
 		off_t ret_size;
 		int ret_type;
+		uint32_t ret_ino;
+		uint32_t ret_gen;
 	} statRet;
 	struct Fsreq_flush {
 		int req_fileid;
@@ -118,6 +253,36 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_cachestat {
+		int req_readahead;	// 1 or 0 to turn readahead on or
+					// off, -1 to leave it
+		int req_drop;		// if set, write back and evict
+					// the cache first
+		uint32_t req_capacity;	// blocks to cache at most, or 0
+					// to leave it
+	} cachestat;
+	struct Fsret_cachestat {
+		uint32_t ret_hits;	// blocks read that were cached
+		uint32_t ret_misses;	// blocks read from disk on demand
+		uint32_t ret_readahead;	// blocks read ahead of readers
+		uint32_t ret_evictions;	// blocks evicted to make room
+		uint32_t ret_cached;	// blocks cached now
+		uint32_t ret_capacity;	// blocks cached at most
+		uint32_t ret_dirty;	// cached blocks not yet written back
+		uint32_t ret_nblocks;	// blocks on disk
+	} cachestatRet;
+	struct Fsreq_dcachestat {
+		int req_enable;		// 1 or 0 to turn the path lookup
+					// cache on or off, -1 to leave it
+		int req_flush;		// if set, empty it and zero the
+					// counters
+	} dcachestat;
+	struct Fsret_dcachestat {
+		uint32_t ret_hits;	// lookups answered with a file
+		uint32_t ret_neghits;	// lookups answered "not found"
+		uint32_t ret_misses;	// lookups that searched a directory
+		uint32_t ret_entries;	// names cached now
+	} dcachestatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
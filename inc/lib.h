@@ -23,6 +23,7 @@
 #include <inc/fd.h>
 #include <inc/args.h>
 #include <inc/batch.h>
+#include <inc/thread.h>
 
 #define USED(x)		(void)(x)
 
@@ -31,7 +32,8 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+// Each thread's own, kept in its UTLS page.
+#define thisenv		(*(const volatile struct Env **) UTLS)
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -39,6 +41,7 @@ extern const volatile struct PageInfo pages[];
 void	exit(void);
 
 // pgfault.c
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 
 // readline.c
@@ -58,12 +61,25 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+envid_t	sys_fork(bool share);
 int	sys_sysinfo(struct sysinfo *info);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(uint32_t value, void *pg, int perm, void *rcv_pg);
 int	sys_blk_write(uint32_t secno, const void *buf, size_t nsecs);
 int	sys_blk_read(uint32_t secno, void *buf, size_t nsecs);
+int	sys_blk_submit(int write, uint32_t secno, void *buf, size_t nsecs);
+int	sys_blk_reap(struct blk_done *done, int max);
+int	sys_blk_readv(uint32_t secno, void *const *bufs, size_t nbufs);
+int	sys_blk_writev(uint32_t secno, const void *const *bufs, size_t nbufs);
 int	sys_batch(struct batch *sys_calls, uint32_t num_calls);
+int	sys_env_set_priority(envid_t env, int sched_class, uint32_t weight);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t expected,
+		       nanoseconds_t timeout);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -79,12 +95,16 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void);
 
 // time.c
 nanoseconds_t	uptime(void);
@@ -107,7 +127,20 @@ int	stat(const char *path, struct Stat *statbuf);
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
+int	readmap(int fdnum, off_t offset, void *va);
+int	fmap(int fdnum, void *va, size_t len, off_t offset);
 int	sync(void);
+int	fs_cachestat(int readahead, bool drop, uint32_t capacity,
+		     struct Fsret_cachestat *st);
+int	fs_dcachestat(int enable, bool flush, struct Fsret_dcachestat *st);
+int	fsring_enable(void);
+
+// mmap.c
+#define	PROT_READ	0x1
+#define	PROT_WRITE	0x2	// private: writes never reach the file
+int	mmap(int fdnum, off_t offset, size_t len, int prot, void **va_store);
+int	munmap(void *va);
+int	mmap_fault(struct UTrapframe *utf);
 
 // pageref.c
 int	pageref(void *addr);
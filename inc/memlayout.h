@@ -58,6 +58,9 @@
  *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebfd000
+ *                     .                              .
+ *                     |     Per-Thread Variables     | RW/RW  PGSIZE
+ *    UTLS  -------->  +------------------------------+ 0xee800000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -126,6 +129,9 @@
 // Next page left invalid to guard against exception stack overflow; then:
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
+// Page of per-thread variables (thisenv), at the bottom of the stack's
+// page table: fork copies it like the stack, and sfork keeps it private.
+#define UTLS		(UTOP - PTSIZE)
 
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
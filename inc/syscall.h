@@ -21,6 +21,17 @@ enum {
 	SYS_blk_write,
 	SYS_blk_read,
 	SYS_batch,
+	SYS_env_set_priority,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_blk_submit,
+	SYS_blk_reap,
+	SYS_blk_readv,
+	SYS_blk_writev,
+	SYS_fork,
+	SYS_futex_wait,
+	SYS_futex_wake,
 	NSYSCALLS
 };
 
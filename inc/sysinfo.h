@@ -4,11 +4,17 @@
 #include <inc/time.h>
 #include <inc/types.h>
 
+// Size of the per-CPU arrays below; at least the kernel's NCPU.
+#define SYSINFO_MAXCPU	8
+
 struct sysinfo {
 	nanoseconds_t uptime;
+	int ncpus;
 	size_t totalpages, freepages;
 	uint64_t inblocks, outblocks;
 	uint64_t inpackets, outpackets;
+	uint32_t runqlen[SYSINFO_MAXCPU];	// runnable envs queued per CPU
+	uint64_t steals[SYSINFO_MAXCPU];	// envs each CPU stole
 };
 
 #endif	// !JOS_INC_SYSINFO_H
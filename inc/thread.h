@@ -0,0 +1,43 @@
+#ifndef JOS_INC_THREAD_H
+#define JOS_INC_THREAD_H
+
+#include <inc/types.h>
+
+// Threads are environments made with sfork: they share all memory that
+// was mapped when they were created, but each has a stack of its own.
+// Every primitive here waits by spinning with sys_yield.
+
+struct mutex {
+	volatile uint32_t locked;
+};
+
+struct cond {
+	volatile uint32_t seq;		// bumped by every signal
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+
+// Runs fn(arg) in a new thread, storing its id in *tid_store.  arg is
+// shared only if it points outside the caller's stack.
+// Returns 0 on success, < 0 on error.
+int	thread_create(envid_t *tid_store, void (*fn)(void *), void *arg);
+// Ends the calling thread.  Unlike exit, leaves open files alone:
+// they belong to every thread.
+void	thread_exit(void) __attribute__((noreturn));
+// Waits until thread tid has ended.
+void	thread_join(envid_t tid);
+
+void	mutex_init(struct mutex *m);
+void	mutex_lock(struct mutex *m);
+bool	mutex_trylock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+
+// Condition variables wake every waiter on either call; as usual,
+// waiters must recheck their condition when cond_wait returns.
+void	cond_init(struct cond *c);
+void	cond_wait(struct cond *c, struct mutex *m);
+void	cond_signal(struct cond *c);
+void	cond_broadcast(struct cond *c);
+
+#endif
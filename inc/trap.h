@@ -38,6 +38,7 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_NVME        20	// NVMe I/O queue i interrupts on IRQ_NVME + i
 
 #ifndef __ASSEMBLER__
 
@@ -7,6 +7,7 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -389,6 +390,7 @@ static struct {
 	uint8_t buf[CONSBUFSIZE];
 	uint32_t rpos;
 	uint32_t wpos;
+	struct spinlock lock;
 } cons;
 
 // called by device interrupt routines to feed input characters
@@ -401,9 +403,11 @@ cons_intr(int (*proc)(void))
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
+		spin_lock(&cons.lock);
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		spin_unlock(&cons.lock);
 	}
 }
 
@@ -420,13 +424,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons.lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons.lock);
+	return c;
 }
 
 // output a character to the console
@@ -442,6 +448,7 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	spin_initlock(&cons.lock);
 	cga_init();
 	kbd_init();
 	serial_init();
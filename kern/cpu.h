@@ -45,6 +45,7 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_msi(uint8_t apicid, int vector, uint32_t *addr, uint32_t *data);
 
 void pic_init(void);
 void ioapic_init(void);
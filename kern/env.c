@@ -14,10 +14,19 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_free_lock;	// Protects env_free_list
+
+// Per-environment locks, indexed like envs[].  An env's lock protects
+// its address space and IPC state from concurrent updates by its
+// parent or by senders on other CPUs, and keeps the env from being
+// freed while another CPU is operating on it.
+static struct spinlock env_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -108,6 +117,43 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+//
+// Like envid2env, but also acquires the environment's lock on success.
+// The environment cannot be freed until the caller calls env_unlock.
+//
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0) {
+		*env_store = 0;
+		return r;
+	}
+	env_lock(e);
+	// Recheck: e may have been freed before we got the lock.
+	if (e->env_status == ENV_FREE || (envid != 0 && e->env_id != envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -120,7 +166,9 @@ env_init(void)
 	// Set up envs array
 	// LAB 3: Your code here.
 
+	spin_initlock(&env_free_lock);
 	for (int i = NENV - 1; i >= 0; i--) {
+		__spin_initlock(&env_locks[i], "env_lock");
 		envs[i].env_id = 0;
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_link = env_free_list;
@@ -219,24 +267,42 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_free_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
 	if (generation <= 0)	// Don't create a negative env_id.
 		generation = 1 << ENVGENSHIFT;
 	e->env_id = generation | (e - envs);
+	e->env_alive_id = e->env_id;
 
-	// Set the basic status variables.
+	// Set the basic status variables.  The new env stays
+	// ENV_NOT_RUNNABLE until its creator has finished setting it up;
+	// otherwise another CPU could start running it half-built.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	// Start out on the creating CPU's run queue.
+	e->env_cpunum = cpunum();
+	e->env_sched_class = ENV_SCHED_FAIR;
+	e->env_weight = ENV_WEIGHT_DEFAULT;
+	e->env_vruntime = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -268,8 +334,6 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -424,10 +488,17 @@ env_create(uint8_t *binary, enum EnvType type)
 	}
 	load_icode(e, binary);
 	e->env_type = type;
+	// Clients wait on the file server, so don't make it queue
+	// behind CPU-bound work.
+	if (type == ENV_TYPE_FS)
+		e->env_sched_class = ENV_SCHED_LATENCY;
+	sched_wakeup(e);
 }
 
 //
 // Frees env e and all memory it uses.
+// e must be ENV_DYING and must not be running on any other CPU.
+// If e is the current environment, curenv is cleared.
 //
 void
 env_free(struct Env *e)
@@ -444,6 +515,15 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Fail anyone blocked sending to e, and stop sending ourselves
+	ipc_env_free(e);
+
+	// Stop waiting on any futex
+	futex_cancel(e);
+
+	// Wait out any other CPU that is operating on e
+	env_lock(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -456,6 +536,14 @@ env_free(struct Env *e)
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
+		// a table shared with other address spaces (see sys_fork)
+		// is only let go of; the last one out unmaps its pages
+		if (e->env_pgdir[pdeno] & PTE_COW) {
+			e->env_pgdir[pdeno] = 0;
+			pt_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
@@ -472,10 +560,22 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+	spin_lock(&sched_lock);
+	if (e == curenv)
+		curenv = NULL;
+	sched_set_status(e, ENV_FREE);
+	spin_unlock(&sched_lock);
+	env_unlock(e);
+
+	// Wake anyone in wait() for e
+	e->env_alive_id = 0;
+	futex_wake(PADDR(&e->env_alive_id), NENV);
+
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	spin_lock(&env_free_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_free_lock);
 }
 
 //
@@ -486,23 +586,49 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
+	env_lock(e);
+	env_destroy_unlock(e);
+}
+
+//
+// Like env_destroy, but the caller already holds e's lock, which
+// keeps e from being freed and reused between lookup and destruction.
+// The lock is released.
+//
+void
+env_destroy_unlock(struct Env *e)
+{
+	bool self = (e == curenv);
+
+	spin_lock(&sched_lock);
+	// Somebody else is already tearing e down.
+	if (!self && (e->env_status == ENV_DYING || e->env_status == ENV_FREE)) {
+		spin_unlock(&sched_lock);
+		env_unlock(e);
+		return;
+	}
+
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// it traps to the kernel or its CPU switches away from it.
+	if (!self && sched_running_elsewhere(e)) {
+		sched_set_status(e, ENV_DYING);
+		spin_unlock(&sched_lock);
+		env_unlock(e);
 		return;
 	}
 
+	// Otherwise nobody can run e any more and we free it ourselves.
+	sched_set_status(e, ENV_DYING);
+	spin_unlock(&sched_lock);
+	env_unlock(e);
+
 	env_free(e);
 
-	if (curenv == e) {
-		curenv = NULL;
+	if (self)
 		sched_yield();
-	}
 }
 
-
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
 // This exits the kernel and starts executing some environment's code.
@@ -529,6 +655,7 @@ env_pop_tf(struct Trapframe *tf)
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
+// The caller must already have claimed e for this CPU (see sched.c).
 //
 // This function does not return.
 //
@@ -553,15 +680,26 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
-		curenv->env_status = ENV_RUNNABLE;
+	struct Env *prev = curenv;
+	bool prev_dying = 0;
+
+	if (prev != e) {
+		// Switch page directories before letting go of prev:
+		// once it is runnable another CPU may free it.
+		lcr3(PADDR(e->env_pgdir));
+		spin_lock(&sched_lock);
+		if (prev != NULL && prev->env_status == ENV_RUNNING)
+			sched_set_status(prev, ENV_RUNNABLE);
+		prev_dying = prev != NULL && prev->env_status == ENV_DYING;
+		curenv = e;
+		spin_unlock(&sched_lock);
 	}
-	
-	curenv = e;
-	curenv->env_status = ENV_RUNNING;
 	curenv->env_runs++;
-	lcr3(PADDR(curenv->env_pgdir));
 
-	unlock_kernel();
+	// A zombie that was blocked in the kernel on this CPU is ours
+	// to free.
+	if (prev_dying)
+		env_free(prev);
+
 	env_pop_tf(&curenv->env_tf);
 }
@@ -0,0 +1,197 @@
+// Futexes: sleeping until a word of memory changes.
+//
+// A waiter is keyed on the physical address of its word, so
+// environments that share a page, at whatever address, meet on the same
+// key.  Waiters hang off a hash table of buckets with a lock each.  Keys
+// hash by page, so all the waiters on one page are in one bucket, which
+// lets futex_wake_page find them.  A waiter may also have a deadline,
+// after which futex_expire wakes it.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/futex.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+
+#define NFUTEXBUCKET	64
+
+struct futex_bucket {
+	struct spinlock lock;
+	struct Env *head;		// first waiter, in order of arrival
+};
+
+static struct futex_bucket futex_buckets[NFUTEXBUCKET];
+// Per environment, under its bucket's lock: the key it waits on, 0 if
+// none, the next waiter in the same bucket, and when to give up
+// waiting, 0 if never.
+static physaddr_t futex_keys[NENV];
+static struct Env *futex_next[NENV];
+static nanoseconds_t futex_deadlines[NENV];
+
+volatile uint32_t futex_nwaiting;
+// Number of waiters with a deadline, so that futex_expire can skip
+// its scan when there are none.
+static volatile uint32_t futex_ntimed;
+
+static struct futex_bucket *
+futex_bucket(physaddr_t key)
+{
+	return &futex_buckets[(key >> PGSHIFT) % NFUTEXBUCKET];
+}
+
+// Take e, which *pe points at, off its bucket.  Caller holds the
+// bucket's lock.
+static void
+futex_unlink(struct Env **pe, struct Env *e)
+{
+	int i = ENVX(e->env_id);
+
+	*pe = futex_next[i];
+	futex_next[i] = NULL;
+	futex_keys[i] = 0;
+	if (futex_deadlines[i]) {
+		futex_deadlines[i] = 0;
+		asm volatile("lock; decl %0" : "+m" (futex_ntimed) : : "cc");
+	}
+	asm volatile("lock; decl %0" : "+m" (futex_nwaiting) : : "cc");
+}
+
+// Wake up to n waiters in b whose key, masked with mask, equals key.
+// Caller holds b's lock.
+static int
+futex_wake_locked(struct futex_bucket *b, physaddr_t key, physaddr_t mask,
+		  int n)
+{
+	struct Env **pe = &b->head, *e;
+	int woken = 0;
+
+	while ((e = *pe) && woken < n) {
+		if ((futex_keys[ENVX(e->env_id)] & mask) != key) {
+			pe = &futex_next[ENVX(e->env_id)];
+			continue;
+		}
+		// Wake e while its key is still set: until the key is
+		// cleared, futex_cancel waits for our bucket lock, so
+		// env_free cannot free e under us and e's own lock is not
+		// needed.
+		sched_wakeup(e);
+		futex_unlink(pe, e);
+		woken++;
+	}
+	return woken;
+}
+
+// Put e, which must be curenv, to sleep on key if the word there still
+// holds expected, until futex_expire runs at deadline or later, unless
+// deadline is 0.  The check and the sleep are atomic with respect to
+// futex_wake.  Caller holds e's lock, which keeps the page mapped.
+// Returns 0 if e is now asleep and must give up the CPU, -E_AGAIN if
+// the word had changed.
+int
+futex_wait(struct Env *e, physaddr_t key, uint32_t expected,
+	   nanoseconds_t deadline)
+{
+	struct futex_bucket *b = futex_bucket(key);
+	struct Env **pe;
+
+	// An environment woken some other way may still be queued.
+	futex_cancel(e);
+
+	spin_lock(&b->lock);
+	if (*(volatile uint32_t *) KADDR(key) != expected) {
+		spin_unlock(&b->lock);
+		return -E_AGAIN;
+	}
+	for (pe = &b->head; *pe; pe = &futex_next[ENVX((*pe)->env_id)])
+		;
+	*pe = e;
+	futex_keys[ENVX(e->env_id)] = key;
+	if ((futex_deadlines[ENVX(e->env_id)] = deadline))
+		asm volatile("lock; incl %0" : "+m" (futex_ntimed) : : "cc");
+	asm volatile("lock; incl %0" : "+m" (futex_nwaiting) : : "cc");
+	sched_sleep(e);
+	spin_unlock(&b->lock);
+	return 0;
+}
+
+// Wake up to n environments waiting on key, oldest first.
+// Returns the number woken.
+int
+futex_wake(physaddr_t key, int n)
+{
+	struct futex_bucket *b = futex_bucket(key);
+	int woken;
+
+	spin_lock(&b->lock);
+	woken = futex_wake_locked(b, key, ~0, n);
+	spin_unlock(&b->lock);
+	return woken;
+}
+
+// Wake everyone waiting on a word in the page at pa.  Called when a
+// mapping of the page goes away: user code such as pipes judges whether
+// its peers are still there by page reference counts.
+void
+futex_wake_page(physaddr_t pa)
+{
+	struct futex_bucket *b = futex_bucket(pa);
+
+	spin_lock(&b->lock);
+	futex_wake_locked(b, pa, ~(physaddr_t) (PGSIZE - 1), NENV);
+	spin_unlock(&b->lock);
+}
+
+// Wake every waiter whose deadline is now or earlier.  Called on each
+// timer tick.
+void
+futex_expire(nanoseconds_t now)
+{
+	struct futex_bucket *b;
+	struct Env **pe, *e;
+	nanoseconds_t deadline;
+
+	if (!futex_ntimed)
+		return;
+	for (b = futex_buckets; b < futex_buckets + NFUTEXBUCKET; b++) {
+		spin_lock(&b->lock);
+		pe = &b->head;
+		while ((e = *pe)) {
+			deadline = futex_deadlines[ENVX(e->env_id)];
+			if (!deadline || deadline > now) {
+				pe = &futex_next[ENVX(e->env_id)];
+				continue;
+			}
+			// As in futex_wake_locked, wake before unlinking.
+			sched_wakeup(e);
+			futex_unlink(pe, e);
+		}
+		spin_unlock(&b->lock);
+	}
+}
+
+// Take e off the bucket it waits on, if any; env_free does this before
+// e can go away.
+void
+futex_cancel(struct Env *e)
+{
+	struct futex_bucket *b;
+	struct Env **pe;
+	physaddr_t key;
+
+	// Only e itself and env_free enqueue or cancel e, and never at
+	// once, so the key cannot be set under us.  A wakeup clears it
+	// only once it is done with e (see futex_wake_locked); if it
+	// clears it while we wait for the lock, the walk below copes.
+	if (!(key = futex_keys[ENVX(e->env_id)]))
+		return;
+	b = futex_bucket(key);
+	spin_lock(&b->lock);
+	for (pe = &b->head; *pe; pe = &futex_next[ENVX((*pe)->env_id)])
+		if (*pe == e) {
+			futex_unlink(pe, e);
+			break;
+		}
+	spin_unlock(&b->lock);
+}
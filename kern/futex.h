@@ -0,0 +1,22 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+#include <inc/time.h>
+#include <inc/types.h>
+
+// Number of environments asleep in futex_wait, so that page_decref
+// can skip futex_wake_page when there are none.
+extern volatile uint32_t futex_nwaiting;
+
+int	futex_wait(struct Env *e, physaddr_t key, uint32_t expected,
+		   nanoseconds_t deadline);
+int	futex_wake(physaddr_t key, int n);
+void	futex_wake_page(physaddr_t pa);
+void	futex_expire(nanoseconds_t now);
+void	futex_cancel(struct Env *e);
+
+#endif	// !JOS_KERN_FUTEX_H
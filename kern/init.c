@@ -20,6 +20,10 @@
 
 static void boot_aps(void);
 
+// Set once the BSP has created the initial environments; APs wait for
+// it before entering the scheduler.
+static volatile uint32_t sched_started;
+
 
 void
 i386_init(uint32_t magic, uint32_t addr)
@@ -51,6 +55,7 @@ i386_init(uint32_t magic, uint32_t addr)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
 	// Lab 4 multiprocessor initialization functions
@@ -69,9 +74,6 @@ i386_init(uint32_t magic, uint32_t addr)
 	// Lab 5 hardware initialization functions
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
 	// Starting non-boot CPUs
 	boot_aps();
 
@@ -90,6 +92,9 @@ i386_init(uint32_t magic, uint32_t addr)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Let the APs into the scheduler now that there is work.
+	xchg(&sched_started, 1);
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -144,8 +149,10 @@ mp_main(void)
 	// to start running processes on this CPU.  But make sure that
 	// only one CPU can enter the scheduler at a time!
 	//
-	// Your code here:
-	lock_kernel();
+	// The scheduler locks for itself, but wait until the BSP has
+	// created the initial environments.
+	while (!sched_started)
+		asm volatile("pause");
 	sched_yield();
 	// Remove this after you finish Exercise 4
 }
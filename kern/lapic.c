@@ -195,3 +195,13 @@ lapic_ipi(int vector)
 	while (lapic_read(ICRLO) & DELIVS)
 		;
 }
+
+// The message a PCI device writes to deliver 'vector' to the CPU
+// whose local APIC is 'apicid': fixed delivery, edge triggered.
+// See section 10.11 of IA32 volume 3A.
+void
+lapic_msi(uint8_t apicid, int vector, uint32_t *addr, uint32_t *data)
+{
+	*addr = 0xFEE00000 | (apicid << 12);
+	*data = vector;
+}
@@ -1,21 +1,80 @@
 #include <inc/assert.h>
 #include <inc/error.h>
 #include <inc/string.h>
+#include <inc/x86.h>
 
+#include <kern/cpu.h>
 #include <kern/env.h>
 #include <kern/nvme.h>
 #include <kern/nvmereg.h>
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 // queue sizes
 #define ADMINQ_SIZE	8
-#define IOQ_SIZE	8
+#define IOQ_MAXSIZE	256	// capped further by CAP.MQES
+
+// Most pages one command transfers, capped further by MDTS.  Each
+// command slot has a PRP list this long.
+#define NVME_MAXPAGES	BLK_MAXIOV
+
+// Command slots per I/O queue that asynchronous commands cannot take,
+// so that nvme_rw on any CPU sharing the queue always gets one.
+#define IOQ_SYNC_RESERVE	NCPU
+
+// How nvme_read and nvme_write wait for their command: spin on the
+// CQ, sleep until the completion interrupt, or spin for a while and
+// then sleep.  Chosen at boot with make NVME_WAIT=poll|irq|hybrid;
+// without MSI-X there are no interrupts and every mode polls.
+#ifndef NVME_WAIT
+#define NVME_WAIT	"hybrid"
+#endif
+enum {
+	NVME_WAIT_POLL = 0,
+	NVME_WAIT_IRQ,
+	NVME_WAIT_HYBRID
+};
+static int nvme_wait;
+
+// How long NVME_WAIT_HYBRID spins before sleeping, in TSC cycles:
+// about as long as a trip through the scheduler and back.
+#define NVME_SPIN_CYCLES	20000
+
+// An I/O command slot, indexed by command identifier.
+struct nvme_cmd {
+	uint8_t state;		// NVME_CMD_*
+	uint8_t collect;	// NVME_COLLECT_*
+	envid_t envid;		// submitter
+	struct PageInfo *pp;	// first buffer page; the rest are in the
+				// slot's PRP list.  All are held until
+				// the slot is freed.
+	int16_t next;		// next free or done slot, or -1
+	uint16_t npages;
+	uint16_t nsecs;
+	uint16_t flags;		// completion status
+};
+
+enum {
+	NVME_CMD_FREE = 0,
+	NVME_CMD_BUSY,
+	NVME_CMD_DONE
+};
 
+// How the submitter picks up a finished command.
+enum {
+	NVME_COLLECT_REAP = 0,	// nvme_reap, later
+	NVME_COLLECT_POLL,	// nvme_rw, spinning on the slot
+	NVME_COLLECT_WAKE	// the harvester, waking the sleeping submitter
+};
+
+// Lock order: a queue's lock, then an environment's lock.
 struct nvme_queue {
 	uint16_t id;
 	size_t size;
+	struct spinlock lock;	// serializes submitters on different CPUs
 
 	// submission queue
 	void *sq_va;
@@ -27,41 +86,52 @@ struct nvme_queue {
 	volatile void *cq_hdbl;
 	uint32_t cq_head;
 	uint16_t cq_phase;
+
+	// I/O queues only
+	struct nvme_cmd *cmds;
+	uint64_t (*prps)[NVME_MAXPAGES];	// PRP list of each slot
+	int16_t free;		// list of free command slots
+	int nfree;
+	int16_t done;		// async commands completed but not reaped
 };
 
 // queues
-static struct nvme_queue adminq, ioq;
+static struct nvme_queue adminq, ioqs[NCPU];
+static int nioq;
+static int nvme_maxpages;
+
+// Queue memory.  An I/O submission queue spans several pages, so it
+// must come from the kernel image, which is physically contiguous.
+static struct nvme_sqe adminq_sq[ADMINQ_SIZE] __attribute__((aligned(PGSIZE)));
+static struct nvme_cqe adminq_cq[ADMINQ_SIZE] __attribute__((aligned(PGSIZE)));
+static struct nvme_sqe ioq_sq[NCPU][IOQ_MAXSIZE] __attribute__((aligned(PGSIZE)));
+static struct nvme_cqe ioq_cq[NCPU][IOQ_MAXSIZE] __attribute__((aligned(PGSIZE)));
+static struct nvme_cmd ioq_cmds[NCPU][IOQ_MAXSIZE];
+static uint64_t ioq_prps[NCPU][IOQ_MAXSIZE][NVME_MAXPAGES] __attribute__((aligned(PGSIZE)));
 
 static void
-nvme_queue_init(struct nvme_queue *q, volatile void *base, uint16_t id, size_t size, size_t dstrd)
+nvme_queue_init(struct nvme_queue *q, volatile void *base, uint16_t id, size_t size, size_t dstrd,
+		void *sq_va, void *cq_va)
 {
-	struct PageInfo *p;
-
 	memset(q, 0, sizeof(*q));
+	spin_initlock(&q->lock);
 	q->id = id;
 	q->size = size;
 
-	p = page_alloc(ALLOC_ZERO);
-	assert(p);
-	p->pp_ref++;
-	q->sq_va = page2kva(p);
+	q->sq_va = sq_va;
 	q->sq_tdbl = base + NVME_SQTDBL(id, dstrd);
 
-	p = page_alloc(ALLOC_ZERO);
-	assert(p);
-	p->pp_ref++;
-	q->cq_va = page2kva(p);
+	q->cq_va = cq_va;
 	q->cq_hdbl = base + NVME_CQHDBL(id, dstrd);
 }
 
-static int
-nvme_queue_submit(struct nvme_queue *q, void *cmd)
+// Hand cmd to the controller.  Caller holds q's lock.
+static void
+nvme_queue_push(struct nvme_queue *q, void *cmd)
 {
 	struct nvme_sqe *sqe = q->sq_va;
-	volatile struct nvme_cqe *cqe = q->cq_va;
 
 	sqe += q->sq_tail;
-	cqe += q->cq_head;
 
 	// Copy to SQ
 	memcpy(sqe, cmd, sizeof(struct nvme_sqe));
@@ -73,11 +143,19 @@ nvme_queue_submit(struct nvme_queue *q, void *cmd)
 
 	// Ring the SQ doorbell
 	mmio_write32(q->sq_tdbl, q->sq_tail);
+}
 
-	// Wait for CQ
-	while ((cqe->flags & NVME_CQE_PHASE) == q->cq_phase)
-		;
-	assert(NVME_CQE_SC(cqe->flags) == NVME_CQE_SC_SUCCESS);
+// Take the next completion off q's CQ, if there is one, and return
+// it.  The entry stays valid until the CQ doorbell is rung.  Caller
+// holds q's lock.
+static volatile struct nvme_cqe *
+nvme_queue_pop(struct nvme_queue *q)
+{
+	volatile struct nvme_cqe *cqe = q->cq_va;
+
+	cqe += q->cq_head;
+	if ((cqe->flags & NVME_CQE_PHASE) == q->cq_phase)
+		return NULL;
 
 	// Bump the CQ head pointer
 	++q->cq_head;
@@ -85,22 +163,130 @@ nvme_queue_submit(struct nvme_queue *q, void *cmd)
 		q->cq_head = 0;
 		q->cq_phase ^= NVME_CQE_PHASE;
 	}
+	return cqe;
+}
+
+// Run an admin command to completion, and return the completion's
+// dword 0 in *cdw0 if cdw0 is not NULL.
+static int
+nvme_admin(void *cmd, uint32_t *cdw0)
+{
+	struct nvme_queue *q = &adminq;
+	volatile struct nvme_cqe *cqe;
+	int r = 0;
 
+	spin_lock(&q->lock);
+	nvme_queue_push(q, cmd);
+	// Wait for CQ
+	while (!(cqe = nvme_queue_pop(q)))
+		;
+	if (NVME_CQE_SC(cqe->flags) != NVME_CQE_SC_SUCCESS)
+		r = -E_INVAL;
+	if (cdw0)
+		*cdw0 = cqe->cdw0;
 	// Ring the CQ doorbell
 	mmio_write32(q->cq_hdbl, q->cq_head);
+	spin_unlock(&q->lock);
+	return r;
+}
 
-	return 0;
+// Free command slot cid.  Caller holds q's lock.
+static void
+nvme_cmd_free(struct nvme_queue *q, int cid)
+{
+	struct nvme_cmd *cmd = &q->cmds[cid];
+	int i;
+
+	if (cmd->pp)
+		page_decref(cmd->pp);
+	for (i = 0; i + 1 < cmd->npages; i++)
+		page_decref(pa2page(q->prps[cid][i]));
+	cmd->pp = NULL;
+	cmd->npages = 0;
+	cmd->state = NVME_CMD_FREE;
+	cmd->next = q->free;
+	q->free = cid;
+	q->nfree++;
 }
 
+// Is the env that submitted cmd gone?  Then nobody will collect it.
+static bool
+nvme_cmd_orphaned(struct nvme_cmd *cmd)
+{
+	return envs[ENVX(cmd->envid)].env_id != cmd->envid;
+}
+
+// The result of a finished command: the number of sectors
+// transferred, or < 0 on a device error.
+static int
+nvme_result(struct nvme_cmd *cmd)
+{
+	if (NVME_CQE_SC(cmd->flags) != NVME_CQE_SC_SUCCESS ||
+	    NVME_CQE_SCT(cmd->flags) != NVME_CQE_SCT_GENERIC)
+		return -E_UNSPECIFIED;
+	return cmd->nsecs;
+}
+
+// Hand finished command cid's result to its sleeping submitter as the
+// return value of its system call, and wake it.  Caller holds q's
+// lock.
 static void
-nvme_queue_create(struct nvme_queue *q)
+nvme_cmd_wake(struct nvme_queue *q, int cid)
+{
+	struct nvme_cmd *cmd = &q->cmds[cid];
+	struct Env *e = &envs[ENVX(cmd->envid)];
+
+	// The lock keeps e from being destroyed and reused meanwhile.
+	env_lock(e);
+	if (e->env_id == cmd->envid) {
+		e->env_tf.tf_regs.reg_eax = nvme_result(cmd);
+		sched_wakeup(e);
+	}
+	env_unlock(e);
+	nvme_cmd_free(q, cid);
+}
+
+// Move every completion on q's CQ to its command slot, and wake any
+// submitters sleeping on them.  Caller holds q's lock.
+static void
+nvme_queue_harvest(struct nvme_queue *q)
+{
+	volatile struct nvme_cqe *cqe;
+	struct nvme_cmd *cmd;
+	bool popped = 0;
+
+	while ((cqe = nvme_queue_pop(q))) {
+		popped = 1;
+		cmd = &q->cmds[cqe->cid];
+		cmd->flags = cqe->flags;
+		if (nvme_cmd_orphaned(cmd)) {
+			nvme_cmd_free(q, cqe->cid);
+			continue;
+		}
+		cmd->state = NVME_CMD_DONE;
+		if (cmd->collect == NVME_COLLECT_REAP) {
+			cmd->next = q->done;
+			q->done = cqe->cid;
+		} else if (cmd->collect == NVME_COLLECT_WAKE)
+			nvme_cmd_wake(q, cqe->cid);
+	}
+	// Ring the CQ doorbell
+	if (popped)
+		mmio_write32(q->cq_hdbl, q->cq_head);
+}
+
+// Create q on the controller.  If 'intr' is set, completions raise
+// MSI-X entry q->id.
+static void
+nvme_queue_create(struct nvme_queue *q, bool intr)
 {
 	struct nvme_sqe_q cmd_add_iocq = {
 		.opcode = NVM_ADMIN_ADD_IOCQ,
 		.prp1 = PADDR(q->cq_va),
 		.qsize = q->size - 1,
 		.qid = q->id,
-		.qflags = NVM_SQE_Q_PC,
+		.qflags = NVM_SQE_Q_PC | (intr ? NVM_SQE_CQ_IEN : 0),
+		.cqid = intr ? q->id : 0,
 	};
 	struct nvme_sqe_q cmd_add_iosq = {
 		.opcode = NVM_ADMIN_ADD_IOSQ,
@@ -113,9 +299,11 @@ nvme_queue_create(struct nvme_queue *q)
 
 	static_assert(sizeof(struct nvme_sqe_q) == sizeof(struct nvme_sqe));
 	// Create CQ
-	nvme_queue_submit(&adminq, &cmd_add_iocq);
+	if (nvme_admin(&cmd_add_iocq, NULL) < 0)
+		panic("nvme: cannot create I/O CQ %d", q->id);
 	// Create SQ
-	nvme_queue_submit(&adminq, &cmd_add_iosq);
+	if (nvme_admin(&cmd_add_iosq, NULL) < 0)
+		panic("nvme: cannot create I/O SQ %d", q->id);
 }
 
 int
@@ -139,7 +327,8 @@ nvme_attach(struct pci_func *pcif)
 	cc = mmio_read32(base + NVME_CC);
 	assert(!ISSET(cc, NVME_CC_EN));
 
-	nvme_queue_init(&adminq, base, NVME_ADMIN_Q, ADMINQ_SIZE, dstrd);
+	nvme_queue_init(&adminq, base, NVME_ADMIN_Q, ADMINQ_SIZE, dstrd,
+			adminq_sq, adminq_cq);
 	// Set admin queue sizes
 	mmio_write32(base + NVME_AQA, NVME_AQA_ACQS(ADMINQ_SIZE) | NVME_AQA_ASQS(ADMINQ_SIZE));
 	// Set admin queue addresses
@@ -160,56 +349,365 @@ nvme_attach(struct pci_func *pcif)
 	while (!ISSET(mmio_read32(base + NVME_CSTS), NVME_CSTS_RDY))
 		;
 
+	// Ask for one I/O queue pair per CPU, and size them to what the
+	// controller allows.
+	struct nvme_sqe cmd_nq = {
+		.opcode = NVM_ADMIN_SET_FEATURES,
+		.cdw10 = NVM_FEAT_NUMBER_OF_QUEUES,
+		.cdw11 = NVM_FEAT_NQ(ncpu, ncpu),
+	};
+	uint32_t nq;
+	size_t qsize;
+	int i, cid;
+
+	nioq = ncpu;
+	if (nvme_admin(&cmd_nq, &nq) == 0)
+		nioq = MIN(nioq, MIN(NVM_FEAT_NQ_NSQA(nq), NVM_FEAT_NQ_NCQA(nq)));
+	qsize = MIN(NVME_CAP_MQES(cap), IOQ_MAXSIZE);
+
+	// The largest transfer: MDTS is a power of two in units of the
+	// minimum page size, or 0 for no limit.
+	struct PageInfo *idpp = page_alloc(ALLOC_ZERO);
+	struct nvme_sqe cmd_id = {
+		.opcode = NVM_ADMIN_IDENTIFY,
+		.cdw10 = NVM_IDENTIFY_CNS_CONTROLLER,
+	};
+	uint8_t mdts;
+
+	assert(idpp);
+	cmd_id.entry.prp[0] = page2pa(idpp);
+	nvme_maxpages = NVME_MAXPAGES;
+	if (nvme_admin(&cmd_id, NULL) == 0 &&
+	    (mdts = ((struct nvm_identify_controller *) page2kva(idpp))->mdts))
+		nvme_maxpages = MIN(nvme_maxpages,
+			(1 << mdts) << (NVME_CAP_MPSMIN(cap) - PGSHIFT));
+	page_free(idpp);
+
+	// Completion interrupts need an MSI-X entry per I/O queue, after
+	// entry 0 for the admin queue, which we leave masked.
+	if (strcmp(NVME_WAIT, "irq") == 0)
+		nvme_wait = NVME_WAIT_IRQ;
+	else if (strcmp(NVME_WAIT, "hybrid") == 0)
+		nvme_wait = NVME_WAIT_HYBRID;
+	else
+		nvme_wait = NVME_WAIT_POLL;
+	if (nvme_wait != NVME_WAIT_POLL && pci_msix_enable(pcif) <= nioq)
+		nvme_wait = NVME_WAIT_POLL;
+
 	// Create I/O queues
-	nvme_queue_init(&ioq, base, 1, IOQ_SIZE, dstrd);
-	nvme_queue_create(&ioq);
+	for (i = 0; i < nioq; i++) {
+		struct nvme_queue *q = &ioqs[i];
+
+		nvme_queue_init(q, base, 1 + i, qsize, dstrd, ioq_sq[i], ioq_cq[i]);
+		// One SQ slot always stays empty, so at most size - 1
+		// commands are in flight.
+		q->cmds = ioq_cmds[i];
+		q->prps = ioq_prps[i];
+		q->free = q->done = -1;
+		q->nfree = 0;
+		for (cid = qsize - 2; cid >= 0; cid--)
+			nvme_cmd_free(q, cid);
+		// Queue i serves CPU i, so interrupt CPU i.
+		if (nvme_wait != NVME_WAIT_POLL)
+			pci_msix_route(pcif, q->id, i, IRQ_OFFSET + IRQ_NVME + i);
+		nvme_queue_create(q, nvme_wait != NVME_WAIT_POLL);
+	}
+	cprintf("nvme: %d I/O queues of %d entries, %d KB transfers, %s completions\n",
+		nioq, qsize, nvme_maxpages * PGSIZE / 1024,
+		nvme_wait == NVME_WAIT_IRQ ? "interrupt" :
+		nvme_wait == NVME_WAIT_HYBRID ? "hybrid" : "polled");
 	return 1;
 }
 
-static physaddr_t
-va2pa(void *va)
+// The I/O queue for this CPU.
+static struct nvme_queue *
+nvme_ioq(void)
 {
-	struct PageInfo *pp;
+	return &ioqs[cpunum() % nioq];
+}
 
-	pp = page_lookup(curenv->env_pgdir, va, NULL);
-	assert(pp);
-	return page2pa(pp) + PGOFF(va);
+// Hold the n page-aligned pages bufs[0..n-1] of curenv in pps, so
+// that they outlive the command even if curenv does not.  Returns
+// -E_INVAL if a buffer is not page-aligned, or -E_FAULT unless every
+// one is mapped with at least perm.
+static int
+nvme_pin(void *const *bufs, int n, int perm, struct PageInfo **pps)
+{
+	pte_t *pte;
+	int i, r = 0;
+
+	// As in sys_page_map, look the pages up under our own lock, and
+	// unshare their tables first if PTE_W is to mean anything.
+	env_lock(curenv);
+	for (i = 0; i < n; i++) {
+		if (PGOFF(bufs[i])) {
+			r = -E_INVAL;
+			break;
+		}
+		if ((perm & PTE_W) &&
+		    (r = pgdir_unshare(curenv->env_pgdir, bufs[i])) < 0)
+			break;
+		if (bufs[i] >= (void *) UTOP ||
+		    !(pps[i] = page_lookup(curenv->env_pgdir, bufs[i], &pte)) ||
+		    (*pte & perm) != perm) {
+			r = -E_FAULT;
+			break;
+		}
+		page_incref(pps[i]);
+	}
+	env_unlock(curenv);
+	if (i == n)
+		return 0;
+	while (--i >= 0)
+		page_decref(pps[i]);
+	return r;
 }
 
+// Start an I/O command for curenv on queue q, to be collected as
+// 'collect' says, and return its command identifier.  The slot owns
+// the references to the npages pages in pps.  A NVME_COLLECT_WAKE
+// submitter is put to sleep before the command can complete.
 static int
-nvme_rw(uint8_t opcode, uint64_t secno, void *buf, uint16_t nsecs)
+nvme_start(struct nvme_queue *q, uint8_t opcode, uint64_t secno,
+	   struct PageInfo **pps, int npages, uint16_t nsecs, int collect)
 {
-	struct PageInfo *pp;
 	struct nvme_sqe_io cmd = {
 		.opcode = opcode,
 		.nsid = 1,
 		.slba = secno,
 		.nlb = nsecs - 1,
-		.entry.prp[0] = va2pa(buf),
+		.entry.prp[0] = page2pa(pps[0]),
 	};
+	int i, cid;
 
 	static_assert(sizeof(struct nvme_sqe_io) == sizeof(struct nvme_sqe));
-	if (!ioq.sq_va)
-		return -E_INVAL;
-	// buf must be page aligned
-	if (PGOFF(buf))
+	spin_lock(&q->lock);
+	if ((cid = q->free) < 0 ||
+	    (collect == NVME_COLLECT_REAP && q->nfree <= IOQ_SYNC_RESERVE)) {
+		spin_unlock(&q->lock);
+		return -E_NO_MEM;
+	}
+	q->free = q->cmds[cid].next;
+	q->nfree--;
+	q->cmds[cid].state = NVME_CMD_BUSY;
+	q->cmds[cid].collect = collect;
+	q->cmds[cid].envid = curenv->env_id;
+	q->cmds[cid].pp = pps[0];
+	q->cmds[cid].npages = npages;
+	q->cmds[cid].nsecs = nsecs;
+	// PRP entry 2 is the second page itself, or a list of all the
+	// pages after the first.
+	for (i = 1; i < npages; i++)
+		q->prps[cid][i - 1] = page2pa(pps[i]);
+	if (npages == 2)
+		cmd.entry.prp[1] = q->prps[cid][0];
+	else if (npages > 2)
+		cmd.entry.prp[1] = PADDR(q->prps[cid]);
+	cmd.cid = cid;
+	if (collect == NVME_COLLECT_WAKE)
+		sched_sleep(curenv);
+	nvme_queue_push(q, &cmd);
+	spin_unlock(&q->lock);
+	return cid;
+}
+
+// Read or write nsecs sectors at secno, scattered over the page-
+// aligned buffers bufs[0..], on behalf of curenv's system call.
+// Every buffer is a whole page except perhaps the last.  Unless
+// polling, curenv may sleep until the completion interrupt; then this
+// does not return, and the harvester hands the result to curenv.
+static int
+nvme_rw(uint8_t opcode, uint64_t secno, void *const *bufs, uint16_t nsecs)
+{
+	struct PageInfo *pps[NVME_MAXPAGES];
+	struct nvme_queue *q;
+	uint64_t start;
+	int npages, cid, r;
+
+	if (!nioq)
 		return -E_INVAL;
-	// support one page for now
-	if (nsecs > BLKSECTS)
+	npages = ROUNDUP(nsecs, BLKSECTS) / BLKSECTS;
+	if (npages == 0 || npages > nvme_maxpages)
 		return -E_INVAL;
+	// The device writes the buffers on a read, so they must be
+	// writable.
+	r = nvme_pin(bufs, npages, PTE_U | (opcode == NVM_CMD_READ ? PTE_W : 0), pps);
+	if (r < 0)
+		return r;
+
+	// Slots are held back from asynchronous commands, but not from
+	// other synchronous ones: sleepers hold theirs until their
+	// completion is harvested.  Harvest while we wait, since that
+	// completion's interrupt may be aimed at this CPU, which has
+	// interrupts off.
+	q = nvme_ioq();
+	while ((cid = nvme_start(q, opcode, secno, pps, npages, nsecs,
+				 nvme_wait == NVME_WAIT_IRQ ? NVME_COLLECT_WAKE :
+				 NVME_COLLECT_POLL)) < 0) {
+		spin_lock(&q->lock);
+		nvme_queue_harvest(q);
+		spin_unlock(&q->lock);
+	}
+	if (nvme_wait == NVME_WAIT_IRQ)
+		sched_yield();
+
+	// Other commands may be in flight on our queue; wait for ours,
+	// letting others in between polls.  In hybrid mode, give up
+	// after a while and sleep like NVME_WAIT_IRQ.
+	start = read_tsc();
+	while (1) {
+		spin_lock(&q->lock);
+		nvme_queue_harvest(q);
+		if (q->cmds[cid].state == NVME_CMD_DONE)
+			break;
+		if (nvme_wait == NVME_WAIT_HYBRID &&
+		    read_tsc() - start > NVME_SPIN_CYCLES) {
+			q->cmds[cid].collect = NVME_COLLECT_WAKE;
+			sched_sleep(curenv);
+			spin_unlock(&q->lock);
+			sched_yield();
+		}
+		spin_unlock(&q->lock);
+	}
+	r = nvme_result(&q->cmds[cid]);
+	nvme_cmd_free(q, cid);
+	spin_unlock(&q->lock);
+	return r;
+}
+
+// Split the buffer at buf into its pages.  Returns how many there
+// are, or 0 if that is more than one command can take.
+static int
+nvme_pages(void *buf, uint16_t nsecs, void **bufs)
+{
+	int i, npages;
 
-	nvme_queue_submit(&ioq, &cmd);
-	return nsecs;
+	npages = ROUNDUP(nsecs, BLKSECTS) / BLKSECTS;
+	if (npages > nvme_maxpages)
+		return 0;
+	for (i = 0; i < npages; i++)
+		bufs[i] = buf + i * PGSIZE;
+	return npages;
 }
 
 int
 nvme_read(uint64_t secno, void *buf, uint16_t nsecs)
 {
-	return nvme_rw(NVM_CMD_READ, secno, buf, nsecs);
+	void *bufs[NVME_MAXPAGES];
+
+	if (!nvme_pages(buf, nsecs, bufs))
+		return -E_INVAL;
+	return nvme_rw(NVM_CMD_READ, secno, bufs, nsecs);
 }
 
 int
 nvme_write(uint64_t secno, void *buf, uint16_t nsecs)
 {
-	return nvme_rw(NVM_CMD_WRITE, secno, buf, nsecs);
+	void *bufs[NVME_MAXPAGES];
+
+	if (!nvme_pages(buf, nsecs, bufs))
+		return -E_INVAL;
+	return nvme_rw(NVM_CMD_WRITE, secno, bufs, nsecs);
+}
+
+// Read nbufs blocks starting at sector secno into the pages bufs[],
+// which need not be contiguous, in one command.
+int
+nvme_readv(uint64_t secno, void *const *bufs, int nbufs)
+{
+	if (nbufs <= 0 || nbufs > nvme_maxpages)
+		return -E_INVAL;
+	return nvme_rw(NVM_CMD_READ, secno, bufs, nbufs * BLKSECTS);
+}
+
+// Write the pages bufs[] to nbufs blocks starting at sector secno in
+// one command.
+int
+nvme_writev(uint64_t secno, void *const *bufs, int nbufs)
+{
+	if (nbufs <= 0 || nbufs > nvme_maxpages)
+		return -E_INVAL;
+	return nvme_rw(NVM_CMD_WRITE, secno, bufs, nbufs * BLKSECTS);
+}
+
+// Start reading (or writing, if 'write' is set) nsecs sectors at
+// secno into the page-aligned buffer buf in curenv, without waiting
+// for the command to finish.  The buffer pages are held until the
+// command is reaped with nvme_reap.  Returns a tag for the command,
+// or < 0 on error:
+//	-E_INVAL if there is no disk, or buf is not page-aligned, or
+//		nsecs is 0 or more than one command can transfer.
+//	-E_FAULT if buf is not mapped, or is read-only for a read.
+//	-E_NO_MEM if this CPU's queue has no free command slot; reap
+//		some commands and try again.
+int
+nvme_submit(bool write, uint64_t secno, void *buf, uint16_t nsecs)
+{
+	struct PageInfo *pps[NVME_MAXPAGES];
+	void *bufs[NVME_MAXPAGES];
+	struct nvme_queue *q;
+	int i, npages, cid;
+
+	if (!nioq || nsecs == 0 || !(npages = nvme_pages(buf, nsecs, bufs)))
+		return -E_INVAL;
+	if ((cid = nvme_pin(bufs, npages, PTE_U | (write ? 0 : PTE_W), pps)) < 0)
+		return cid;
+
+	q = nvme_ioq();
+	if ((cid = nvme_start(q, write ? NVM_CMD_WRITE : NVM_CMD_READ, secno,
+			      pps, npages, nsecs, NVME_COLLECT_REAP)) < 0) {
+		for (i = 0; i < npages; i++)
+			page_decref(pps[i]);
+		return cid;
+	}
+	return (q - ioqs) * IOQ_MAXSIZE + cid;
+}
+
+// Collect up to max of curenv's finished asynchronous commands into
+// done, and return how many there were.  Never waits.
+int
+nvme_reap(struct blk_done *done, int max)
+{
+	struct nvme_queue *q;
+	struct nvme_cmd *cmd;
+	int16_t *pcid;
+	int i, cid, n = 0;
+
+	for (i = 0; i < nioq && n < max; i++) {
+		q = &ioqs[i];
+		spin_lock(&q->lock);
+		nvme_queue_harvest(q);
+		pcid = &q->done;
+		while ((cid = *pcid) >= 0 && n < max) {
+			cmd = &q->cmds[cid];
+			if (cmd->envid != curenv->env_id && !nvme_cmd_orphaned(cmd)) {
+				pcid = &cmd->next;
+				continue;
+			}
+			*pcid = cmd->next;
+			if (cmd->envid == curenv->env_id) {
+				done[n].tag = i * IOQ_MAXSIZE + cid;
+				done[n].result = nvme_result(cmd);
+				n++;
+			}
+			nvme_cmd_free(q, cid);
+		}
+		spin_unlock(&q->lock);
+	}
+	return n;
+}
+
+// Completion interrupt for I/O queue i: collect its finished commands
+// and wake their sleeping submitters.
+void
+nvme_intr(int i)
+{
+	struct nvme_queue *q;
+
+	if (i >= nioq)
+		return;
+	q = &ioqs[i];
+	spin_lock(&q->lock);
+	nvme_queue_harvest(q);
+	spin_unlock(&q->lock);
 }
@@ -7,5 +7,10 @@
 int nvme_attach(struct pci_func *pcif);
 int nvme_write(uint64_t secno, void *buf, uint16_t nsecs);
 int nvme_read(uint64_t secno, void *buf, uint16_t nsecs);
+int nvme_readv(uint64_t secno, void *const *bufs, int nbufs);
+int nvme_writev(uint64_t secno, void *const *bufs, int nbufs);
+int nvme_submit(bool write, uint64_t secno, void *buf, uint16_t nsecs);
+int nvme_reap(struct blk_done *done, int max);
+void nvme_intr(int i);
 
 #endif	// JOS_KERN_NVME_H
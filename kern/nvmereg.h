@@ -266,6 +266,7 @@ struct nvme_cqe {
 #define NVM_ADMIN_DEL_IOCQ	0x04 /* Delete I/O Completion Queue */
 #define NVM_ADMIN_ADD_IOCQ	0x05 /* Create I/O Completion Queue */
 #define NVM_ADMIN_IDENTIFY	0x06 /* Identify */
+#define  NVM_IDENTIFY_CNS_CONTROLLER	0x01 /* Identify cdw10: controller */
 #define NVM_ADMIN_ABORT		0x08 /* Abort */
 #define NVM_ADMIN_SET_FEATURES	0x09 /* Set Features */
 #define NVM_ADMIN_GET_FEATURES	0x0a /* Get Features */
@@ -273,6 +274,12 @@ struct nvme_cqe {
 #define NVM_ADMIN_FW_COMMIT	0x10 /* Firmware Commit */
 #define NVM_ADMIN_FW_DOWNLOAD	0x11 /* Firmware Image Download */
 
+/* Feature Identifiers (Set/Get Features cdw10) */
+#define NVM_FEAT_NUMBER_OF_QUEUES	0x07
+#define  NVM_FEAT_NQ(_nsq, _ncq)	(((_nsq) - 1) | (((_ncq) - 1) << 16))
+#define  NVM_FEAT_NQ_NSQA(_r)		(((_r) & 0xffff) + 1)
+#define  NVM_FEAT_NQ_NCQA(_r)		((((_r) >> 16) & 0xffff) + 1)
+
 #define NVM_CMD_FLUSH		0x00 /* Flush */
 #define NVM_CMD_WRITE		0x01 /* Write */
 #define NVM_CMD_READ		0x02 /* Read */
@@ -1,7 +1,9 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
+#include <kern/cpu.h>
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/pmap.h>
@@ -231,6 +233,77 @@ pci_func_enable(struct pci_func *f)
 		PCI_VENDOR(f->dev_id), PCI_PRODUCT(f->dev_id));
 }
 
+// Return the configuration space offset of f's capability 'id', or
+// 0 if f does not have one.
+int
+pci_find_cap(struct pci_func *f, uint8_t id)
+{
+	uint32_t off, cap;
+	int n;
+
+	if (!(pci_conf_read(f, PCI_COMMAND_STATUS_REG) & PCI_STATUS_CAPLIST_SUPPORT))
+		return 0;
+	off = PCI_CAPLIST_PTR(pci_conf_read(f, PCI_CAPLISTPTR_REG));
+	// Bound the walk in case the list is corrupt and loops.
+	for (n = 0; off && n < 48; n++) {
+		off &= ~3;
+		cap = pci_conf_read(f, off);
+		if (PCI_CAPLIST_CAP(cap) == id)
+			return off;
+		off = PCI_CAPLIST_NEXT(cap);
+	}
+	return 0;
+}
+
+// Map f's MSI-X vector table, mask every entry, and switch f from
+// legacy interrupts to MSI-X.  Entries stay masked until routed with
+// pci_msix_route.  Returns the number of entries, or < 0 if f has no
+// MSI-X capability.
+int
+pci_msix_enable(struct pci_func *f)
+{
+	uint32_t cap, ctl, tbl, bir, i;
+	physaddr_t pa;
+
+	if (!(cap = pci_find_cap(f, PCI_CAP_MSIX)))
+		return -E_NOT_SUPP;
+	ctl = pci_conf_read(f, cap + PCI_MSIX_CTL);
+	tbl = pci_conf_read(f, cap + PCI_MSIX_TBLOFFSET);
+	bir = tbl & PCI_MSIX_TBLBIR_MASK;
+	if (bir >= 6 || !f->reg_base[bir])
+		return -E_NOT_SUPP;
+
+	f->msix_nvec = PCI_MSIX_CTL_TBLSIZE(ctl);
+	pa = f->reg_base[bir] + (tbl & PCI_MSIX_TBLOFFSET_MASK);
+	f->msix_table = mmio_map_region(ROUNDDOWN(pa, PGSIZE),
+		PGOFF(pa) + f->msix_nvec * PCI_MSIX_TABLE_ENTRY_SIZE);
+	f->msix_table += PGOFF(pa) / 4;
+
+	for (i = 0; i < f->msix_nvec; i++)
+		f->msix_table[(i * PCI_MSIX_TABLE_ENTRY_SIZE + PCI_MSIX_TABLE_ENTRY_VECTCTL) / 4] =
+			PCI_MSIX_VECTCTL_HWMASK_MASK;
+	pci_conf_write(f, cap + PCI_MSIX_CTL,
+		       (ctl & ~PCI_MSIX_CTL_FUNCMASK) | PCI_MSIX_CTL_ENABLE);
+	return f->msix_nvec;
+}
+
+// Deliver MSI-X table entry 'entry' of f as interrupt 'vector' on
+// CPU 'cpu', and unmask it.
+void
+pci_msix_route(struct pci_func *f, int entry, int cpu, int vector)
+{
+	volatile uint32_t *e;
+	uint32_t addr, data;
+
+	assert(f->msix_table && entry < f->msix_nvec);
+	e = f->msix_table + entry * PCI_MSIX_TABLE_ENTRY_SIZE / 4;
+	lapic_msi(cpus[cpu].cpu_apicid, vector, &addr, &data);
+	e[PCI_MSIX_TABLE_ENTRY_ADDR_LO / 4] = addr;
+	e[PCI_MSIX_TABLE_ENTRY_ADDR_HI / 4] = 0;
+	e[PCI_MSIX_TABLE_ENTRY_DATA / 4] = data;
+	e[PCI_MSIX_TABLE_ENTRY_VECTCTL / 4] = 0;
+}
+
 static int
 pci_bridge_attach(struct pci_func *pcif)
 {
@@ -20,6 +20,10 @@ struct pci_func {
 	uint32_t reg_base[6];
 	uint32_t reg_size[6];
 	uint8_t irq_line;
+
+	// MSI-X, once pci_msix_enable has mapped the vector table
+	volatile uint32_t *msix_table;
+	uint32_t msix_nvec;
 };
 
 struct pci_bus {
@@ -29,5 +33,8 @@ struct pci_bus {
 
 int  pci_init(void);
 void pci_func_enable(struct pci_func *f);
+int  pci_find_cap(struct pci_func *f, uint8_t id);
+int  pci_msix_enable(struct pci_func *f);
+void pci_msix_route(struct pci_func *f, int entry, int cpu, int vector);
 
 #endif
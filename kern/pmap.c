@@ -10,6 +10,8 @@
 #include <kern/pmap.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/futex.h>
 
 // This is set by detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,6 +21,7 @@ size_t nfreepages;
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct spinlock page_lock;	// Protects page_free_list and nfreepages
 
 
 // --------------------------------------------------------------
@@ -322,6 +325,8 @@ page_init(void)
 	// free pages!
 
 	struct e820_entry *e = e820_map.entries;
+
+	spin_initlock(&page_lock);
 	
 	// pages[0].pp_ref = 1;
 	pages[0].pp_link = NULL;
@@ -368,18 +373,19 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if (nfreepages <= 0) {
-		return NULL;
-	}
-	if (!page_free_list) {
+	spin_lock(&page_lock);
+	if (nfreepages <= 0 || !page_free_list) {
+		spin_unlock(&page_lock);
 		return NULL;
 	}
 	
 	struct PageInfo *page_ptr = page_free_list;
 	page_free_list = page_free_list->pp_link;
 	nfreepages--;
+	spin_unlock(&page_lock);
 	page_ptr->pp_link = NULL;
 	
+	// The page is private to us now, so clear it outside the lock
 	if (alloc_flags & ALLOC_ZERO) {
 		memset(page2kva(page_ptr), 0, PGSIZE);
 	}
@@ -399,22 +405,127 @@ page_free(struct PageInfo *pp)
 	if (pp->pp_ref != 0 || pp->pp_link != NULL) {
 		panic("page_free: pp_ref or pp_link make no sense");
 	}
+	spin_lock(&page_lock);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
 	nfreepages++;
+	spin_unlock(&page_lock);
 }
 
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// The decrement is atomic, so exactly one of several CPUs dropping
+// the last references to a shared page will free it.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	uint8_t zero;
+
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (pp->pp_ref), "=q" (zero) : : "cc");
+	// Reference counts are something user code may be waiting on.
+	if (futex_nwaiting)
+		futex_wake_page(page2pa(pp));
+	if (zero)
 		page_free(pp);
 }
 
+// Drop a reference to the page table page pp.  sys_fork shares page
+// tables between address spaces, and the pages one maps are counted
+// once for the table, not once per address space, so the last
+// reference releases them.
+void
+pt_decref(struct PageInfo *pp)
+{
+	pte_t *pt = page2kva(pp);
+	uint8_t zero;
+	int i;
+
+	asm volatile("lock; decw %0; sete %1"
+		     : "+m" (pp->pp_ref), "=q" (zero) : : "cc");
+	if (!zero)
+		return;
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] & PTE_P) {
+			page_decref(pa2page(PTE_ADDR(pt[i])));
+			pt[i] = 0;
+		}
+	page_free(pp);
+}
+
+// Give pgdir a page table of its own for va, if sys_fork left it
+// sharing one: PTE_COW in the directory entry marks a shared table,
+// mapped read-only so that every write through it faults.  The copy
+// and the shared table both get PTE_COW for the pages that were
+// writable, since those pages are now mapped by two tables.  Once
+// everyone else has split off, the last holder simply takes the
+// table back.
+// Returns 0 on success, -E_NO_MEM if there was no page for the copy.
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *ptp, *np;
+	pte_t *pt, *npt, pte;
+	int i;
+
+	if ((*pde & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	ptp = pa2page(PTE_ADDR(*pde));
+	if (ptp->pp_ref > 1) {
+		if (!(np = page_alloc(0)))
+			return -E_NO_MEM;
+		pt = page2kva(ptp);
+		npt = page2kva(np);
+		for (i = 0; i < NPTENTRIES; i++) {
+			pte = pt[i];
+			if ((pte & PTE_P) && (pte & PTE_W)
+			    && !(pte & (PTE_SHARE | PTE_ALIAS))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				// The other holders map the table read-only,
+				// so this takes nothing away from them.
+				pt[i] = pte;
+			}
+			if (pte & PTE_P)
+				page_incref(pa2page(PTE_ADDR(pte)));
+			npt[i] = pte;
+		}
+		page_incref(np);
+		*pde = page2pa(np) | PTE_P | PTE_W | PTE_U;
+		pt_decref(ptp);
+	} else
+		*pde = PTE_ADDR(*pde) | PTE_P | PTE_W | PTE_U;
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(PADDR(pgdir));
+	return 0;
+}
+
+// Make the copy-on-write page that *pte maps at va in pgdir writable.
+// A page nobody else maps is simply made writable again; otherwise
+// pgdir gets a copy of its own and drops its reference to the original.
+// Returns 0 on success, -E_NO_MEM if there was no page for the copy.
+int
+page_cow_break(pde_t *pgdir, pte_t *pte, void *va)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte)), *np;
+	int perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1)
+		*pte = PTE_ADDR(*pte) | perm;
+	else {
+		if (!(np = page_alloc(0)))
+			return -E_NO_MEM;
+		memcpy(page2kva(np), page2kva(pp), PGSIZE);
+		page_incref(np);
+		*pte = page2pa(np) | perm;
+		page_decref(pp);
+	}
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -441,7 +552,11 @@ pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	pte_t * pt;
-	pde_t pde = pgdir[PDX(va)];
+	pde_t pde;
+	// Creating means changing, which a shared table cannot take.
+	if (create && pgdir_unshare(pgdir, va) < 0)
+		return NULL;
+	pde = pgdir[PDX(va)];
 	if (pde & PTE_P) {
 		pt = KADDR(PTE_ADDR(pde));
 	} else {
@@ -452,7 +567,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 				return NULL;
 			}
 			pgdir[PDX(va)] = page2pa(pg) | PTE_U | PTE_W | PTE_P;
-			pg->pp_ref++;
+			page_incref(pg);
 			pt = page2kva(pg);
 		} else {
 			// no page and not told to create new
@@ -520,9 +635,14 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 		return -E_NO_MEM;
 	}
 	// Increment reference count before to avoid corner case
-	pp->pp_ref++;
+	page_incref(pp);
 	// If page is already mapped, page_remove() it
 	if (*pte & PTE_P) {
+		// Mapping the same page again keeps it shared with our
+		// sfork threads.
+		if (PTE_ADDR(*pte) == page2pa(pp))
+			perm |= *pte & PTE_ALIAS;
+		// pgdir_walk unshared the table, so this cannot fail.
 		page_remove(pgdir, va);
 	}
 	// Set value to physical address with correct permissions
@@ -539,6 +659,10 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //
 // Return NULL if there is no page mapped at va.
 //
+// The entry may be in a table pgdir shares with a child; its PTE_W
+// then says nothing, and it must not be changed.  Callers that change
+// the entry or rely on PTE_W call pgdir_unshare first.
+//
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
 struct PageInfo *
@@ -559,6 +683,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
+// Returns 0 on success, -E_NO_MEM if the page table was shared and
+// there was no page to copy it to.
 //
 // Details:
 //   - The ref count on the physical page should decrement.
@@ -571,16 +697,22 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+int
 page_remove(pde_t *pgdir, void *va)
 {
 	pte_t *pte;
-	struct PageInfo *page = page_lookup(pgdir, va, &pte);
+	struct PageInfo *page;
+	int r;
+
+	if ((r = pgdir_unshare(pgdir, va)) < 0)
+		return r;
+	page = page_lookup(pgdir, va, &pte);
 	if (page != NULL) {
 		page_decref(page);
 	        *pte = 0;
 		tlb_invalidate(pgdir, va);
 	}
+	return 0;
 }
 
 //
@@ -673,7 +805,8 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 			// page is not in kernel space
 			pte_t *entry = pgdir_walk(env->env_pgdir, 
 				       (void *) user_mem_check_addr, 0);
-			if (entry != NULL && (*entry & perm) == perm) {
+			if (entry != NULL && (*entry & perm) == perm
+			    && (env->env_pgdir[PDX(user_mem_check_addr)] & perm) == perm) {
 				// env has permission
 				continue;	
 			}
@@ -57,9 +57,20 @@ void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
-void	page_remove(pde_t *pgdir, void *va);
+int	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	pt_decref(struct PageInfo *pp);
+int	pgdir_unshare(pde_t *pgdir, const void *va);
+int	page_cow_break(pde_t *pgdir, pte_t *pte, void *va);
+
+// Take a reference to pp.  Shared pages can be mapped by environments
+// running on different CPUs at once, so the increment must be atomic.
+static inline void
+page_incref(struct PageInfo *pp)
+{
+	asm volatile("lock; incw %0" : "+m" (pp->pp_ref) : : "cc");
+}
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
@@ -4,8 +4,307 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
 
-void sched_halt(void);
+struct spinlock sched_lock;
+
+// Per-CPU queues of ENV_RUNNABLE environments.  An env is on exactly
+// one queue while it is ENV_RUNNABLE and on none otherwise; it is
+// queued on the CPU it last ran on (env_cpunum) so that it tends to
+// stay cache-warm there.  Idle CPUs steal from the others.  The
+// queues are protected by sched_lock.
+//
+// Each queue has two parts.  ENV_SCHED_LATENCY envs sit on a FIFO
+// list and always run before fair-share envs, as long as they keep
+// within SCHED_LATENCY_BUDGET between blocks.  ENV_SCHED_FAIR envs
+// sit in a min-heap ordered by virtual runtime: CPU time scaled by
+// ENV_WEIGHT_DEFAULT / env_weight, so heavier envs age more slowly
+// and get a proportionally larger share.
+struct runq {
+	struct Env *head, *tail;	// latency class, FIFO
+	struct Env *heap[NENV];		// fair class, min-heap on vruntime
+	uint32_t nheap;
+	uint64_t min_vruntime;		// never decreases
+	uint64_t run_start;		// TSC when curenv was last charged
+	uint32_t len;
+	uint64_t steals;	// envs this CPU took from other queues
+};
+
+static struct runq runqs[NCPU];
+
+// Queue links, indexed like envs[] so that struct Env, which user
+// space also sees, does not change.
+static struct {
+	struct Env *next, *prev;
+	uint32_t heapidx;
+} runq_links[NENV];
+
+// How far behind min_vruntime an env that has been asleep or has
+// moved between CPUs may start, in TSC cycles (roughly one 10ms
+// timer tick).  Keeps long sleepers from monopolizing the CPU when
+// they wake.
+#define SCHED_WAKEUP_SLACK	20000000ULL
+
+// How much CPU time, in TSC cycles, a latency-class env may use
+// between blocks (roughly five timer ticks).  Servers answer a request
+// and block again well within it; an env that overruns it is a CPU
+// hog, and is moved to the fair class for good so that it cannot
+// starve the fair-share envs.  The file server, which the kernel put
+// in the latency class itself, is trusted to block.
+#define SCHED_LATENCY_BUDGET	(5 * SCHED_WAKEUP_SLACK)
+
+// Per env, under sched_lock: CPU time used in the latency class since
+// the env last woke up.
+static uint64_t latency_used[NENV];
+
+void sched_halt(void) __attribute__((noreturn));
+
+void
+sched_init(void)
+{
+	spin_initlock(&sched_lock);
+}
+
+static bool
+vruntime_before(struct Env *a, struct Env *b)
+{
+	return a->env_vruntime < b->env_vruntime ||
+		(a->env_vruntime == b->env_vruntime && a < b);
+}
+
+static void
+heap_set(struct runq *rq, uint32_t i, struct Env *e)
+{
+	rq->heap[i] = e;
+	runq_links[e - envs].heapidx = i;
+}
+
+static void
+heap_sift_up(struct runq *rq, uint32_t i)
+{
+	struct Env *e = rq->heap[i];
+
+	while (i > 0 && vruntime_before(e, rq->heap[(i - 1) / 2])) {
+		heap_set(rq, i, rq->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(rq, i, e);
+}
+
+static void
+heap_sift_down(struct runq *rq, uint32_t i)
+{
+	struct Env *e = rq->heap[i];
+	uint32_t child;
+
+	while ((child = 2 * i + 1) < rq->nheap) {
+		if (child + 1 < rq->nheap &&
+		    vruntime_before(rq->heap[child + 1], rq->heap[child]))
+			child++;
+		if (!vruntime_before(rq->heap[child], e))
+			break;
+		heap_set(rq, i, rq->heap[child]);
+		i = child;
+	}
+	heap_set(rq, i, e);
+}
+
+static void
+runq_push(struct runq *rq, struct Env *e)
+{
+	int x = e - envs;
+
+	if (e->env_sched_class == ENV_SCHED_LATENCY) {
+		runq_links[x].next = NULL;
+		runq_links[x].prev = rq->tail;
+		if (rq->tail)
+			runq_links[rq->tail - envs].next = e;
+		else
+			rq->head = e;
+		rq->tail = e;
+	} else {
+		if (e->env_vruntime + SCHED_WAKEUP_SLACK < rq->min_vruntime)
+			e->env_vruntime = rq->min_vruntime - SCHED_WAKEUP_SLACK;
+		rq->heap[rq->nheap] = e;
+		heap_sift_up(rq, rq->nheap++);
+	}
+	rq->len++;
+}
+
+static void
+runq_remove(struct runq *rq, struct Env *e)
+{
+	int x = e - envs;
+	uint32_t i;
+
+	if (e->env_sched_class == ENV_SCHED_LATENCY) {
+		struct Env *next = runq_links[x].next, *prev = runq_links[x].prev;
+
+		if (prev)
+			runq_links[prev - envs].next = next;
+		else
+			rq->head = next;
+		if (next)
+			runq_links[next - envs].prev = prev;
+		else
+			rq->tail = prev;
+		runq_links[x].next = runq_links[x].prev = NULL;
+	} else {
+		struct Env *last = rq->heap[--rq->nheap];
+
+		i = runq_links[x].heapidx;
+		if (last != e) {
+			heap_set(rq, i, last);
+			heap_sift_up(rq, i);
+			heap_sift_down(rq, runq_links[last - envs].heapidx);
+		}
+	}
+	rq->len--;
+}
+
+// Change e's status, keeping the run queues in step.
+// Caller must hold sched_lock.
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == status)
+		return;
+	if (e->env_status == ENV_RUNNABLE)
+		runq_remove(&runqs[e->env_cpunum], e);
+	if (status == ENV_RUNNABLE)
+		runq_push(&runqs[e->env_cpunum], e);
+	if (e->env_status == ENV_NOT_RUNNABLE)
+		latency_used[e - envs] = 0;
+	e->env_status = status;
+}
+
+// Change e's scheduling class and weight, requeueing it if needed.
+void
+sched_set_class(struct Env *e, int sched_class, uint32_t weight)
+{
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_RUNNABLE)
+		runq_remove(&runqs[e->env_cpunum], e);
+	e->env_sched_class = sched_class;
+	e->env_weight = weight;
+	latency_used[e - envs] = 0;
+	if (e->env_status == ENV_RUNNABLE)
+		runq_push(&runqs[e->env_cpunum], e);
+	spin_unlock(&sched_lock);
+}
+
+// Move e, a latency-class env that has overrun SCHED_LATENCY_BUDGET,
+// to the fair class, level with the fair-share envs on its queue.
+// Caller must hold sched_lock.
+static void
+sched_demote(struct Env *e)
+{
+	struct runq *rq = &runqs[e->env_cpunum];
+	bool queued = e->env_status == ENV_RUNNABLE;
+
+	if (queued)
+		runq_remove(rq, e);
+	e->env_sched_class = ENV_SCHED_FAIR;
+	e->env_vruntime = rq->min_vruntime;
+	if (queued)
+		runq_push(rq, e);
+}
+
+// Is e some other CPU's current environment?  Such an env may still be
+// in the kernel on that CPU even if it is no longer ENV_RUNNING (for
+// example while it blocks in sys_ipc_recv), so only that CPU may run
+// or free it.  Caller must hold sched_lock.
+bool
+sched_running_elsewhere(struct Env *e)
+{
+	return e->env_cpunum != cpunum() && cpus[e->env_cpunum].cpu_env == e;
+}
+
+// Charge curenv for the CPU time it has used since it was last
+// charged.  Caller must hold sched_lock.
+static void
+sched_account(void)
+{
+	struct runq *rq = &runqs[cpunum()];
+	uint64_t now = read_tsc(), ran = now - rq->run_start;
+
+	if (curenv && curenv->env_sched_class == ENV_SCHED_FAIR)
+		curenv->env_vruntime += ran *
+			ENV_WEIGHT_DEFAULT / curenv->env_weight;
+	else if (curenv && curenv->env_type != ENV_TYPE_FS &&
+		 (latency_used[curenv - envs] += ran) > SCHED_LATENCY_BUDGET)
+		sched_demote(curenv);
+	rq->run_start = now;
+}
+
+// Mark e as running on this CPU.  Caller must hold sched_lock.
+static void
+sched_claim(struct Env *e)
+{
+	struct runq *rq = &runqs[cpunum()];
+
+	sched_set_status(e, ENV_RUNNING);
+	e->env_cpunum = cpunum();
+	if (e->env_sched_class == ENV_SCHED_FAIR &&
+	    e->env_vruntime > rq->min_vruntime)
+		rq->min_vruntime = e->env_vruntime;
+	rq->run_start = read_tsc();
+}
+
+// The env this CPU should run next from rq, or NULL: the first
+// claimable latency-class env, otherwise the claimable fair-share env
+// with the least virtual runtime.  Caller must hold sched_lock.
+static struct Env *
+runq_pick(struct runq *rq)
+{
+	struct Env *e, *best = NULL;
+	uint32_t i;
+
+	for (e = rq->head; e; e = runq_links[e - envs].next)
+		if (!sched_running_elsewhere(e))
+			return e;
+	// Only another CPU's queue can hold envs we may not claim, so
+	// on our own queue this returns the heap top straight away.
+	for (i = 0; i < rq->nheap; i++) {
+		e = rq->heap[i];
+		if (!sched_running_elsewhere(e) &&
+		    (!best || vruntime_before(e, best))) {
+			best = e;
+			if (i == 0)
+				break;
+		}
+	}
+	return best;
+}
+
+// Take an env from the longest other run queue.
+// Caller must hold sched_lock.
+static struct Env *
+sched_steal(void)
+{
+	struct runq *victim = NULL;
+	struct Env *e;
+	int i, me = cpunum();
+
+	for (i = 1; i < ncpu; i++) {
+		struct runq *rq = &runqs[(me + i) % ncpu];
+		if (rq->len > 0 && (!victim || rq->len > victim->len))
+			victim = rq;
+	}
+	if (!victim || !(e = runq_pick(victim)))
+		return NULL;
+	// Carry e's lag behind the victim's clock over to ours.
+	if (e->env_sched_class == ENV_SCHED_FAIR) {
+		int64_t lag = e->env_vruntime - victim->min_vruntime;
+
+		if (lag < 0 && -lag > runqs[me].min_vruntime)
+			e->env_vruntime = 0;
+		else
+			e->env_vruntime = runqs[me].min_vruntime + lag;
+	}
+	runqs[me].steals++;
+	return e;
+}
 
 // Choose a user environment to run and run it.
 void
@@ -13,54 +312,121 @@ sched_yield(void)
 {
 	struct Env *idle;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
+	// Put the current env back on our queue, then run the best env
+	// on it (see runq_pick).  That may be the current env again if
+	// it is still the fair-share env furthest behind.  Latency-class
+	// envs rotate round-robin.  If our queue is empty, steal from
+	// the busiest other CPU.
 	//
 	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
+	// another CPU. If there are no runnable environments, simply
+	// drop through to the code below to halt the cpu.
+	//
+	// The pick and the claim happen under sched_lock, so two CPUs
+	// can never pick the same environment.
 
 	// LAB 4: Your code here.
-	struct Env *curr_env = curenv;
-	if (curr_env == NULL) {
-		for (idle = envs; idle < envs + NENV; idle++) {
-			if (idle->env_status == ENV_RUNNABLE) {
-				env_run(idle);
-			}
-		}
-	} else {
-		for (idle = curr_env; idle < envs + NENV; idle++) {
-			if (idle->env_status == ENV_RUNNABLE) {
-				env_run(idle);
-			}
-		}
-		for (idle = envs; idle < curr_env; idle++) {
-			if (idle->env_status == ENV_RUNNABLE) {
-				env_run(idle);
-			}
-		}
-		if (curenv->env_status == ENV_RUNNING) {
-			env_run(curenv);
-		}
+	spin_lock(&sched_lock);
+	sched_account();
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		sched_set_status(curenv, ENV_RUNNABLE);
+	if ((idle = runq_pick(&runqs[cpunum()])) ||
+	    (idle = sched_steal())) {
+		sched_claim(idle);
+		spin_unlock(&sched_lock);
+		env_run(idle);
 	}
+	spin_unlock(&sched_lock);
+
 	// sched_halt never returns
 	sched_halt();
 }
 
+// Return to the current environment if it may still run, otherwise
+// pick another one.  curenv may have been made runnable again by
+// another CPU while this CPU was still in the kernel on its behalf;
+// only this CPU can claim it in that case.
+void
+sched_resume(void)
+{
+	spin_lock(&sched_lock);
+	sched_account();
+	if (curenv && (curenv->env_status == ENV_RUNNING ||
+		       curenv->env_status == ENV_RUNNABLE)) {
+		sched_claim(curenv);
+		spin_unlock(&sched_lock);
+		env_run(curenv);
+	}
+	spin_unlock(&sched_lock);
+	sched_yield();
+}
+
+// Switch this CPU straight to e, which the caller has just woken,
+// without a scheduling pass: the L4-style direct process switch used
+// by sys_ipc_send.  curenv stays runnable.  Returns if e cannot be
+// run here, for example because it is still in the kernel on another
+// CPU; it will then be picked up by the scheduler as usual.
+void
+sched_switch(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e->env_status != ENV_RUNNABLE || sched_running_elsewhere(e)) {
+		spin_unlock(&sched_lock);
+		return;
+	}
+	sched_account();
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		sched_set_status(curenv, ENV_RUNNABLE);
+	sched_claim(e);
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
+// Make a blocked environment runnable again.  Safe to call from any
+// CPU; environments that are dying or already runnable are left alone.
+void
+sched_wakeup(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_NOT_RUNNABLE)
+		sched_set_status(e, ENV_RUNNABLE);
+	spin_unlock(&sched_lock);
+}
+
+// Stop scheduling e.  If e is running on some CPU it keeps running
+// until it next enters the kernel.
+void
+sched_sleep(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_RUNNING)
+		sched_set_status(e, ENV_NOT_RUNNABLE);
+	spin_unlock(&sched_lock);
+}
+
+// Fill in the scheduler part of sys_sysinfo.
+void
+sched_stats(struct sysinfo *info)
+{
+	int i;
+
+	static_assert(SYSINFO_MAXCPU >= NCPU);
+	spin_lock(&sched_lock);
+	for (i = 0; i < ncpu; i++) {
+		info->runqlen[i] = runqs[i].len;
+		info->steals[i] = runqs[i].steals;
+	}
+	spin_unlock(&sched_lock);
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
 void
 sched_halt(void)
 {
+	struct Env *prev;
+	bool dying;
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
@@ -77,18 +443,25 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
+	// Mark that no environment is running on this CPU.  Switch
+	// away from its page directory first, since once it is no
+	// longer ours another CPU may free it.
 	lcr3(PADDR(kern_pgdir));
+	spin_lock(&sched_lock);
+	prev = curenv;
+	dying = prev && prev->env_status == ENV_DYING;
+	curenv = NULL;
+	spin_unlock(&sched_lock);
+
+	// A zombie that was blocked in the kernel on this CPU is ours
+	// to free.
+	if (dying)
+		env_free(prev);
 
 	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// timer interupts come in, we know we are coming from here
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
-
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
@@ -100,5 +473,5 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	__builtin_unreachable();
 }
-
@@ -6,7 +6,24 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
-// This function does not return.
+#include <inc/env.h>
+#include <inc/sysinfo.h>
+#include <kern/spinlock.h>
+
+// Protects every env_status transition and each CPU's cpu_env.
+extern struct spinlock sched_lock;
+
+// These functions do not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_resume(void) __attribute__((noreturn));
+
+void sched_init(void);
+void sched_set_status(struct Env *e, unsigned status);
+void sched_set_class(struct Env *e, int sched_class, uint32_t weight);
+void sched_switch(struct Env *e);
+void sched_wakeup(struct Env *e);
+void sched_sleep(struct Env *e);
+bool sched_running_elsewhere(struct Env *e);
+void sched_stats(struct sysinfo *info);
 
 #endif	// !JOS_KERN_SCHED_H
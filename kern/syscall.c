@@ -13,6 +13,8 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/sysinfo.h>
+#include <kern/futex.h>
+#include <kern/sysinfo.h>
 // you added
 #include <kern/nvme.h>
 
@@ -70,7 +72,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_lock(envid, &e, 1)) < 0)
 		return r;
 
 	// this was deleted in lab5 but it breaks the lab4 tests when commented out
@@ -80,7 +82,7 @@ sys_env_destroy(envid_t envid)
 		cprintf("[%08x] destroying %08x\n", curenv->env_id, e->env_id);
 	}
 
-	env_destroy(e);
+	env_destroy_unlock(e);
 	return 0;
 }
 
@@ -119,15 +121,22 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	}
 	// valid perm and va params
 	
+	struct PageInfo *new_page = page_alloc(ALLOC_ZERO);
+	if (!new_page) {
+		return -E_NO_MEM;
+	}
+
 	struct Env *e;
-	if (envid2env(envid, &e, 1) < 0) {
+	if (envid2env_lock(envid, &e, 1) < 0) {
+		page_free(new_page);
 		return -E_BAD_ENV;
 	}
-	struct PageInfo *new_page = page_alloc(ALLOC_ZERO);
 	if (page_insert(e->env_pgdir, new_page, va, perm) < 0) {
+		env_unlock(e);
 		page_free(new_page);
 		return -E_NO_MEM;
 	}
+	env_unlock(e);
 	return 0;
 }
 
@@ -160,13 +169,22 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	// LAB 3: Your code here.
 
+	// Only one env lock is held at a time, so two CPUs mapping
+	// pages in opposite directions cannot deadlock.  The extra
+	// reference keeps the page alive between the two steps.
+
 	struct Env *src_e;
 	struct Env *dst_e;
-	if (envid2env(srcenvid, &src_e, 1) < 0 ||
-	    envid2env(dstenvid, &dst_e, 1) < 0) {
+	int r;
+	if (envid2env_lock(srcenvid, &src_e, 1) < 0) {
 		return -E_BAD_ENV;
 	}
 
+	// PTE_W means nothing in a table shared with a child.
+	if ((perm & PTE_W) && (r = pgdir_unshare(src_e->env_pgdir, srcva)) < 0) {
+		env_unlock(src_e);
+		return r;
+	}
 	pte_t *src_entry;
 	struct PageInfo *page = page_lookup(src_e->env_pgdir, srcva, &src_entry);
 	
@@ -174,14 +192,24 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	    dstva >= (void *) UTOP || (size_t) dstva % PGSIZE != 0 || 
 	    !valid_perms(perm) || page == NULL ||
 	    (!(*src_entry & PTE_W) && (perm & PTE_W))) {
+		env_unlock(src_e);
 		return -E_INVAL;
 	}
-	
-	if (page_insert(dst_e->env_pgdir, page, dstva, perm) < 0) {
-		return -E_NO_MEM;
+	page_incref(page);
+	env_unlock(src_e);
+
+	r = 0;
+	if (envid2env_lock(dstenvid, &dst_e, 1) < 0) {
+		r = -E_BAD_ENV;
+	} else {
+		if (page_insert(dst_e->env_pgdir, page, dstva, perm) < 0) {
+			r = -E_NO_MEM;
+		}
+		env_unlock(dst_e);
 	}
+	page_decref(page);
 
-	return 0;
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -191,23 +219,26 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if the page table was shared and could not be copied.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
 	// Hint: This function is a wrapper around page_remove().
 
 	// LAB 3: Your code here.
-	struct Env *e;
-	if (envid2env(envid, &e, 1) < 0) {
-		return -E_BAD_ENV;
-	}
-
 	if (va >= (void *) UTOP || (size_t) va % PGSIZE != 0) {
 		return -E_INVAL;
 	}
 
-	page_remove(e->env_pgdir, va);
-	return 0;
+	struct Env *e;
+	int r;
+	if (envid2env_lock(envid, &e, 1) < 0) {
+		return -E_BAD_ENV;
+	}
+
+	r = page_remove(e->env_pgdir, va);
+	env_unlock(e);
+	return r;
 }
 
 // Deschedule current environment and pick a different one to run.
@@ -235,6 +266,8 @@ sys_exofork(void)
 	int result = env_alloc(&new_env, curenv->env_id);
 	if (result == 0) {
 		new_env->env_status = ENV_NOT_RUNNABLE;
+		new_env->env_sched_class = curenv->env_sched_class;
+		new_env->env_weight = curenv->env_weight;
 		new_env->env_tf = curenv->env_tf;
 		new_env->env_tf.tf_regs.reg_eax = 0;
 		return new_env->env_id;
@@ -243,6 +276,155 @@ sys_exofork(void)
 	}
 }
 
+// Does the page table pde points at map any PTE_SHARE page?  A table
+// shared copy-on-write never does, since mapping a page into it
+// unshares it first (pgdir_walk).
+static bool
+pt_maps_share(pde_t pde)
+{
+	pte_t *pt = KADDR(PTE_ADDR(pde));
+	int i;
+
+	if (pde & PTE_COW)
+		return 0;
+	for (i = 0; i < NPTENTRIES; i++)
+		if ((pt[i] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE))
+			return 1;
+	return 0;
+}
+
+// Create a child whose address space is a copy-on-write copy of ours,
+// as fork() in lib/fork.c builds with a system call per page.  Walks
+// the page directory once, skipping absent page tables.  Every table
+// but the stack's is shared whole with the child, read-only, until the
+// first write through it in either address space (pgdir_unshare), so
+// the cost is per table, not per page.  The stack's table, which also
+// holds the exception stack, is copied: writable and copy-on-write
+// pages become copy-on-write in both, PTE_SHARE and PTE_ALIAS pages are
+// shared.  So is every table that maps a PTE_SHARE page: a page in a
+// shared table has one reference however many of us map it, and user
+// code tells whether its peers still hold a PTE_SHARE page, such as a
+// pipe or an open file's Fd, by its reference count.  The child gets a
+// fresh exception stack and our page fault upcall, and is left
+// runnable, returning 0 from the call.
+//
+// If share is set the child is a thread instead: it maps the very same
+// pages as we do, writable where we have them writable, and only the
+// stack's table is copied copy-on-write as above.  Our own copy-on-write
+// pages are resolved first, so that writes by either of us are seen by
+// both.  The pages are tagged PTE_ALIAS in both of us, so that a later
+// fork by any thread shares them instead of making them copy-on-write,
+// which would split that thread off from the others.  Page tables
+// themselves are still per environment, since a table shared writable
+// would need TLB shootdowns we do not have: pages mapped or unmapped
+// later are seen only by whoever did it.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(bool share)
+{
+	struct Env *child;
+	struct PageInfo *pp;
+	pde_t *pgdir = curenv->env_pgdir;
+	pte_t *pt, *cpt, pte;
+	uint32_t pdx, ptx, perm;
+	uintptr_t va;
+	bool cow = 0, stack, alias;
+	int r;
+
+	if ((r = env_alloc(&child, curenv->env_id)) < 0)
+		return r;
+	child->env_status = ENV_NOT_RUNNABLE;
+	child->env_sched_class = curenv->env_sched_class;
+	child->env_weight = curenv->env_weight;
+	child->env_tf = curenv->env_tf;
+	child->env_tf.tf_regs.reg_eax = 0;
+	child->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	// Nobody but us can reach the child yet, so only our own page
+	// tables need the lock.
+	env_lock(curenv);
+	for (pdx = PDX(UTEXT); pdx <= PDX(USTACKTOP - 1); pdx++) {
+		if (!(pgdir[pdx] & PTE_P))
+			continue;
+		stack = pdx == PDX(USTACKTOP - 1);
+		// Pages of this table map the same memory in both of us.
+		alias = share && !stack;
+		if (!share && !stack && !pt_maps_share(pgdir[pdx])) {
+			if (pgdir[pdx] & PTE_W) {
+				pgdir[pdx] = (pgdir[pdx] & ~PTE_W) | PTE_COW;
+				cow = 1;
+			}
+			child->env_pgdir[pdx] = pgdir[pdx];
+			page_incref(pa2page(PTE_ADDR(pgdir[pdx])));
+			continue;
+		}
+		if (alias && (r = pgdir_unshare(pgdir, PGADDR(pdx, 0, 0))) < 0)
+			goto fail;
+		pt = KADDR(PTE_ADDR(pgdir[pdx]));
+		cpt = NULL;
+		for (ptx = 0; ptx < NPTENTRIES; ptx++) {
+			va = (uintptr_t) PGADDR(pdx, ptx, 0);
+			if (!(pt[ptx] & PTE_P) || !(pt[ptx] & PTE_U)
+			    || va < UTEXT || va >= USTACKTOP)
+				continue;
+			if (alias && (pt[ptx] & PTE_COW)
+			    && (r = page_cow_break(pgdir, &pt[ptx], (void *) va)) < 0)
+				goto fail;
+			pte = pt[ptx];
+			perm = pte & (PTE_SYSCALL | PTE_ALIAS);
+			if (alias) {
+				perm |= PTE_ALIAS;
+				pt[ptx] = PTE_ADDR(pte) | perm;
+			} else if (!(pte & (PTE_SHARE | PTE_ALIAS))
+				   && (pte & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[ptx] = PTE_ADDR(pte) | perm;
+				cow = 1;
+			}
+			if (!cpt) {
+				cpt = pgdir_walk(child->env_pgdir, (void *) va, 1);
+				if (!cpt) {
+					r = -E_NO_MEM;
+					goto fail;
+				}
+				cpt -= ptx;
+			}
+			page_incref(pa2page(PTE_ADDR(pte)));
+			cpt[ptx] = PTE_ADDR(pte) | perm;
+		}
+	}
+	// One flush for every entry made read-only above.
+	if (cow)
+		lcr3(PADDR(pgdir));
+	env_unlock(curenv);
+
+	if (!(pp = page_alloc(ALLOC_ZERO))
+	    || page_insert(child->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+			   PTE_P | PTE_U | PTE_W) < 0) {
+		if (pp)
+			page_free(pp);
+		env_free(child);
+		return -E_NO_MEM;
+	}
+
+	// Once it is runnable the child may exit, so read its id first.
+	r = child->env_id;
+	env_lock(child);
+	sched_wakeup(child);
+	env_unlock(child);
+	return r;
+
+fail:
+	if (cow)
+		lcr3(PADDR(pgdir));
+	env_unlock(curenv);
+	env_free(child);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -264,11 +446,15 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_INVAL;
 	}
 	struct Env *e;
-	if (envid2env(envid, &e, 1) < 0) {
+	if (envid2env_lock(envid, &e, 1) < 0) {
 		return -E_BAD_ENV;
 	}
 
-	e->env_status = status;
+	if (status == ENV_RUNNABLE)
+		sched_wakeup(e);
+	else
+		sched_sleep(e);
+	env_unlock(e);
 	return 0;
 }
 
@@ -288,11 +474,12 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0) {
+	if ((r = envid2env_lock(envid, &e, 1)) < 0) {
 		return r;
 	}
 
 	e->env_tf = *tf;
+	env_unlock(e);
 	return 0;
 }
 
@@ -309,11 +496,40 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 4: Your code here.
 	struct Env *e;
-	if (envid2env(envid, &e, 1) < 0) {
+	if (envid2env_lock(envid, &e, 1) < 0) {
 		return -E_BAD_ENV;
 	}
 
 	e->env_pgfault_upcall = func;
+	env_unlock(e);
+	return 0;
+}
+
+// Set envid's scheduling class and, for ENV_SCHED_FAIR, its weight.
+// An ENV_SCHED_LATENCY env runs ahead of every ENV_SCHED_FAIR env
+// until it uses too much CPU time without blocking, when the scheduler
+// moves it to ENV_SCHED_FAIR (see SCHED_LATENCY_BUDGET); fair-share
+// envs split the remaining CPU time in proportion to their weights.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if sched_class is not a valid class, or weight is not
+//		in [1, ENV_WEIGHT_MAX].
+static int
+sys_env_set_priority(envid_t envid, int sched_class, uint32_t weight)
+{
+	struct Env *e;
+
+	if (sched_class != ENV_SCHED_FAIR && sched_class != ENV_SCHED_LATENCY)
+		return -E_INVAL;
+	if (weight < 1 || weight > ENV_WEIGHT_MAX)
+		return -E_INVAL;
+	if (envid2env_lock(envid, &e, 1) < 0)
+		return -E_BAD_ENV;
+
+	sched_set_class(e, sched_class, weight);
+	env_unlock(e);
 	return 0;
 }
 
@@ -325,9 +541,239 @@ sys_sysinfo(struct sysinfo *info)
 	return sysinfo(info);
 }
 
+// What a message carries besides its value: a page, held by a
+// reference while the message is in flight, or up to IPC_MAXWORDS
+// inline words copied out of the sender.
+struct ipc_msg {
+	struct PageInfo *pg;
+	unsigned perm;
+	uint32_t nwords;
+	uint32_t words[IPC_MAXWORDS];
+};
+
+// Senders blocked in sys_ipc_send or sys_ipc_call.  Each receiver has
+// a FIFO queue of senders, protected by the receiver's env lock.
+// Both arrays are indexed like envs[].
+static struct ipc_sender {
+	struct Env *dst;	// receiver we are queued on, or NULL
+	struct Env *next;	// next sender queued on dst
+	uint32_t value;
+	struct ipc_msg msg;
+	bool call;		// keep waiting for dst's reply once received
+} ipc_senders[NENV];
+
+static struct {
+	struct Env *head, *tail;
+} ipc_sendq[NENV];
+
+// While an env is receiving, the only env it accepts a message from,
+// or 0 for any.  sys_ipc_call waits this way for the reply.
+// Protected by the env's lock.
+static envid_t ipc_waitfor[NENV];
+
+// Fill in m with what curenv is sending along with its value.  If
+// perm is IPC_INLINE(n), copy the n words at srcva.  Otherwise look up
+// the page at srcva for sending with perm, and take a reference to it
+// so it stays alive while we lock the receiver; no page is sent if
+// srcva >= UTOP.  Drop m with ipc_msg_put.
+static int
+ipc_msg_get(void *srcva, unsigned perm, struct ipc_msg *m)
+{
+	pte_t *src_entry;
+	struct PageInfo *src_pg;
+	int r;
+
+	m->pg = NULL;
+	m->perm = 0;
+	m->nwords = 0;
+	if (perm & IPC_INLINE_FLAG) {
+		m->nwords = IPC_INLINE_NWORDS(perm);
+		if (perm != IPC_INLINE(m->nwords) || m->nwords > IPC_MAXWORDS)
+			return -E_INVAL;
+		if (user_mem_check(curenv, srcva, m->nwords * 4, PTE_U) < 0)
+			return -E_FAULT;
+		memcpy(m->words, srcva, m->nwords * 4);
+		return 0;
+	}
+	if (srcva >= (void *) UTOP)
+		return 0;
+
+	env_lock(curenv);
+	// PTE_W means nothing in a table shared with a child.
+	if ((perm & PTE_W) && (r = pgdir_unshare(curenv->env_pgdir, srcva)) < 0) {
+		env_unlock(curenv);
+		return r;
+	}
+	src_pg = page_lookup(curenv->env_pgdir, srcva, &src_entry);
+	if ((uintptr_t) srcva % PGSIZE != 0 || !valid_perms(perm) ||
+			!src_pg || ((perm & PTE_W) && !(*src_entry & PTE_W))) {
+		env_unlock(curenv);
+		return -E_INVAL;
+	}
+	page_incref(src_pg);
+	env_unlock(curenv);
+	m->pg = src_pg;
+	m->perm = perm;
+	return 0;
+}
+
+// Drop the page reference m holds, if any.
+static void
+ipc_msg_put(struct ipc_msg *m)
+{
+	if (m->pg)
+		page_decref(m->pg);
+	m->pg = NULL;
+}
+
+// Is dst waiting for a message from src?  Caller holds dst's lock.
+static bool
+ipc_accepts(struct Env *dst, envid_t src)
+{
+	envid_t from = ipc_waitfor[ENVX(dst->env_id)];
+
+	return dst->env_ipc_recving && (from == 0 || from == src);
+}
+
+// Hand a message to dst, whose lock the caller holds and which is
+// either blocked in sys_ipc_recv or is curenv receiving right now.
+static int
+ipc_deliver(struct Env *dst, envid_t from, uint32_t value,
+	    const struct ipc_msg *m)
+{
+	dst->env_ipc_perm = 0;
+	if (m->pg && dst->env_ipc_dstva < (void *) UTOP) {
+		if (page_insert(dst->env_pgdir, m->pg, dst->env_ipc_dstva, m->perm) < 0) {
+			return -E_NO_MEM;
+		}
+		dst->env_ipc_perm = m->perm;
+	}
+	// Inline words go through dst's struct Env; no mapping to update.
+	dst->env_ipc_nwords = m->nwords;
+	memcpy(dst->env_ipc_words, m->words, m->nwords * 4);
+
+	// mapping was successful or no mapping in ipc was attempted
+	dst->env_ipc_recving = 0;
+	ipc_waitfor[ENVX(dst->env_id)] = 0;
+	dst->env_ipc_from = from;
+	dst->env_ipc_value = value;
+
+	// this part was not immediately obv to you... it's cause we did sched_yield so when
+	// we start running this env again the eax register will hold the pseudo return value
+	dst->env_tf.tf_regs.reg_eax = 0;
+	return 0;
+}
+
+// Unlink sender s from dst's queue.  Caller holds dst's lock.
+static void
+ipc_sendq_remove(struct Env *dst, struct Env *s)
+{
+	struct Env **pp = &ipc_sendq[ENVX(dst->env_id)].head;
+	struct Env *prev = NULL;
+
+	while (*pp != s) {
+		prev = *pp;
+		pp = &ipc_senders[ENVX(prev->env_id)].next;
+	}
+	*pp = ipc_senders[ENVX(s->env_id)].next;
+	if (ipc_sendq[ENVX(dst->env_id)].tail == s)
+		ipc_sendq[ENVX(dst->env_id)].tail = prev;
+}
+
+// Take the first queued sender that dst will accept a message from.
+// The caller holds dst's lock and must finish with the sender
+// (ipc_sender_done) before dropping it.
+static struct Env *
+ipc_sendq_take(struct Env *dst)
+{
+	struct Env *s;
+
+	for (s = ipc_sendq[ENVX(dst->env_id)].head; s;
+	     s = ipc_senders[ENVX(s->env_id)].next)
+		if (ipc_waitfor[ENVX(dst->env_id)] == 0 ||
+		    ipc_waitfor[ENVX(dst->env_id)] == s->env_id) {
+			ipc_sendq_remove(dst, s);
+			return s;
+		}
+	return NULL;
+}
+
+// Stop s, which is blocked in the kernel, from receiving and make its
+// system call return r.
+static void
+ipc_recv_cancel(struct Env *s, int r)
+{
+	s->env_ipc_recving = 0;
+	ipc_waitfor[ENVX(s->env_id)] = 0;
+	s->env_tf.tf_regs.reg_eax = r;
+	sched_wakeup(s);
+}
+
+// Complete blocked sender s with result r.  A caller whose request got
+// through keeps sleeping until the reply; anyone else is woken.  The
+// caller holds the lock of the receiver s was queued on, which is the
+// only env s's reply filter lets in.  Clearing s's dst last lets
+// ipc_env_free know that we are done with s.
+static void
+ipc_sender_done(struct Env *s, int r)
+{
+	struct ipc_sender *rec = &ipc_senders[ENVX(s->env_id)];
+
+	if (!rec->call) {
+		s->env_tf.tf_regs.reg_eax = r;
+		sched_wakeup(s);
+	} else if (r < 0) {
+		ipc_recv_cancel(s, r);
+	}
+	ipc_msg_put(&rec->msg);
+	rec->next = NULL;
+	rec->dst = NULL;
+}
+
+// Drop e's IPC state before it is freed: take e off the queue of the
+// receiver it is blocked sending to, fail every sender blocked sending
+// to e, and fail every caller still waiting for e's reply.  e must
+// already be ENV_DYING so no new sender queues.
+void
+ipc_env_free(struct Env *e)
+{
+	struct ipc_sender *rec = &ipc_senders[ENVX(e->env_id)];
+	struct Env *dst, *s;
+	int i;
+
+	if ((dst = rec->dst)) {
+		env_lock(dst);
+		if (rec->dst == dst) {
+			ipc_sendq_remove(dst, e);
+			ipc_msg_put(&rec->msg);
+			rec->next = NULL;
+			rec->dst = NULL;
+		}
+		env_unlock(dst);
+	}
+
+	env_lock(e);
+	while ((s = ipc_sendq[ENVX(e->env_id)].head)) {
+		ipc_sendq_remove(e, s);
+		ipc_sender_done(s, -E_BAD_ENV);
+	}
+	env_unlock(e);
+
+	for (i = 0; i < NENV; i++) {
+		if (ipc_waitfor[i] != e->env_id)
+			continue;
+		env_lock(&envs[i]);
+		if (ipc_waitfor[i] == e->env_id && envs[i].env_ipc_recving)
+			ipc_recv_cancel(&envs[i], -E_BAD_ENV);
+		env_unlock(&envs[i]);
+	}
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If perm is IPC_INLINE(n), then srcva instead points at n words to
+// copy into the receiver's env_ipc_words, and no page is sent.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -339,7 +785,8 @@ sys_sysinfo(struct sysinfo *info)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_nwords is set to the number of inline words sent, or 0.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -363,51 +810,191 @@ sys_sysinfo(struct sysinfo *info)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//	-E_INVAL if perm is IPC_INLINE(n) with n > IPC_MAXWORDS.
+//	-E_FAULT if the inline words are not readable by the caller.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
+	// As in sys_page_map, look the page up under our own lock and
+	// hold a reference to it while we lock the receiver.
+	struct ipc_msg m;
+	int r;
+	if ((r = ipc_msg_get(srcva, perm, &m)) < 0) {
+		return r;
+	}
+
 	struct Env *dst_e;
-	if (envid2env(envid, &dst_e, 0) < 0) {
-		return -E_BAD_ENV;
+	if (envid2env_lock(envid, &dst_e, 0) < 0) {
+		r = -E_BAD_ENV;
+		goto out;
 	}
 
-	if (!dst_e->env_ipc_recving) {
-		return -E_IPC_NOT_RECV;
+	if (!ipc_accepts(dst_e, curenv->env_id)) {
+		r = -E_IPC_NOT_RECV;
+	} else if ((r = ipc_deliver(dst_e, curenv->env_id, value, &m)) == 0) {
+		sched_wakeup(dst_e);
 	}
+	env_unlock(dst_e);
+out:
+	ipc_msg_put(&m);
+	return r;
+}
 
-	pte_t *src_entry;
-	struct PageInfo *src_pg;
-	if (srcva < (void *) UTOP) {
-		src_pg = page_lookup(curenv->env_pgdir, srcva, &src_entry);
-		if ((uintptr_t) srcva % PGSIZE != 0 || !valid_perms(perm) ||
-				!src_pg || ((perm & PTE_W) && !(*src_entry & PTE_W))) {
-			return -E_INVAL;
-		}
-		if (dst_e->env_ipc_dstva < (void *) UTOP) {
-			if (page_insert(dst_e->env_pgdir, src_pg, dst_e->env_ipc_dstva, perm) < 0) {
-				return -E_NO_MEM;
-			}
-			dst_e->env_ipc_perm = perm;
+// Start receiving into dstva, accepting only messages from 'from' (or
+// from anyone if 'from' is 0).  If 'take_queued' is set and an
+// acceptable sender is already queued on us, take its message and
+// return 1; the message is in our env_ipc fields.  Otherwise mark
+// ourselves asleep and receiving and return 0; the caller must then
+// give up the CPU.
+static int
+ipc_recv_begin(void *dstva, envid_t from, bool take_queued)
+{
+	struct Env *s;
+	int r;
+
+	env_lock(curenv);
+	curenv->env_ipc_dstva = dstva;
+	ipc_waitfor[ENVX(curenv->env_id)] = from;
+
+	while (take_queued && (s = ipc_sendq_take(curenv))) {
+		struct ipc_sender *rec = &ipc_senders[ENVX(s->env_id)];
+		r = ipc_deliver(curenv, s->env_id, rec->value, &rec->msg);
+		ipc_sender_done(s, r);
+		if (r == 0) {
+			env_unlock(curenv);
+			return 1;
 		}
 	}
 
-	// mapping was successful or no mapping in ipc was attempted
-	dst_e->env_ipc_recving = 0;
-	dst_e->env_ipc_from = curenv->env_id;
-	dst_e->env_ipc_value = value;
-	dst_e->env_status = ENV_RUNNABLE;
+	// Go to sleep before advertising that we are receiving, and do
+	// both under our lock, so a sender on another CPU cannot wake us
+	// before we sleep.
+	sched_sleep(curenv);
+	curenv->env_ipc_recving = 1;
+	env_unlock(curenv);
+	return 0;
+}
 
-	// this part was not immediately obv to you... it's cause we did sched_yield so when
-	// we start running this env again the eax register will hold the pseudo return value
-	dst_e->env_tf.tf_regs.reg_eax = 0;
+// Send a message to envid, blocking until it is received, and, if
+// 'call' is set, then wait for a reply from envid into dstva.
+// Shared by sys_ipc_send and sys_ipc_call; only returns on error or
+// for a plain send that could not hand the CPU to the receiver.
+static int
+ipc_send_common(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		bool call, void *dstva)
+{
+	struct ipc_sender *rec = &ipc_senders[ENVX(curenv->env_id)];
+	struct Env *dst_e;
+	int r;
 
-	return 0;
+	if (envid == 0 || envid == curenv->env_id)
+		return -E_IPC_NOT_RECV;
+	if (call && dstva < (void *) UTOP && (uintptr_t) dstva % PGSIZE != 0)
+		return -E_INVAL;
+	// Nobody else touches our sender record until we queue it.
+	if ((r = ipc_msg_get(srcva, perm, &rec->msg)) < 0)
+		return r;
+
+	// A caller must be waiting for the reply before the receiver can
+	// see the request.  Anything envid queued for us before then is
+	// not the reply, so leave it for a later receive.
+	if (call)
+		ipc_recv_begin(dstva, envid, 0);
+
+	if ((r = envid2env_lock(envid, &dst_e, 0)) < 0)
+		goto fail;
+	// Nobody would fail us once the target's IPC state is torn down.
+	if (dst_e->env_status == ENV_DYING) {
+		env_unlock(dst_e);
+		r = -E_BAD_ENV;
+		goto fail;
+	}
+
+	if (ipc_accepts(dst_e, curenv->env_id)) {
+		r = ipc_deliver(dst_e, curenv->env_id, value, &rec->msg);
+		if (r == 0)
+			sched_wakeup(dst_e);
+		env_unlock(dst_e);
+		ipc_msg_put(&rec->msg);
+		if (r < 0)
+			goto fail;
+		// Direct handoff; env_run does not come back here, so
+		// set our return value first.  A caller's is set by the
+		// reply.
+		if (!call)
+			curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_switch(dst_e);
+		if (!call)
+			return 0;
+		sched_yield();
+	}
+
+	// Queue up on the target.  As in sys_ipc_recv, go to sleep before
+	// the receiver can see us.  The message is already in our record.
+	rec->dst = dst_e;
+	rec->next = NULL;
+	rec->value = value;
+	rec->call = call;
+	if (ipc_sendq[ENVX(dst_e->env_id)].tail)
+		ipc_senders[ENVX(ipc_sendq[ENVX(dst_e->env_id)].tail->env_id)].next = curenv;
+	else
+		ipc_sendq[ENVX(dst_e->env_id)].head = curenv;
+	ipc_sendq[ENVX(dst_e->env_id)].tail = curenv;
+	sched_sleep(curenv);
+	env_unlock(dst_e);
+	sched_yield();
+
+fail:
+	if (call) {
+		env_lock(curenv);
+		ipc_recv_cancel(curenv, r);
+		env_unlock(curenv);
+	}
+	ipc_msg_put(&rec->msg);
+	return r;
+}
+
+// Send 'value' (and the page at 'srcva', as in sys_ipc_try_send) to
+// 'envid', blocking until it is received.
+//
+// If the target is blocked in sys_ipc_recv, the message is delivered
+// at once and this CPU switches straight to the target, without a pass
+// through the scheduler; the caller stays runnable.  Otherwise the
+// caller queues on the target and sleeps until the target's next
+// sys_ipc_recv takes the message.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except that -E_IPC_NOT_RECV is only returned for a
+// send to oneself, which could never complete, and:
+//	-E_BAD_ENV if the target is destroyed before receiving.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return ipc_send_common(envid, value, srcva, perm, 0, 0);
+}
+
+// Send a request to 'envid' as sys_ipc_send does, then wait for its
+// reply as sys_ipc_recv(dstva) would, but accepting a message from
+// 'envid' only.  The reply is in thisenv's env_ipc fields as usual.
+// This saves a kernel entry over sys_ipc_send plus sys_ipc_recv, and
+// the reply cannot race with our getting ready to receive it.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_send and sys_ipc_recv, and:
+//	-E_BAD_ENV if 'envid' is destroyed before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	return ipc_send_common(envid, value, srcva, perm, 1, dstva);
 }
 
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
+// If a sender is already blocked in sys_ipc_send on us, take its
+// message and return at once instead.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
@@ -424,11 +1011,57 @@ sys_ipc_recv(void *dstva)
 		return -E_INVAL;
 	}
 	// dstva is either page-aligned and below UTOP or dstva is not above UTOP
-	curenv->env_ipc_recving = 1;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	if (ipc_recv_begin(dstva, 0, 1))
+		return 0;
+	sched_yield();
+}
+
+// Reply to the env we last received from (env_ipc_from) with 'value'
+// and the page at 'srcva', then receive the next message into 'dstva'
+// as sys_ipc_recv does.  Meant for servers answering sys_ipc_call.
+//
+// A reply that cannot be delivered because its target has died is
+// dropped, so that the server keeps serving.  If no request is
+// queued, this CPU switches straight to the env we replied to.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_IPC_NOT_RECV if the env we last received from exists but is
+//		not waiting for a reply (it sent with sys_ipc_send rather
+//		than sys_ipc_call, say).  Nothing is sent or received;
+//		the caller should fall back to a blocking send.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if srcva < UTOP and the page cannot be sent
+//		(see sys_ipc_try_send).
+static int
+sys_ipc_reply_recv(uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	struct ipc_msg m;
+	struct Env *dst_e, *replied = NULL;
+	int r;
+
+	if (dstva < (void *) UTOP && (uintptr_t) dstva % PGSIZE != 0)
+		return -E_INVAL;
+	if ((r = ipc_msg_get(srcva, perm, &m)) < 0)
+		return r;
+
+	if (envid2env_lock(curenv->env_ipc_from, &dst_e, 0) == 0) {
+		if (!ipc_accepts(dst_e, curenv->env_id)) {
+			r = dst_e->env_status == ENV_DYING ? 0 : -E_IPC_NOT_RECV;
+		} else if (ipc_deliver(dst_e, curenv->env_id, value, &m) == 0) {
+			sched_wakeup(dst_e);
+			replied = dst_e;
+		}
+		env_unlock(dst_e);
+	}
+	ipc_msg_put(&m);
+	if (r < 0)
+		return r;
+
+	if (ipc_recv_begin(dstva, 0, 1))
+		return 0;
+	if (replied)
+		sched_switch(replied);
 	sched_yield();
-	return 0;
 }
 
 static int
@@ -437,7 +1070,9 @@ sys_blk_write(uint32_t secno, void *buf, size_t nsecs)
 	// LAB 5: Your code here.
 	// Check that the user has permission for buf.
 	int r;
-	if ((r = user_mem_check(curenv, buf, BLKSIZE, PTE_U)) == 0) {
+	if (nsecs > BLK_MAXIOV * BLKSECTS)
+		return -E_INVAL;
+	if ((r = user_mem_check(curenv, buf, nsecs * SECTSIZE, PTE_U)) == 0) {
 		return nvme_write((uint64_t) secno, buf, (uint16_t) nsecs);
 	}
 	return r;
@@ -449,12 +1084,130 @@ sys_blk_read(uint32_t secno, void *buf, size_t nsecs)
 	// LAB 5: Your code here.
 	// Check that the user has permission for buf.
 	int r;
-	if ((r = user_mem_check(curenv, buf, BLKSIZE, PTE_U)) == 0) {
+	if (nsecs > BLK_MAXIOV * BLKSECTS)
+		return -E_INVAL;
+	if ((r = user_mem_check(curenv, buf, nsecs * SECTSIZE, PTE_U)) == 0) {
 		return nvme_read((uint64_t) secno, buf, (uint16_t) nsecs);
 	}
 	return r;
 }
 
+// Read (or write, if 'write' is set) nbufs consecutive blocks
+// starting at sector secno into (from) the page-aligned blocks at
+// bufs[0..nbufs-1], in one disk command.  Returns the number of
+// sectors transferred, or < 0 on error:
+//	-E_INVAL if nbufs is not between 1 and BLK_MAXIOV (or the
+//		disk's own limit), or a buffer is not page-aligned.
+//	-E_FAULT if the array or a buffer is not mapped, or a buffer
+//		is read-only for a read.
+static int
+sys_blk_rwv(bool write, uint32_t secno, void *const *bufs, size_t nbufs)
+{
+	void *kbufs[BLK_MAXIOV];
+	int r;
+
+	if (nbufs == 0 || nbufs > BLK_MAXIOV)
+		return -E_INVAL;
+	if ((r = user_mem_check(curenv, bufs, nbufs * sizeof(bufs[0]), PTE_U)) < 0)
+		return r;
+	// Copy the array, so that it cannot change under us.
+	memcpy(kbufs, bufs, nbufs * sizeof(bufs[0]));
+	if (write)
+		return nvme_writev((uint64_t) secno, kbufs, nbufs);
+	return nvme_readv((uint64_t) secno, kbufs, nbufs);
+}
+
+// Start an asynchronous disk read, or write if 'write' is set, of
+// nsecs sectors at secno into the page at buf.  Returns a tag to
+// match with the completion from sys_blk_reap, or < 0 on error (see
+// nvme_submit).
+static int
+sys_blk_submit(int write, uint32_t secno, void *buf, size_t nsecs)
+{
+	return nvme_submit(write, (uint64_t) secno, buf, (uint16_t) nsecs);
+}
+
+// Store up to max of our finished sys_blk_submit commands in done,
+// without waiting, and return how many there were.
+static int
+sys_blk_reap(struct blk_done *done, int max)
+{
+	int r;
+
+	if (max <= 0 || max > PGSIZE)
+		return -E_INVAL;
+	if ((r = user_mem_check(curenv, done, max * sizeof(*done),
+				PTE_U | PTE_W)) < 0)
+		return r;
+	return nvme_reap(done, max);
+}
+
+// Look up the futex key, the physical address, of curenv's word at
+// addr, which must be aligned and readable.  Caller holds curenv's lock.
+static int
+futex_key(uint32_t *addr, physaddr_t *key_store)
+{
+	struct PageInfo *pp;
+
+	if ((uintptr_t) addr % sizeof(uint32_t) != 0)
+		return -E_INVAL;
+	if (user_mem_check(curenv, addr, sizeof(uint32_t), PTE_U) < 0
+	    || !(pp = page_lookup(curenv->env_pgdir, addr, NULL)))
+		return -E_FAULT;
+	*key_store = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Sleep until a sys_futex_wake on the word at addr, provided it still
+// holds expected, or, if timeout is not 0, until timeout nanoseconds
+// have passed.  Words are matched by physical address, so they work
+// between environments sharing a page.  The sleep also ends, early, when
+// any mapping of the word's page is removed; as with any wakeup, the
+// caller must check whatever it was waiting for again.
+//
+// Returns 0 once woken or timed out.  Errors are:
+//	-E_AGAIN if the word did not hold expected.
+//	-E_INVAL if addr is not 4-byte aligned.
+//	-E_FAULT if addr is not readable.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t expected, nanoseconds_t timeout)
+{
+	nanoseconds_t deadline = 0;
+	physaddr_t key;
+	int r;
+
+	// Time only moves on ticks, so this sleeps at least timeout.
+	if (timeout)
+		deadline = time_now() + timeout + NANOSECONDS_PER_TICK;
+	env_lock(curenv);
+	if ((r = futex_key(addr, &key)) == 0) {
+		// What the call returns once woken
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		r = futex_wait(curenv, key, expected, deadline);
+	}
+	env_unlock(curenv);
+	if (r < 0)
+		return r;
+	sched_yield();
+}
+
+// Wake up to n environments sleeping in sys_futex_wait on the word at
+// addr.  Returns the number woken, or -E_INVAL or -E_FAULT as
+// sys_futex_wait.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int r;
+
+	env_lock(curenv);
+	r = futex_key(addr, &key);
+	env_unlock(curenv);
+	if (r < 0)
+		return r;
+	return futex_wake(key, n);
+}
+
 static int
 sys_batch(struct batch *sys_calls, uint32_t num_calls)
 {
@@ -512,6 +1265,11 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_exofork :
 		return sys_exofork();
 
+	case SYS_fork :
+		// copy the current environment, copy-on-write, or share
+		// everything but the stack with it if a1 is set
+		return sys_fork((bool) a1);
+
 	case SYS_env_set_status :
 		// set env corresponding with envid in a1 to have status held in a2
 		return sys_env_set_status(a1, (int) a2);
@@ -529,6 +1287,21 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		// a2 and the mapping stored in a3 with perm bits a4
 		return sys_ipc_try_send(a1, a2, (void *) a3, (int) a4);
 
+	case SYS_ipc_send :
+		// send to env a1 the value in a2 and the mapping stored in a3
+		// with perm bits a4, blocking until it is received
+		return sys_ipc_send(a1, a2, (void *) a3, (int) a4);
+
+	case SYS_ipc_call :
+		// send to env a1 the value in a2 and the mapping stored in a3
+		// with perm bits a4, then wait for its reply into dstva a5
+		return sys_ipc_call(a1, a2, (void *) a3, (int) a4, (void *) a5);
+
+	case SYS_ipc_reply_recv :
+		// reply to the last sender with value a1 and the mapping in a2
+		// with perm bits a3, then wait for the next message into a4
+		return sys_ipc_reply_recv(a1, (void *) a2, (int) a3, (void *) a4);
+
 	case SYS_ipc_recv :
 		// block for ipc with mapping for dstva stored in a1
 		return sys_ipc_recv((void *) a1);
@@ -541,11 +1314,42 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		// read fron buffer in a2
 		return sys_blk_read(a1, (void *) a2, a3);
 
+	case SYS_blk_submit :
+		// start reading (a1 == 0) or writing a4 sectors at a2 into
+		// the buffer at a3
+		return sys_blk_submit(a1, a2, (void *) a3, a4);
+
+	case SYS_blk_reap :
+		// store up to a2 finished disk commands in array a1
+		return sys_blk_reap((struct blk_done *) a1, a2);
+
+	case SYS_blk_readv :
+		// read a3 blocks at sector a1 into the pages in array a2
+		return sys_blk_rwv(0, a1, (void *const *) a2, a3);
+
+	case SYS_blk_writev :
+		// write the a3 pages in array a2 to the blocks at sector a1
+		return sys_blk_rwv(1, a1, (void *const *) a2, a3);
+
 	case SYS_env_set_trapframe :
 		// set trapframe of env corresponding with envid a1 to one
 		// at a2 
 		return sys_env_set_trapframe(a1, (struct Trapframe *) a2);
 
+	case SYS_env_set_priority :
+		// set scheduling class a2 and fair-share weight a3 of env a1
+		return sys_env_set_priority(a1, (int) a2, a3);
+
+	case SYS_futex_wait :
+		// sleep on the word at a1 if it holds a2, for at most
+		// the nanoseconds in a3 (low) and a4 (high), if not 0
+		return sys_futex_wait((uint32_t *) a1, a2,
+				      a3 | (nanoseconds_t) a4 << 32);
+
+	case SYS_futex_wake :
+		// wake up to a2 sleepers on the word at a1
+		return sys_futex_wake((uint32_t *) a1, (int) a2);
+
 	case SYS_batch:
 		// batch a2 calls held in batch array a1
 		return sys_batch((struct batch *) a1, a2);
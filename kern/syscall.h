@@ -4,8 +4,10 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
 #include <inc/syscall.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void ipc_env_free(struct Env *e);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -5,8 +5,7 @@
 #include <kern/cpu.h>
 #include <kern/sysinfo.h>
 #include <kern/pmap.h>
-
-#define NANOSECONDS_PER_TICK	(10 * NANOSECONDS_PER_MILLISECOND)
+#include <kern/sched.h>
 
 static uint64_t ticks = 0;
 uint64_t inblocks, outblocks;
@@ -22,15 +21,24 @@ time_tick(void)
 		panic("time_tick: time overflowed");
 }
 
+// Time since boot, to the last timer tick.
+nanoseconds_t
+time_now(void)
+{
+	return ticks * NANOSECONDS_PER_TICK;
+}
+
 int
 sysinfo(struct sysinfo *info)
 {
-	info->uptime = ticks * NANOSECONDS_PER_TICK;
+	info->uptime = time_now();
+	info->ncpus = ncpu;
 	info->totalpages = npages;
 	info->freepages = nfreepages;
 	info->inblocks = inblocks;
 	info->outblocks = outblocks;
 	info->inpackets = inpackets;
 	info->outpackets = outpackets;
+	sched_stats(info);
 	return 0;
 }
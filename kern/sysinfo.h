@@ -6,10 +6,13 @@
 
 #include <inc/sysinfo.h>
 
+#define NANOSECONDS_PER_TICK	(10 * NANOSECONDS_PER_MILLISECOND)
+
 extern uint64_t inblocks, outblocks;
 extern uint64_t inpackets, outpackets;
 
 void	time_tick(void);
+nanoseconds_t	time_now(void);
 int	sysinfo(struct sysinfo *info);
 
 #endif	// !JOS_KERN_SYSINFO_H
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -12,6 +13,8 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/sysinfo.h>
+#include <kern/futex.h>
+#include <kern/nvme.h>
 
 // static struct Taskstate ts;
 
@@ -61,6 +64,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno >= IRQ_OFFSET + IRQ_NVME && trapno < IRQ_OFFSET + IRQ_NVME + NCPU)
+		return "NVMe Interrupt";
 	return "(unknown trap)";
 }
 
@@ -103,6 +108,14 @@ void i_t_45(); // ?
 void i_t_46();
 void i_t_47(); // ?
 void i_t_51();
+void i_t_52();
+void i_t_53();
+void i_t_54();
+void i_t_55();
+void i_t_56();
+void i_t_57();
+void i_t_58();
+void i_t_59();
 
 void
 trap_init(void)
@@ -146,6 +159,14 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, 0x8, &i_t_46, 0);
 	SETGATE(idt[IRQ_OFFSET + 15], 0, 0x8, &i_t_47, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, 0x8, &i_t_51, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 0], 0, 0x8, &i_t_52, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 1], 0, 0x8, &i_t_53, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 2], 0, 0x8, &i_t_54, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 3], 0, 0x8, &i_t_55, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 4], 0, 0x8, &i_t_56, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 5], 0, 0x8, &i_t_57, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 6], 0, 0x8, &i_t_58, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_NVME + 7], 0, 0x8, &i_t_59, 0);
 
 	SETGATE(idt[T_SYSCALL], 0, 0x8, &i_t_SYSCALL, 3);
 
@@ -276,7 +297,11 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
-		time_tick();
+		// Every CPU gets timer interrupts; only one keeps time.
+		if (thiscpu == bootcpu) {
+			time_tick();
+			futex_expire(time_now());
+		}
 		sched_yield();
 	}
 	// Add time tick increment to clock interrupts.
@@ -298,6 +323,14 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// NVMe completion interrupts, one vector per I/O queue.
+	if (tf->tf_trapno >= IRQ_OFFSET + IRQ_NVME &&
+	    tf->tf_trapno < IRQ_OFFSET + IRQ_NVME + NCPU) {
+		lapic_eoi();
+		nvme_intr(tf->tf_trapno - IRQ_OFFSET - IRQ_NVME);
+		return;
+	}
+
 	if (tf->tf_trapno == T_SYSCALL) {
 		tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
 					      tf->tf_regs.reg_edx,
@@ -330,10 +363,8 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_halt()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -343,16 +374,12 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
 		assert(curenv);
-		lock_kernel();
 
-		// Garbage collect if current enviroment is a zombie
+		// Garbage collect if current enviroment is a zombie.
+		// Only this CPU can free it, since it is our curenv.
 		if (curenv->env_status == ENV_DYING) {
 			env_free(curenv);
-			curenv = NULL;
 			sched_yield();
 		}
 
@@ -374,13 +401,45 @@ trap(struct Trapframe *tf)
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
 	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
-	else
-		sched_yield();
+	sched_resume();
 }
 
 
+// Resolve a user write to a copy-on-write page of curenv without a
+// trip through the page fault upcall: give curenv its own copy, or,
+// if nobody else maps the page any more, just make it writable.  A
+// write through a page table fork left shared first gets curenv its
+// own table, which may be all the fault needed.
+// Returns 0 if the fault was handled, -E_INVAL if it was not a COW
+// fault, -E_NO_MEM if there was no page for the copy.
+static int
+cow_fault(uint32_t fault_va, uint32_t err)
+{
+	void *va = ROUNDDOWN((void *) fault_va, PGSIZE);
+	pte_t *pte;
+	int r = 0;
+
+	if ((err & (FEC_PR | FEC_WR)) != (FEC_PR | FEC_WR) || fault_va >= UTOP)
+		return -E_INVAL;
+
+	// The lock keeps pages from being mapped out of curenv meanwhile,
+	// so a page it alone holds stays that way.
+	env_lock(curenv);
+	if ((r = pgdir_unshare(curenv->env_pgdir, va)) < 0)
+		goto out;
+	pte = pgdir_walk(curenv->env_pgdir, va, 0);
+	if (pte && (*pte & (PTE_P | PTE_U | PTE_W)) == (PTE_P | PTE_U | PTE_W))
+		goto out;
+	if (!pte || (*pte & (PTE_P | PTE_U | PTE_COW)) != (PTE_P | PTE_U | PTE_COW)) {
+		r = -E_INVAL;
+		goto out;
+	}
+	r = page_cow_break(curenv->env_pgdir, pte, va);
+out:
+	env_unlock(curenv);
+	return r;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -398,6 +457,10 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// Copy-on-write faults never reach the upcall.
+	if (cow_fault(fault_va, tf->tf_err) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
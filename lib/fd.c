@@ -6,14 +6,15 @@
 #define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
-// Bottom of file data area.  We reserve one data page for each FD,
-// which devices can use if they choose.
+// Bottom of file data area.  We reserve FDDATAPAGES data pages for
+// each FD, which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
+#define FDDATAPAGES	2
 
 // Return the 'struct Fd*' for file descriptor index i
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
-// Return the file data page for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Return the first file data page for file descriptor index i
+#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*FDDATAPAGES*PGSIZE))
 
 
 // --------------------------------------------------------------
@@ -173,7 +174,7 @@ close_all(void)
 int
 dup(int oldfdnum, int newfdnum)
 {
-	int r;
+	int r, i;
 	char *ova, *nva;
 	pte_t pte;
 	struct Fd *oldfd, *newfd;
@@ -186,9 +187,15 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
+	// The data pages go before the fd page, as pipe close detection
+	// needs.
+	for (i = 0; i < FDDATAPAGES*PGSIZE; i += PGSIZE) {
+		if (!(uvpd[PDX(ova + i)] & PTE_P) || !(uvpt[PGNUM(ova + i)] & PTE_P))
+			continue;
+		if ((r = sys_page_map(0, ova + i, 0, nva + i,
+				      uvpt[PGNUM(ova + i)] & PTE_SYSCALL)) < 0)
 			goto err;
+	}
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -196,7 +203,10 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	sys_page_unmap(0, nva);
+	while (i > 0) {
+		i -= PGSIZE;
+		sys_page_unmap(0, nva + i);
+	}
 	return r;
 }
 
@@ -302,6 +312,8 @@ fstat(int fdnum, struct Stat *stat)
 	stat->st_name[0] = 0;
 	stat->st_size = 0;
 	stat->st_type = 0;
+	stat->st_ino = 0;
+	stat->st_gen = 0;
 	stat->st_dev = dev;
 	return (*dev->dev_stat)(fd, stat);
 }
@@ -6,6 +6,8 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +17,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -24,8 +25,172 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but for a request whose body is just the first 'len'
+// bytes of fsipcbuf: send those as inline IPC words rather than
+// mapping fsipcbuf into the file server.  An inline reply is copied
+// back to the start of fsipcbuf.
+static int
+fsipc_inline(unsigned type, size_t len)
+{
+	int r;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_inline %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+
+	r = ipc_call(fsenv, type, &fsipcbuf, IPC_INLINE(ROUNDUP(len, 4) / 4),
+		     NULL, NULL);
+	if (r >= 0)
+		memmove(&fsipcbuf, (void *) thisenv->env_ipc_words,
+			thisenv->env_ipc_nwords * 4);
+	return r;
+}
+
+// The shared ring transport (see struct Fsring in inc/fs.h), used by
+// reads, writes and stats once fsring_enable has set it up.  The ring
+// and its data pages are PTE_SHARE so that fork does not make them
+// copy-on-write under the file server; a child sees them but uses the
+// ring only if it sets up its own.
+
+#define FSRINGVA	0xCF000000
+#define FSRINGBUF(i)	((char *) FSRINGVA + (1 + (i)) * PGSIZE)
+
+static struct Fsring *const fsring = (struct Fsring *) FSRINGVA;
+static envid_t fsring_owner;	// env that set up the ring, if any
+static uint32_t fsring_next;	// next request slot to fill
+
+// Set up a ring shared with the file server, and send file requests
+// through it from now on.
+int
+fsring_enable(void)
+{
+	int i, r;
+
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	fsring_owner = 0;
+	if ((r = sys_page_alloc(0, fsring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	if ((r = ipc_call(fsenv, FSREQ_RING_SETUP, fsring,
+			  PTE_P|PTE_U|PTE_W, NULL, NULL)) < 0)
+		goto fail;
+	for (i = 0; i < FSRING_NBUF; i++) {
+		if ((r = sys_page_alloc(0, FSRINGBUF(i),
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			goto fail;
+		if ((r = ipc_call(fsenv, FSREQ_RING_BUF, FSRINGBUF(i),
+				  PTE_P|PTE_U|PTE_W, NULL, NULL)) < 0)
+			goto fail;
+	}
+	fsring_next = 0;
+	fsring_owner = thisenv->env_id;
+	return 0;
+
+fail:
+	// The server lets go of the ring once we do.
+	sys_page_unmap(0, fsring);
+	return r;
+}
+
+static bool
+fsring_ready(void)
+{
+	return fsring_owner != 0 && fsring_owner == thisenv->env_id;
+}
+
+// Queue a request, using data page 'buf'; fsring_submit hands it to
+// the server.
+static void
+fsring_push(uint32_t op, struct Fd *fd, off_t offset, size_t n, uint32_t buf)
+{
+	struct Fsring_sqe *sqe = &fsring->sq[fsring_next % FSRING_NENT];
+
+	sqe->op = op;
+	sqe->fileid = fd->fd_file.id;
+	sqe->offset = offset;
+	sqe->n = n;
+	sqe->buf = buf;
+	sqe->tag = buf;
+	fsring_next++;
+}
+
+static void
+fsring_submit(void)
+{
+	uint32_t old_tail = fsring->sq_tail;
+
+	fsring->sq_tail = fsring_next;
+	// Pairs with the fence in the server's ring_poll: if it has
+	// already taken everything up to old_tail, it may be blocked
+	// without having seen our new requests.
+	asm volatile("mfence" ::: "memory");
+	if (fsring->sq_head == old_tail)
+		sys_ipc_send(fsenv, FSREQ_RING_DOORBELL, (void *) -1, 0);
+}
+
+// Wait for n completions, storing the result of each in res[tag].
+static int
+fsring_reap(int32_t *res, int n)
+{
+	struct Fsring_cqe *cqe;
+	int r;
+
+	while (n > 0) {
+		if (fsring->cq_head == fsring->cq_tail) {
+			if ((r = fsipc_inline(FSREQ_RING_WAIT, 0)) < 0)
+				return r;
+			continue;
+		}
+		cqe = &fsring->cq[fsring->cq_head % FSRING_NENT];
+		res[cqe->tag] = cqe->res;
+		fsring->cq_head++;
+		n--;
+	}
+	return 0;
+}
+
+// Read or write up to FSRING_NBUF pages at fd's offset with a single
+// batch of ring requests.
+static ssize_t
+fsring_rw(uint32_t op, struct Fd *fd, void *buf, size_t n)
+{
+	int32_t res[FSRING_NBUF];
+	size_t total = 0, m;
+	int i, nreq, r;
+
+	nreq = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSRING_NBUF);
+	for (i = 0; i < nreq; i++) {
+		m = MIN(n - i * PGSIZE, PGSIZE);
+		if (op == FSRING_WRITE)
+			memmove(FSRINGBUF(i), (char *) buf + i * PGSIZE, m);
+		fsring_push(op, fd, fd->fd_offset + i * PGSIZE, m, i);
+	}
+	fsring_submit();
+	if ((r = fsring_reap(res, nreq)) < 0)
+		return r;
+
+	// Stop at the first error or short transfer.
+	for (i = 0; i < nreq; i++) {
+		if (res[i] < 0) {
+			if (total == 0)
+				return res[i];
+			break;
+		}
+		if (op == FSRING_READ)
+			memmove((char *) buf + total, FSRINGBUF(i), res[i]);
+		total += res[i];
+		if (res[i] < MIN(n - i * PGSIZE, PGSIZE))
+			break;
+	}
+	fd->fd_offset += total;
+	return total;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -100,7 +265,7 @@ static int
 devfile_flush(struct Fd *fd)
 {
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc_inline(FSREQ_FLUSH, sizeof(fsipcbuf.flush));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -117,6 +282,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (fsring_ready())
+		return fsring_rw(FSRING_READ, fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -144,6 +312,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	int r;
 	size_t new_n = n;
 
+	if (fsring_ready())
+		return fsring_rw(FSRING_WRITE, fd, (void *) buf, n);
+
 	if (new_n > PGSIZE) {
 		new_n = PGSIZE;
 	}
@@ -162,14 +333,26 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
+	struct Fsret_stat *ret = &fsipcbuf.statRet;
+	int32_t res;
 	int r;
 
-	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
-		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_type = fsipcbuf.statRet.ret_type;
+	if (fsring_ready()) {
+		fsring_push(FSRING_STAT, fd, 0, 0, 0);
+		fsring_submit();
+		if ((r = fsring_reap(&res, 1)) < 0 || (r = res) < 0)
+			return r;
+		ret = (struct Fsret_stat *) FSRINGBUF(0);
+	} else {
+		fsipcbuf.stat.req_fileid = fd->fd_file.id;
+		if ((r = fsipc_inline(FSREQ_STAT, sizeof(fsipcbuf.stat))) < 0)
+			return r;
+	}
+	strcpy(st->st_name, ret->ret_name);
+	st->st_size = ret->ret_size;
+	st->st_type = ret->ret_type;
+	st->st_ino = ret->ret_ino;
+	st->st_gen = ret->ret_gen;
 	return 0;
 }
 
@@ -179,9 +362,67 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 {
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	return fsipc_inline(FSREQ_SET_SIZE, sizeof(fsipcbuf.set_size));
+}
+
+
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
+// Map the block of file fdnum at offset, a multiple of BLKSIZE,
+// read-only at va.  The page is the file server's cached copy of the
+// block, not a copy of it, so later writes to the file may or may not
+// show through it.
+// Returns the number of bytes of file data in the page, or 0 at the
+// end of the file, when nothing is mapped.
+int
+readmap(int fdnum, off_t offset, void *va)
+{
+	struct Fsreq_readmap req;
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	// Build the request on the stack, not in fsipcbuf: mmap's fault
+	// handler calls us, possibly in the middle of filling fsipcbuf
+	// from a mapped page.
+	req.req_fileid = fd->fd_file.id;
+	req.req_offset = offset;
+	return ipc_call(fsenv, FSREQ_READMAP, &req,
+			IPC_INLINE(sizeof(struct Fsreq_readmap) / 4), va, NULL);
 }
 
+// Map len bytes of file fdnum from offset, a multiple of BLKSIZE,
+// read-only at va, a page at a time with readmap.  Returns the number
+// of bytes of file data mapped, which is less than len only at the end
+// of the file.
+int
+fmap(int fdnum, void *va, size_t len, off_t offset)
+{
+	size_t done;
+	int r;
+
+	for (done = 0; done < len; done += PGSIZE) {
+		if ((r = readmap(fdnum, offset + done, (char *) va + done)) < 0)
+			return r;
+		if (r < PGSIZE)
+			return MIN(done + r, len);
+	}
+	return len;
+}
 
 // Synchronize disk with buffer cache
 int
@@ -190,6 +431,43 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_inline(FSREQ_SYNC, 0);
+}
+
+// Turn file server readahead on (1) or off (0), or leave it (-1),
+// empty the server's block cache if 'drop' is set, limit it to
+// 'capacity' blocks unless that is 0, and fetch the block cache
+// counters into *st if st is not NULL.
+int
+fs_cachestat(int readahead, bool drop, uint32_t capacity,
+	     struct Fsret_cachestat *st)
+{
+	int r;
+
+	fsipcbuf.cachestat.req_readahead = readahead;
+	fsipcbuf.cachestat.req_drop = drop;
+	fsipcbuf.cachestat.req_capacity = capacity;
+	if ((r = fsipc_inline(FSREQ_CACHESTAT, sizeof(struct Fsreq_cachestat))) < 0)
+		return r;
+	if (st)
+		*st = fsipcbuf.cachestatRet;
+	return 0;
+}
+
+// Turn the file server's path lookup cache on (1) or off (0), or
+// leave it (-1), empty it and zero its counters if 'flush' is set,
+// and fetch the counters into *st if st is not NULL.
+int
+fs_dcachestat(int enable, bool flush, struct Fsret_dcachestat *st)
+{
+	int r;
+
+	fsipcbuf.dcachestat.req_enable = enable;
+	fsipcbuf.dcachestat.req_flush = flush;
+	if ((r = fsipc_inline(FSREQ_DCACHESTAT, sizeof(struct Fsreq_dcachestat))) < 0)
+		return r;
+	if (st)
+		*st = fsipcbuf.dcachestatRet;
+	return 0;
 }
 
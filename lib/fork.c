@@ -5,10 +5,6 @@
 #include <inc/batch.h>
 #include <inc/malloc.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -27,10 +23,14 @@ pgfault(struct UTrapframe *utf)
 	//   (see <inc/memlayout.h>).
 
 	// LAB 4: Your code here.
+	// ufork replaces any handler mmap installed, so let it resolve
+	// faults on file mappings first.
+	if (mmap_fault(utf) == 0)
+		return;
 	if ((err & FEC_WR) == 0) {
 		panic("pgfault was not from a write\n");
 	}
-	if ((uvpt[PGNUM(addr)] & PTE_COW) == 0) {
+	if (!(uvpd[PDX(addr)] & PTE_P) || (uvpt[PGNUM(addr)] & PTE_COW) == 0) {
 		panic("address is not a COW address\n");
 	}
 	// Allocate a new page, map it at a temporary location (PFTEMP),
@@ -79,8 +79,8 @@ duppage(envid_t envid, unsigned pn, struct batch **calls, int *num)
 	int flags = PTE_U | PTE_P;
 	struct batch *fork_calls = *calls;
 	int addr = pn * PGSIZE;
-	if (uvpt[pn] & PTE_SHARE) {
-		// page at pn is sharable
+	if (uvpt[pn] & (PTE_SHARE | PTE_ALIAS)) {
+		// page at pn is sharable, or shared with our threads
 		setup_batch(&fork_calls[(*num)++], SYS_page_map, 0, addr,
 				envid, addr, uvpt[pn] & PTE_SYSCALL);
 		//r = sys_page_map(0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL);
@@ -129,8 +129,11 @@ duppage(envid_t envid, unsigned pn, struct batch **calls, int *num)
 //   Neither user exception stack should ever be marked copy-on-write,
 //   so you must allocate a new page for the child's user exception stack.
 //
+// fork() below has the kernel do all this in one system call; this
+// version is kept for comparison.
+//
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	set_pgfault_handler(&pgfault);
@@ -196,10 +199,36 @@ fork(void)
 	//return envid;
 }
 
-// Challenge!
-int
+//
+// Fork with the kernel copying the address space (sys_fork).  The
+// kernel also resolves the copy-on-write faults that follow, so unlike
+// ufork this needs no page fault handler.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork(0)) == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
+
+//
+// Fork a thread: the child shares all our memory except the stack,
+// which it gets a copy-on-write copy of, as with fork.  thisenv lives
+// in UTLS, next to the stack, so each thread has its own.  Only memory
+// mapped at the time of the call is shared; pages either thread maps
+// afterwards, including those malloc and mmap hand out, are its own.
+// The shared memory stays shared with children that any of the threads
+// forks later, as PTE_SHARE pages do.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t envid;
+
+	if ((envid = sys_fork(1)) == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
 }
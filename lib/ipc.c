@@ -2,6 +2,9 @@
 
 #include <inc/lib.h>
 
+static int32_t ipc_result(int r, envid_t *from_env_store, void *pg,
+			  int *perm_store);
+
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
 //	that address.
@@ -29,6 +32,49 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	} else {
 		r = sys_ipc_recv((void *) -1);
 	}
+	return ipc_result(r, from_env_store, pg, perm_store);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, which is received as by ipc_recv.
+// Returns the reply value, or the error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_call(to_env, val, pg ? pg : (void *) -1, perm,
+			 rcv_pg ? rcv_pg : (void *) -1);
+	return ipc_result(r, NULL, rcv_pg, perm_store);
+}
+
+// Reply with 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to the
+// env we last received from, then receive the next message as by
+// ipc_recv.  For servers answering ipc_call.
+int32_t
+ipc_reply_recv(uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	r = sys_ipc_reply_recv(val, pg ? pg : (void *) -1, perm,
+			       rcv_pg ? rcv_pg : (void *) -1);
+	if (r == -E_IPC_NOT_RECV) {
+		// The client used ipc_send and ipc_recv rather than
+		// ipc_call; reply the slow way.  Drop the reply if the
+		// client has gone away meanwhile.
+		sys_ipc_send(thisenv->env_ipc_from, val,
+			     pg ? pg : (void *) -1, perm);
+		return ipc_recv(from_env_store, rcv_pg, perm_store);
+	}
+	return ipc_result(r, from_env_store, rcv_pg, perm_store);
+}
+
+// Finish a receive that returned r into 'pg' for the functions above.
+static int32_t
+ipc_result(int r, envid_t *from_env_store, void *pg, int *perm_store)
+{
 	if (from_env_store) {
 		if (r == 0) {
 			*from_env_store = thisenv->env_ipc_from;
@@ -51,12 +97,11 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// The kernel blocks us until 'toenv' receives the message.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -66,13 +111,8 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		pg = (void *) -1;
 	}	
 	int r;
-	while ((r = sys_ipc_try_send(to_env, val, pg, perm))) {
-		// some error ocurred
-		if (r == -E_IPC_NOT_RECV) {
-			sys_yield();
-		} else {
-			panic("ipc_send failed\n");
-		}
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0) {
+		panic("ipc_send failed: %e\n", r);
 	}
 }
 
@@ -5,7 +5,6 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
 
 void
@@ -13,6 +12,11 @@ libmain(int argc, char **argv)
 {
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
+	// Whoever built our address space may have left UTLS unmapped;
+	// a fork child already has its parent's copy.
+	if (!(uvpd[PDX(UTLS)] & PTE_P) || !(uvpt[PGNUM(UTLS)] & PTE_P))
+		if (sys_page_alloc(0, (void *) UTLS, PTE_P | PTE_U | PTE_W) < 0)
+			sys_env_destroy(0);
 	thisenv = envs + ENVX(sys_getenvid());
 
 	// save the name of the program so that panic() can use it
@@ -0,0 +1,196 @@
+// Memory-mapped files.
+//
+// mmap only reserves address space; nothing is mapped until a page is
+// touched.  The page fault handler then asks the file server for the
+// block with readmap, which maps the server's cached page read-only.
+// Every environment reading the same block shares that one page.  A
+// PROT_WRITE mapping is private: the first write to a page replaces it
+// with a copy, and writes never reach the file.
+
+#include <inc/lib.h>
+
+// Mappings are placed in [MMAPBASE, MMAPTOP), clear of malloc's arena.
+#define MMAPBASE	0xA0000000
+#define MMAPTOP		0xC0000000
+#define NMMAP		32
+
+struct Mmap {
+	uintptr_t mm_va;	// 0 if the slot is free
+	size_t mm_len;		// page multiple
+	off_t mm_offset;	// file offset mapped at mm_va
+	int mm_fdnum;		// our own dup of the caller's fd
+	int mm_prot;
+};
+
+static struct Mmap mmaps[NMMAP];
+static uintptr_t mmap_next = MMAPBASE;
+static void (*mmap_prev_handler)(struct UTrapframe *utf);
+
+static struct Mmap *
+mmap_find(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaps[i].mm_va && mmaps[i].mm_va <= va
+		    && va < mmaps[i].mm_va + mmaps[i].mm_len)
+			return &mmaps[i];
+	return NULL;
+}
+
+// Find len bytes of address space for a new mapping.  Space is handed
+// out upwards and only reclaimed once every mapping is gone.
+static uintptr_t
+mmap_reserve(size_t len)
+{
+	int i;
+
+	for (i = 0; i < NMMAP && !mmaps[i].mm_va; i++)
+		;
+	if (i == NMMAP)
+		mmap_next = MMAPBASE;
+	if (len > MMAPTOP - mmap_next)
+		return 0;
+	mmap_next += len;
+	return mmap_next - len;
+}
+
+// Give a private, writable copy of the page at pg the first len bytes
+// of the page now mapped there, zero-filling the rest.
+static int
+mmap_copy(void *pg, size_t len)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if (len)
+		memcpy(PFTEMP, pg, len);
+	memset((char *) PFTEMP + len, 0, PGSIZE - len);
+	if ((r = sys_page_map(0, PFTEMP, 0, pg, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	return sys_page_unmap(0, PFTEMP);
+}
+
+// Resolve a fault on a mapped file page.  Returns 0 if the fault was
+// handled, -E_INVAL if the address is not in any mapping.  Faults that
+// are in a mapping but cannot be satisfied panic, like any other bad
+// access would.
+int
+mmap_fault(struct UTrapframe *utf)
+{
+	uintptr_t va = utf->utf_fault_va;
+	struct Mmap *m;
+	void *pg;
+	off_t off;
+	int r;
+
+	if ((m = mmap_find(va)) == NULL)
+		return -E_INVAL;
+	pg = ROUNDDOWN((void *) va, PGSIZE);
+	off = m->mm_offset + ((uintptr_t) pg - m->mm_va);
+
+	if ((utf->utf_err & FEC_WR) && !(m->mm_prot & PROT_WRITE))
+		panic("write to read-only file mapping at %08x, eip %08x",
+		      va, utf->utf_eip);
+
+	if (!(uvpd[PDX(pg)] & PTE_P) || !(uvpt[PGNUM(pg)] & PTE_P)) {
+		if ((r = readmap(m->mm_fdnum, off, pg)) < 0)
+			panic("mmap: readmap at offset %d: %e", off, r);
+		// The cached block's tail past the end of the file, or a
+		// page wholly past it, must read as zeros.
+		if (r < PGSIZE) {
+			if ((r = mmap_copy(pg, r)) < 0)
+				panic("mmap: %e", r);
+			return 0;
+		}
+	}
+	if ((utf->utf_err & FEC_WR) && !(uvpt[PGNUM(pg)] & PTE_W))
+		if ((r = mmap_copy(pg, PGSIZE)) < 0)
+			panic("mmap: %e", r);
+	return 0;
+}
+
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	if (mmap_fault(utf) == 0)
+		return;
+	if (mmap_prev_handler) {
+		mmap_prev_handler(utf);
+		return;
+	}
+	panic("page fault at va %08x, eip %08x", utf->utf_fault_va, utf->utf_eip);
+}
+
+// Map len bytes of file fdnum from offset, a multiple of PGSIZE, with
+// protection prot (PROT_READ, optionally | PROT_WRITE).  Pages are read
+// in on first access; bytes past the end of the file read as zero.
+// The mapping holds its own reference to the file, so fdnum may be
+// closed afterwards.
+// On success, stores the address of the mapping in *va_store and
+// returns 0.
+int
+mmap(int fdnum, off_t offset, size_t len, int prot, void **va_store)
+{
+	struct Fd *fd;
+	struct Mmap *m;
+	uintptr_t va;
+	int i, r;
+
+	if (offset < 0 || PGOFF(offset) || len == 0 || !(prot & PROT_READ))
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+
+	for (i = 0; i < NMMAP && mmaps[i].mm_va; i++)
+		;
+	if (i == NMMAP)
+		return -E_NO_MEM;
+	m = &mmaps[i];
+
+	// Take our reference to the file before reserving address space,
+	// which cannot be given back once later mappings are placed.
+	if ((r = fd_alloc(&fd)) < 0)
+		return r;
+	if ((r = dup(fdnum, fd2num(fd))) < 0)
+		return r;
+	len = ROUNDUP(len, PGSIZE);
+	if ((va = mmap_reserve(len)) == 0) {
+		close(r);
+		return -E_NO_MEM;
+	}
+
+	if (_pgfault_handler != mmap_pgfault) {
+		mmap_prev_handler = _pgfault_handler;
+		set_pgfault_handler(mmap_pgfault);
+	}
+
+	m->mm_len = len;
+	m->mm_offset = offset;
+	m->mm_fdnum = r;
+	m->mm_prot = prot;
+	m->mm_va = va;
+	*va_store = (void *) va;
+	return 0;
+}
+
+// Remove the mapping that starts at va.  The whole mapping goes;
+// partial unmaps are not supported.
+int
+munmap(void *va)
+{
+	struct Mmap *m;
+	uintptr_t pg;
+
+	if ((m = mmap_find((uintptr_t) va)) == NULL || m->mm_va != (uintptr_t) va)
+		return -E_INVAL;
+	for (pg = m->mm_va; pg < m->mm_va + m->mm_len; pg += PGSIZE)
+		if ((uvpd[PDX(pg)] & PTE_P) && (uvpt[PGNUM(pg)] & PTE_P))
+			sys_page_unmap(0, (void *) pg);
+	close(m->mm_fdnum);
+	m->mm_va = 0;
+	return 0;
+}
@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #define debug 0
@@ -22,9 +23,23 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	volatile uint32_t p_event;	// futex word: changes on every move and close
+	volatile uint32_t p_sleepers;	// number of envs that may sleep on p_event
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// Every fd on a pipe maps both of its data pages (see FDDATAPAGES in
+// fd.c): first one that is never touched, then the Pipe.  The first
+// page's reference count, against
+// the fd page's, says whether the other end is still open.  Closers
+// drop it before waking sleepers on the Pipe, so a woken sleeper is
+// sure to see them gone.  The Pipe itself could not serve, since a
+// closer must still map it to wake anyone; and coming after the first
+// page, it is also unmapped after it when the kernel tears down an
+// environment that dies without closing, which wakes sleepers too.
+#define pipe_refpage(fd)	fd2data(fd)
+#define fd2pipe(fd)		((struct Pipe*) (fd2data(fd) + PGSIZE))
+
 int
 pipe(int pfd[2])
 {
@@ -41,12 +56,18 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
-	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	// allocate the reference page and the pipe structure as the
+	// data pages of both
+	va = pipe_refpage(fd0);
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_SHARE)) < 0)
 		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	if ((r = sys_page_map(0, va, 0, pipe_refpage(fd1), PTE_P|PTE_U|PTE_SHARE)) < 0)
 		goto err3;
+	va = fd2pipe(fd0);
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		goto err4;
+	if ((r = sys_page_map(0, va, 0, fd2pipe(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		goto err5;
 
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -62,8 +83,12 @@ pipe(int pfd[2])
 	pfd[1] = fd2num(fd1);
 	return 0;
 
-    err3:
+    err5:
 	sys_page_unmap(0, va);
+    err4:
+	sys_page_unmap(0, pipe_refpage(fd1));
+    err3:
+	sys_page_unmap(0, pipe_refpage(fd0));
     err2:
 	sys_page_unmap(0, fd1);
     err1:
@@ -73,13 +98,13 @@ pipe(int pfd[2])
 }
 
 static int
-_pipeisclosed(struct Fd *fd, struct Pipe *p)
+_pipeisclosed(struct Fd *fd)
 {
 	int n, nn, ret;
 
 	while (1) {
 		n = thisenv->env_runs;
-		ret = pageref(fd) == pageref(p);
+		ret = pageref(fd) == pageref(pipe_refpage(fd));
 		nn = thisenv->env_runs;
 		if (n == nn)
 			return ret;
@@ -92,13 +117,51 @@ int
 pipeisclosed(int fdnum)
 {
 	struct Fd *fd;
-	struct Pipe *p;
 	int r;
 
 	if ((r = fd_lookup(fdnum, &fd)) < 0)
 		return r;
-	p = (struct Pipe*) fd2data(fd);
-	return _pipeisclosed(fd, p);
+	return _pipeisclosed(fd);
+}
+
+// Tell anyone asleep on p that it has changed.  The locked increment
+// orders our changes before the look at p_sleepers, against the
+// sleeper's increment of p_sleepers before its look at the pipe.
+static void
+pipe_wakeup(struct Pipe *p)
+{
+	asm volatile("lock; incl %0" : "+m" (p->p_event) : : "cc", "memory");
+	if (p->p_sleepers)
+		sys_futex_wake(&p->p_event, NENV);
+}
+
+// Sleep until the pipe changes, unless ready(p) holds or the other end
+// is closed already.  The caller must look again either way.
+static void
+pipe_sleep(struct Fd *fd, struct Pipe *p, bool (*ready)(struct Pipe *))
+{
+	uint32_t ev;
+
+	asm volatile("lock; incl %0" : "+m" (p->p_sleepers) : : "cc", "memory");
+	ev = p->p_event;
+	if (!ready(p) && !_pipeisclosed(fd)) {
+		if (debug)
+			cprintf("pipe_sleep %08x\n", ev);
+		sys_futex_wait(&p->p_event, ev, 0);
+	}
+	asm volatile("lock; decl %0" : "+m" (p->p_sleepers) : : "cc", "memory");
+}
+
+static bool
+pipe_readable(struct Pipe *p)
+{
+	return p->p_rpos != p->p_wpos;
+}
+
+static bool
+pipe_writable(struct Pipe *p)
+{
+	return p->p_wpos < p->p_rpos + sizeof(p->p_buf);
 }
 
 static ssize_t
@@ -108,31 +171,32 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 	size_t i;
 	struct Pipe *p;
 
-	p = (struct Pipe*)fd2data(fd);
+	p = fd2pipe(fd);
 	if (debug)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		while (!pipe_readable(p)) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
+			if (_pipeisclosed(fd))
 				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+			// sleep until a writer comes by
+			pipe_sleep(fd, p, pipe_readable);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	// there is room now for any writer waiting
+	pipe_wakeup(p);
 	return i;
 }
 
@@ -140,27 +204,30 @@ static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	size_t i, woken;
 	struct Pipe *p;
 
-	p = (struct Pipe*) fd2data(fd);
+	p = fd2pipe(fd);
 	if (debug)
 		cprintf("[%08x] devpipe_write %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = woken = 0; i < n; i++) {
+		while (!pipe_writable(p)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
-			if (_pipeisclosed(fd, p))
+			if (_pipeisclosed(fd))
 				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+			// let readers at what we wrote, then sleep until
+			// one makes room
+			if (woken < i) {
+				pipe_wakeup(p);
+				woken = i;
+			}
+			pipe_sleep(fd, p, pipe_writable);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,13 +235,14 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wakeup(p);
 	return i;
 }
 
 static int
 devpipe_stat(struct Fd *fd, struct Stat *stat)
 {
-	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	struct Pipe *p = fd2pipe(fd);
 	strcpy(stat->st_name, "<pipe>");
 	stat->st_size = p->p_wpos - p->p_rpos;
 	stat->st_type = FTYPE_IFIFO;
@@ -185,7 +253,13 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = fd2pipe(fd);
+
+	// In this order, whoever is woken sees us gone (see pipe_refpage),
+	// and nobody ever sees the other end gone while it is not.
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	(void) sys_page_unmap(0, pipe_refpage(fd));
+	pipe_wakeup(p);
+	return sys_page_unmap(0, p);
 }
 
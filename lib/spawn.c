@@ -5,10 +5,33 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Spawn keeps a read-only view of the last few programs it started,
+// keyed by the file's inode number and generation.  Each page of a
+// view is the file server's cached block, mapped with readmap, so
+// starting a program again asks the file server for nothing but the
+// open and a stat: text pages go straight from the view to the child,
+// shared by every instance, and data pages are copied from it.
+#define EXECVA			0xC0000000
+#define EXECSLOTSIZE		(8 * PTSIZE)	// largest program kept
+#define NEXECSLOT		4
+
+struct ExecImage {
+	uint32_t ei_ino;
+	uint32_t ei_gen;
+	off_t ei_size;		// 0 if the slot is free
+	uint32_t ei_used;	// exec_clock at last use
+};
+
+static struct ExecImage exec_images[NEXECSLOT];
+static uint32_t exec_clock;
+
 // Helper functions for spawn.
+static char *exec_image(int fd);
+static int exec_page(int fd, char *img, off_t offset);
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
+		       int fd, size_t filesz, off_t fileoffset, int perm,
+		       char *img);
 static int copy_shared_pages(envid_t child);
 
 // Spawn a child process from a program image loaded from the file system.
@@ -27,6 +50,7 @@ spawn(const char *prog, const char **argv)
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
+	char *img;
 
 	// This code follows this procedure:
 	//
@@ -89,9 +113,15 @@ spawn(const char *prog, const char **argv)
 		return r;
 	fd = r;
 
-	// Read elf header
+	// Read elf header, from the view if there is one.
 	elf = (struct Elf*) elf_buf;
-	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf)
+	if ((img = exec_image(fd)) != NULL) {
+		if (exec_page(fd, img, 0) < 0)
+			img = NULL;
+		else
+			memcpy(elf_buf, img, sizeof(elf_buf));
+	}
+	if ((img == NULL && readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf))
 	    || elf->e_magic != ELF_MAGIC) {
 		close(fd);
 		cprintf("elf magic %08x want %08x\n", elf->e_magic, ELF_MAGIC);
@@ -119,7 +149,7 @@ spawn(const char *prog, const char **argv)
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
 		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+				     fd, ph->p_filesz, ph->p_offset, perm, img)) < 0)
 			goto error;
 	}
 	close(fd);
@@ -259,12 +289,64 @@ error:
 	return r;
 }
 
+// Find or make the view of program fd, or return NULL if it does not
+// have one.  A view of an older version of the same file is dropped.
+static char *
+exec_image(int fd)
+{
+	struct ExecImage *ei, *victim = NULL;
+	struct Stat st;
+	uintptr_t va;
+	int i;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > EXECSLOTSIZE)
+		return NULL;
+	for (i = 0; i < NEXECSLOT; i++) {
+		ei = &exec_images[i];
+		if (ei->ei_size && ei->ei_ino == st.st_ino) {
+			victim = ei;
+			break;
+		}
+		if (!victim || ei->ei_used < victim->ei_used)
+			victim = ei;
+	}
+	ei = victim;
+	va = EXECVA + (ei - exec_images) * EXECSLOTSIZE;
+
+	if (ei->ei_size && (ei->ei_ino != st.st_ino || ei->ei_gen != st.st_gen
+			    || ei->ei_size != st.st_size)) {
+		for (i = 0; i < ei->ei_size; i += PGSIZE)
+			if ((uvpd[PDX(va + i)] & PTE_P) && (uvpt[PGNUM(va + i)] & PTE_P))
+				sys_page_unmap(0, (void *) (va + i));
+		ei->ei_size = 0;
+	}
+	ei->ei_ino = st.st_ino;
+	ei->ei_gen = st.st_gen;
+	ei->ei_size = st.st_size;
+	ei->ei_used = ++exec_clock;
+	return (char *) va;
+}
+
+// Make sure the page of the view img at offset, a multiple of PGSIZE,
+// is mapped.
+static int
+exec_page(int fd, char *img, off_t offset)
+{
+	uintptr_t va = (uintptr_t) img + offset;
+	int r;
+
+	if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+		return 0;
+	if ((r = readmap(fd, offset, (void *) va)) < 0)
+		return r;
+	return r == 0 ? -E_NOT_EXEC : 0;
+}
+
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
+	int fd, size_t filesz, off_t fileoffset, int perm, char *img)
 {
 	int i, r;
-	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -274,24 +356,41 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		filesz += i;
 		fileoffset -= i;
 	}
+	if (PGOFF(fileoffset) || fileoffset + filesz > EXECSLOTSIZE)
+		img = NULL;
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+			continue;
+		}
+		if (img && !(perm & PTE_W)
+		    && (i + PGSIZE <= filesz || memsz <= filesz)) {
+			// Read-only and no bss to clear: share the view's page.
+			if ((r = exec_page(fd, img, fileoffset + i)) < 0)
+				return r;
+			if ((r = sys_page_map(0, img + fileoffset + i, child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
+			continue;
+		}
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if (img) {
+			if ((r = exec_page(fd, img, fileoffset + i)) < 0)
+				return r;
+			memcpy(UTEMP, img + fileoffset + i, MIN(PGSIZE, filesz-i));
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
 		}
+		if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+			panic("spawn: sys_page_map data: %e", r);
+		sys_page_unmap(0, UTEMP);
 	}
 	return 0;
 }
@@ -111,18 +111,46 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+// Unlike sys_exofork, the child gets a copy of the whole address space,
+// stack included, so this need not be inlined.
+envid_t
+sys_fork(bool share)
+{
+	return syscall(SYS_fork, 0, share, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva, 0);
+}
+
 int
 sys_blk_write(uint32_t secno, const void *buf, size_t nsecs)
 {
@@ -135,8 +163,52 @@ sys_blk_read(uint32_t secno, void *buf, size_t nsecs)
 	return syscall(SYS_blk_read, 0, secno, (uint32_t)buf, nsecs, 0, 0);
 }
 
+int
+sys_blk_submit(int write, uint32_t secno, void *buf, size_t nsecs)
+{
+	return syscall(SYS_blk_submit, 0, write, secno, (uint32_t) buf, nsecs, 0);
+}
+
+int
+sys_blk_reap(struct blk_done *done, int max)
+{
+	return syscall(SYS_blk_reap, 0, (uint32_t) done, max, 0, 0, 0);
+}
+
+int
+sys_blk_readv(uint32_t secno, void *const *bufs, size_t nbufs)
+{
+	return syscall(SYS_blk_readv, 0, secno, (uint32_t) bufs, nbufs, 0, 0);
+}
+
+int
+sys_blk_writev(uint32_t secno, const void *const *bufs, size_t nbufs)
+{
+	return syscall(SYS_blk_writev, 0, secno, (uint32_t) bufs, nbufs, 0, 0);
+}
+
 int
 sys_batch(struct batch *sys_calls, uint32_t num_calls)
 {
 	return syscall(SYS_batch, 1, (uint32_t) sys_calls, num_calls, 0, 0, 0);
 }
+
+int
+sys_env_set_priority(envid_t envid, int sched_class, uint32_t weight)
+{
+	return syscall(SYS_env_set_priority, 1, envid, sched_class, weight, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected,
+	       nanoseconds_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected,
+		       (uint32_t) timeout, (uint32_t) (timeout >> 32), 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
@@ -0,0 +1,89 @@
+// Threads built on sfork, with mutexes and condition variables that
+// wait by yielding the CPU.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+int
+thread_create(envid_t *tid_store, void (*fn)(void *), void *arg)
+{
+	envid_t tid;
+
+	if ((tid = sfork()) < 0)
+		return tid;
+	if (tid == 0) {
+		fn(arg);
+		thread_exit();
+	}
+	*tid_store = tid;
+	return 0;
+}
+
+void
+thread_exit(void)
+{
+	sys_env_destroy(0);
+	panic("thread_exit: still running");
+}
+
+void
+thread_join(envid_t tid)
+{
+	wait(tid);
+}
+
+void
+mutex_init(struct mutex *m)
+{
+	m->locked = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	while (xchg(&m->locked, 1) != 0)
+		sys_yield();
+}
+
+bool
+mutex_trylock(struct mutex *m)
+{
+	return xchg(&m->locked, 1) == 0;
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	// xchg rather than a plain store, so that neither the compiler
+	// nor the CPU can move accesses made under m past the release.
+	xchg(&m->locked, 0);
+}
+
+void
+cond_init(struct cond *c)
+{
+	c->seq = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	uint32_t seq = c->seq;
+
+	mutex_unlock(m);
+	while (c->seq == seq)
+		sys_yield();
+	mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+	asm volatile("lock; incl %0" : "+m" (c->seq) : : "cc", "memory");
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	cond_signal(c);
+}
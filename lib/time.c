@@ -9,9 +9,12 @@ uptime(void)
 	return info.uptime;
 }
 
+// Sleeps on a futex word nobody wakes, so that only the timeout, or a
+// stray wakeup, which the loop absorbs, ends the sleep.
 void
 nanosleep(nanoseconds_t nanoseconds)
 {
+	static uint32_t never;
 	nanoseconds_t now, end;
 
 	now = uptime();
@@ -19,8 +22,8 @@ nanosleep(nanoseconds_t nanoseconds)
 	if (end < now)
 		panic("nanosleep: wrap");
 
-	while (uptime() < end)
-		sys_yield();
+	while ((now = uptime()) < end)
+		sys_futex_wait(&never, 0, end - now);
 }
 
 void
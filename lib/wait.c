@@ -1,6 +1,7 @@
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
+// Waits until 'envid' exits, asleep in the kernel, which clears
+// env_alive_id and wakes us when the environment is freed.
 void
 wait(envid_t envid)
 {
@@ -8,6 +9,6 @@ wait(envid_t envid)
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_alive_id == envid)
+		sys_futex_wait((volatile uint32_t *) &e->env_alive_id, envid, 0);
 }
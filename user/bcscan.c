@@ -0,0 +1,78 @@
+// Measure the file server's block cache when a file does not fit in
+// it.  Writes a file, then for several cache capacities reads it
+// twice from a cold cache and reports the hit ratio and throughput of
+// the second pass.  A file larger than the cache defeats any
+// recency-based policy on a sequential scan; one that fits is served
+// from memory.
+
+#include <inc/lib.h>
+
+#define PATH		"/bcscan.dat"
+#define FILEBLKS	256
+
+static char buf[PGSIZE];
+static const uint32_t capacities[] = { 64, 128, 2 * FILEBLKS };
+
+static void
+scan(void)
+{
+	int fd, n;
+
+	if ((fd = open(PATH, O_RDONLY)) < 0)
+		panic("open %s: %e", PATH, fd);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (n < 0)
+		panic("read %s: %e", PATH, n);
+	close(fd);
+}
+
+static void
+run(uint32_t capacity)
+{
+	struct Fsret_cachestat st0, st1;
+	nanoseconds_t start, elapsed;
+	uint32_t hits, misses;
+	int r;
+
+	if ((r = fs_cachestat(-1, 1, capacity, NULL)) < 0)
+		panic("fs_cachestat: %e", r);
+	scan();
+	fs_cachestat(-1, 0, 0, &st0);
+	start = uptime();
+	scan();
+	elapsed = uptime() - start;
+	fs_cachestat(-1, 0, 0, &st1);
+
+	if (elapsed == 0)
+		elapsed = 1;
+	hits = st1.ret_hits - st0.ret_hits;
+	misses = st1.ret_misses - st0.ret_misses;
+	printf("bcscan: %4u blocks cached, %u-block file: %u%% hits, %u evictions, %llu KB/sec\n",
+	       st1.ret_capacity, FILEBLKS,
+	       hits + misses ? hits * 100 / (hits + misses) : 0,
+	       st1.ret_evictions - st0.ret_evictions,
+	       (uint64_t) FILEBLKS * BLKSIZE / 1024 * NANOSECONDS_PER_SECOND / elapsed);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cachestat st;
+	int fd, i, r;
+
+	if ((fd = open(PATH, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", PATH, fd);
+	for (i = 0; i < PGSIZE; i++)
+		buf[i] = 'a' + i % 26;
+	for (i = 0; i < FILEBLKS; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", PATH, r);
+	close(fd);
+
+	fs_cachestat(-1, 0, 0, &st);
+	for (i = 0; i < ARRAY_SIZE(capacities); i++)
+		run(capacities[i]);
+	// Put the capacity back.
+	fs_cachestat(-1, 0, st.ret_capacity, NULL);
+}
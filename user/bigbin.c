@@ -0,0 +1,17 @@
+// A program with a large read-only image and nothing to do, for
+// measuring what loading the image costs (see mmapbench).
+
+#include <inc/lib.h>
+
+#define BLOBSIZE	(256 * 1024)
+
+// Initialized, so it is in the file rather than bss.
+static const char blob[BLOBSIZE] = { 1 };
+
+void
+umain(int argc, char **argv)
+{
+	// Touch one page, as a program using a little of its text would.
+	if (blob[argc * PGSIZE % BLOBSIZE] == 0xFF)
+		cprintf("bigbin: impossible\n");
+}
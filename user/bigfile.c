@@ -0,0 +1,91 @@
+// Measure reads of a large file: sequential throughput with
+// readahead, and the latency of random one-block reads, both from a
+// cold cache.  The file is written in one go, so it takes few
+// extents, and is as large as half the disk allows, up to
+// MAXFILEBLKS blocks.  Build a bigger disk with e.g.
+// FSIMGBLKS=65536 to go past what a block map could address.
+
+#include <inc/lib.h>
+
+#define PATH		"/bigfile.dat"
+#define MAXFILEBLKS	16384
+#define NRANDOM		256
+
+static char buf[PGSIZE];
+
+static int
+openbig(int mode)
+{
+	int fd;
+
+	if ((fd = open(PATH, mode)) < 0)
+		panic("open %s: %e", PATH, fd);
+	return fd;
+}
+
+static void
+sequential(uint32_t nblocks)
+{
+	nanoseconds_t start, elapsed;
+	int fd, n;
+
+	fs_cachestat(1, 1, 0, NULL);
+	fd = openbig(O_RDONLY);
+	start = uptime();
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	elapsed = uptime() - start;
+	if (n < 0)
+		panic("read %s: %e", PATH, n);
+	close(fd);
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("bigfile: sequential: %llu KB/sec\n",
+	       (uint64_t) nblocks * BLKSIZE / 1024 * NANOSECONDS_PER_SECOND / elapsed);
+}
+
+static void
+random(uint32_t nblocks)
+{
+	nanoseconds_t start, elapsed;
+	uint32_t seed = 1, i;
+	int fd, r;
+
+	fs_cachestat(0, 1, 0, NULL);
+	fd = openbig(O_RDONLY);
+	start = uptime();
+	for (i = 0; i < NRANDOM; i++) {
+		seed = seed * 1103515245 + 12345;
+		seek(fd, (seed >> 8) % nblocks * BLKSIZE);
+		if ((r = read(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read %s: %e", PATH, r);
+	}
+	elapsed = uptime() - start;
+	close(fd);
+	fs_cachestat(1, 0, 0, NULL);
+	printf("bigfile: random: %llu us per block\n",
+	       elapsed / NRANDOM / 1000);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cachestat st;
+	uint32_t nblocks, i;
+	int fd, r;
+
+	if ((r = fs_cachestat(-1, 0, 0, &st)) < 0)
+		panic("fs_cachestat: %e", r);
+	nblocks = MIN(st.ret_nblocks / 2, MAXFILEBLKS);
+
+	fd = openbig(O_WRONLY | O_CREAT | O_TRUNC);
+	for (i = 0; i < nblocks; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", PATH, r);
+	close(fd);
+	sync();
+	printf("bigfile: %u-block file\n", nblocks);
+
+	sequential(nblocks);
+	random(nblocks);
+}
@@ -0,0 +1,45 @@
+// Fork a process with 64 MB mapped whose child does nothing but spawn
+// a program, the usual fork-then-exec, and time it with fork (which
+// shares page tables until they are written) and with ufork (which
+// maps every page into the child).
+
+#include <inc/lib.h>
+
+#define NPAGES		(64 * 1024 * 1024 / PGSIZE)
+#define MEMVA		0x20000000
+
+static void
+run(const char *name, envid_t (*forker)(void))
+{
+	const char *args[] = { "hello", NULL };
+	nanoseconds_t start, forked;
+	envid_t child;
+	int r;
+
+	start = uptime();
+	if ((child = forker()) < 0)
+		panic("%s: %e", name, child);
+	if (child == 0) {
+		if ((r = spawn("/hello", args)) < 0)
+			panic("spawn /hello: %e", r);
+		wait(r);
+		exit();
+	}
+	forked = uptime() - start;
+	wait(child);
+	printf("bigfork: %s: fork %llu us, fork+spawn+exit %llu us\n",
+	       name, forked / 1000, (uptime() - start) / 1000);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, (void *) (MEMVA + i * PGSIZE),
+					PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	run("fork", fork);
+	run("ufork", ufork);
+}
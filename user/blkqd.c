@@ -0,0 +1,85 @@
+// Measure disk read IOPS at queue depths 1 to 64, keeping that many
+// asynchronous single-block reads (sys_blk_submit) in flight and
+// reaping completions with sys_blk_reap.  Reads random blocks of the
+// file system image, so it is safe to run on a live disk.
+// Run with e.g. make run-blkqd CPUS=1.
+
+#include <inc/lib.h>
+
+#define NIOS		2048
+#define MAXQD		64
+#define DISKBLKS	1024	// size of fs.img
+
+static char bufs[MAXQD][BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Buffer in use by each command in flight.
+static struct {
+	int tag;
+	int buf;
+} inflight[MAXQD];
+
+static uint32_t seed = 1;
+
+static uint32_t
+rand_block(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % DISKBLKS;
+}
+
+static void
+run(int qd)
+{
+	struct blk_done done[MAXQD];
+	int freebufs[MAXQD];
+	int nfree, ninflight = 0, issued = 0, finished = 0;
+	nanoseconds_t start, elapsed;
+	int i, j, n, r;
+
+	for (nfree = 0; nfree < qd; nfree++)
+		freebufs[nfree] = nfree;
+
+	start = uptime();
+	while (finished < NIOS) {
+		while (ninflight < qd && issued < NIOS) {
+			r = sys_blk_submit(0, rand_block() * BLKSECTS,
+					   bufs[freebufs[nfree - 1]], BLKSECTS);
+			if (r == -E_NO_MEM)
+				break;
+			if (r < 0)
+				panic("sys_blk_submit: %e", r);
+			inflight[ninflight].tag = r;
+			inflight[ninflight].buf = freebufs[--nfree];
+			ninflight++;
+			issued++;
+		}
+
+		if ((n = sys_blk_reap(done, MAXQD)) < 0)
+			panic("sys_blk_reap: %e", n);
+		for (i = 0; i < n; i++) {
+			if (done[i].result != BLKSECTS)
+				panic("blkqd: read failed: %e", done[i].result);
+			for (j = 0; j < ninflight && inflight[j].tag != done[i].tag; j++)
+				;
+			assert(j < ninflight);
+			freebufs[nfree++] = inflight[j].buf;
+			inflight[j] = inflight[--ninflight];
+			finished++;
+		}
+	}
+	elapsed = uptime() - start;
+	if (elapsed == 0)
+		elapsed = 1;
+	cprintf("blkqd: QD %2d: %d reads in %llu ms, %llu IOPS\n",
+		qd, NIOS, elapsed / NANOSECONDS_PER_MILLISECOND,
+		(uint64_t) NIOS * NANOSECONDS_PER_SECOND / elapsed);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int qd;
+
+	for (qd = 1; qd <= MAXQD; qd *= 2)
+		run(qd);
+}
@@ -0,0 +1,44 @@
+// Measure sequential disk read throughput as a function of how many
+// blocks each command moves: read the whole file system image with
+// sys_blk_readv, 1 to BLK_MAXIOV blocks at a time, into pages that
+// are deliberately not in disk order.
+// Run with e.g. make run-blkseq.
+
+#include <inc/lib.h>
+
+#define DISKBLKS	1024	// size of fs.img
+
+static char bufs[BLK_MAXIOV][BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+run(int nblocks)
+{
+	void *iov[BLK_MAXIOV];
+	nanoseconds_t start, elapsed;
+	uint32_t blockno;
+	int i, r;
+
+	// Scatter: fill the vector from the last page backwards.
+	for (i = 0; i < nblocks; i++)
+		iov[i] = bufs[BLK_MAXIOV - 1 - i];
+
+	start = uptime();
+	for (blockno = 0; blockno + nblocks <= DISKBLKS; blockno += nblocks)
+		if ((r = sys_blk_readv(blockno * BLKSECTS, iov, nblocks)) < 0)
+			panic("sys_blk_readv: %e", r);
+	elapsed = uptime() - start;
+	if (elapsed == 0)
+		elapsed = 1;
+	cprintf("blkseq: %2d blocks per command: %llu ms, %llu KB/sec\n",
+		nblocks, elapsed / NANOSECONDS_PER_MILLISECOND,
+		(uint64_t) DISKBLKS * BLKSIZE / 1024 * NANOSECONDS_PER_SECOND / elapsed);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int n;
+
+	for (n = 1; n <= BLK_MAXIOV; n *= 2)
+		run(n);
+}
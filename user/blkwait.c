@@ -0,0 +1,69 @@
+// Measure what synchronous disk reads (sys_blk_read) cost the rest of
+// the system.  A spinner child counts loop iterations for a fixed
+// window, first alone and then while we issue back-to-back reads;
+// the ratio is the CPU share the reads left over.  Also reports the
+// average read latency.  Compare the kernel's wait modes with e.g.
+//	make run-blkwait CPUS=1 NVME_WAIT=poll
+//	make run-blkwait CPUS=1 NVME_WAIT=irq
+//	make run-blkwait CPUS=1 NVME_WAIT=hybrid
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define WINDOW		(500 * NANOSECONDS_PER_MILLISECOND)
+#define DISKBLKS	1024	// size of fs.img
+
+static char buf[BLKSIZE] __attribute__((aligned(PGSIZE)));
+
+// Count iterations until the window closes, and report to the parent.
+static void
+spinner(envid_t parent, nanoseconds_t end)
+{
+	uint32_t n = 0;
+
+	while (uptime() < end)
+		n++;
+	ipc_send(parent, n, NULL, 0);
+	exit();
+}
+
+static uint32_t
+spin(bool reads, uint64_t *nreads, uint64_t *cycles)
+{
+	envid_t parent = sys_getenvid();
+	nanoseconds_t end = uptime() + WINDOW;
+	uint64_t t;
+	int r;
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0)
+		spinner(parent, end);
+
+	*nreads = *cycles = 0;
+	while (reads && uptime() < end) {
+		t = read_tsc();
+		r = sys_blk_read((*nreads * 7 % DISKBLKS) * BLKSECTS, buf, BLKSECTS);
+		*cycles += read_tsc() - t;
+		if (r < 0)
+			panic("sys_blk_read: %e", r);
+		(*nreads)++;
+	}
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t nreads, cycles;
+	uint32_t solo, shared;
+
+	solo = spin(0, &nreads, &cycles);
+	shared = spin(1, &nreads, &cycles);
+	if (solo == 0)
+		solo = 1;
+	if (nreads == 0)
+		nreads = 1;
+	cprintf("blkwait: %llu reads, %llu cycles each; spinner kept %u%% of its solo speed\n",
+		nreads, cycles / nreads, (uint32_t) ((uint64_t) shared * 100 / solo));
+}
@@ -1,26 +1,69 @@
 #include <inc/lib.h>
 
-char buf[8192];
+// Room for a full batch of ring requests per read.
+char buf[FSRING_NBUF * PGSIZE];
+int flag[256];
 
 void
 cat(int f, char *s)
 {
 	long n;
 	int r;
+	uint64_t total = 0;
+	nanoseconds_t start, elapsed;
 
-	while ((n = read(f, buf, (long)sizeof(buf))) > 0)
+	start = uptime();
+	while ((n = read(f, buf, (long)sizeof(buf))) > 0) {
+		total += n;
+		if (flag['t'])
+			continue;
 		if ((r = write(1, buf, n)) != n)
 			panic("write error copying %s: %e", s, r);
+	}
 	if (n < 0)
 		panic("error reading %s: %e", s, n);
+	if (flag['t']) {
+		elapsed = uptime() - start;
+		if (elapsed == 0)
+			elapsed = 1;
+		printf("cat: %s: %llu bytes in %llu ms, %llu KB/sec%s\n",
+		       s, total, elapsed / NANOSECONDS_PER_MILLISECOND,
+		       total * NANOSECONDS_PER_SECOND / 1024 / elapsed,
+		       flag['r'] ? " (ring)" : "");
+	}
 }
 
+void
+usage(void)
+{
+	printf("usage: cat [-rt] [file...]\n");
+	exit();
+}
+
+// -r reads through a ring shared with the file server.
+// -t discards the data and reports read throughput instead.
 void
 umain(int argc, char **argv)
 {
-	int f, i;
+	int f, i, r;
+	struct Argstate args;
 
 	binaryname = "cat";
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'r':
+		case 't':
+			flag[i]++;
+			break;
+		default:
+			usage();
+		}
+	if (flag['r'] && (r = fsring_enable()) < 0) {
+		printf("cat: no ring, using plain IPC: %e\n", r);
+		flag['r'] = 0;
+	}
+
 	if (argc == 1)
 		cat(0, "<stdin>");
 	else
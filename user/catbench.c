@@ -0,0 +1,55 @@
+// Measure file read throughput with cat, moving data one page per
+// IPC round trip and through a ring shared with the file server.
+// Writes a large file first, then runs "cat -t" and "cat -t -r" on it
+// from a cold block cache, with file server readahead on and off.
+
+#include <inc/lib.h>
+
+#define PATH		"/catbench.dat"
+#define FILESIZE	(1024 * 1024)
+
+static char buf[PGSIZE];
+
+static void
+run(const char *mode, int readahead)
+{
+	struct Fsret_cachestat st0, st1;
+	int r;
+
+	if ((r = fs_cachestat(readahead, 1, 0, &st0)) < 0)
+		panic("fs_cachestat: %e", r);
+	if (mode)
+		r = spawnl("/cat", "cat", "-t", mode, PATH, (char *) 0);
+	else
+		r = spawnl("/cat", "cat", "-t", PATH, (char *) 0);
+	if (r < 0)
+		panic("spawn cat: %e", r);
+	wait(r);
+	if ((r = fs_cachestat(-1, 0, 0, &st1)) < 0)
+		panic("fs_cachestat: %e", r);
+	printf("catbench: readahead %s: %u hits, %u misses, %u blocks read ahead\n",
+	       readahead ? "on" : "off", st1.ret_hits - st0.ret_hits,
+	       st1.ret_misses - st0.ret_misses,
+	       st1.ret_readahead - st0.ret_readahead);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+
+	if ((fd = open(PATH, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", PATH, fd);
+	for (i = 0; i < PGSIZE; i++)
+		buf[i] = 'a' + i % 26;
+	for (i = 0; i < FILESIZE / PGSIZE; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", PATH, r);
+	close(fd);
+
+	run(NULL, 1);
+	run(NULL, 0);
+	run("-r", 1);
+	run("-r", 0);
+	fs_cachestat(1, 0, 0, NULL);
+}
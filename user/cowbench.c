@@ -0,0 +1,92 @@
+// Measure copy-on-write faults.  Times a first write to each of NPAGES
+// pages three ways: COW pages another mapping still shares, which the
+// kernel copies; COW pages nothing else maps, which the kernel just
+// makes writable; and read-only pages whose faults go to a user
+// handler that copies them the way lib/fork.c's pgfault used to.
+// Then times a child writing all of its memory after fork.
+// Run with e.g. make run-cowbench.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES		512
+#define MEMVA		((char *) 0x20000000)
+#define ALIASVA		((char *) 0x30000000)
+
+static void
+handler(struct UTrapframe *utf)
+{
+	void *addr = ROUNDDOWN((void *) utf->utf_fault_va, PGSIZE);
+	int r;
+
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	memcpy(PFTEMP, addr, PGSIZE);
+	if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_map: %e", r);
+	sys_page_unmap(0, PFTEMP);
+}
+
+// Remap our pages with perm, optionally also mapping each at ALIASVA
+// so it is shared.
+static void
+remap(int perm, bool alias)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if (alias)
+			sys_page_map(0, MEMVA + i * PGSIZE, 0, ALIASVA + i * PGSIZE, PTE_P | PTE_U);
+		else
+			sys_page_unmap(0, ALIASVA + i * PGSIZE);
+		if ((r = sys_page_map(0, MEMVA + i * PGSIZE, 0, MEMVA + i * PGSIZE, perm)) < 0)
+			panic("sys_page_map: %e", r);
+	}
+}
+
+static void
+touch(const char *what)
+{
+	uint64_t t, cycles = 0;
+	int i;
+
+	for (i = 0; i < NPAGES; i++) {
+		t = read_tsc();
+		MEMVA[i * PGSIZE] = i;
+		cycles += read_tsc() - t;
+	}
+	cprintf("cowbench: %-28s %llu cycles per fault\n", what, cycles / NPAGES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	nanoseconds_t start;
+	envid_t child;
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		if (sys_page_alloc(0, MEMVA + i * PGSIZE, PTE_P | PTE_U | PTE_W) < 0)
+			panic("sys_page_alloc");
+
+	remap(PTE_P | PTE_U | PTE_COW, 1);
+	touch("kernel, shared (copy):");
+	remap(PTE_P | PTE_U | PTE_COW, 0);
+	touch("kernel, unshared (no copy):");
+	set_pgfault_handler(handler);
+	remap(PTE_P | PTE_U, 1);
+	touch("user upcall (copy):");
+	remap(PTE_P | PTE_U | PTE_W, 0);
+
+	start = uptime();
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NPAGES * PGSIZE; i += sizeof(int))
+			*(int *) (MEMVA + i) = i;
+		exit();
+	}
+	wait(child);
+	cprintf("cowbench: fork, child writes %u KB: %llu us\n",
+		NPAGES * PGSIZE / 1024, (uptime() - start) / 1000);
+}
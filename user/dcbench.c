@@ -0,0 +1,65 @@
+// Measure the file server's path lookup cache on a spawn-heavy shell
+// script: run sh on testshell.sh NRUNS times with the cache off, then
+// on, and report the time per run and the cache counters.
+
+#include <inc/lib.h>
+
+#define NRUNS		5
+#define OUTPATH		"/dcbench.out"
+
+static void
+runsh(void)
+{
+	int r, fd, out;
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r > 0) {
+		wait(r);
+		return;
+	}
+	if ((fd = open("/testshell.sh", O_RDONLY)) < 0)
+		panic("open /testshell.sh: %e", fd);
+	if ((out = open(OUTPATH, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", OUTPATH, out);
+	dup(fd, 0);
+	dup(out, 1);
+	close(fd);
+	close(out);
+	if ((r = spawnl("/sh", "sh", 0)) < 0)
+		panic("spawn: %e", r);
+	close(0);
+	close(1);
+	wait(r);
+	exit();
+}
+
+static void
+run(bool enable)
+{
+	struct Fsret_dcachestat st;
+	nanoseconds_t start, elapsed;
+	uint32_t lookups;
+	int i, r;
+
+	if ((r = fs_dcachestat(enable, 1, NULL)) < 0)
+		panic("fs_dcachestat: %e", r);
+	start = uptime();
+	for (i = 0; i < NRUNS; i++)
+		runsh();
+	elapsed = uptime() - start;
+	fs_dcachestat(-1, 0, &st);
+
+	lookups = st.ret_hits + st.ret_neghits + st.ret_misses;
+	printf("dcbench: cache %s: %llu ms per run, %u lookups, %u%% hits, %u%% negative hits\n",
+	       enable ? "on " : "off", elapsed / NRUNS / NANOSECONDS_PER_MILLISECOND,
+	       lookups, lookups ? st.ret_hits * 100 / lookups : 0,
+	       lookups ? st.ret_neghits * 100 / lookups : 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run(0);
+	run(1);
+}
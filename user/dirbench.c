@@ -0,0 +1,62 @@
+// Measure open() in a big directory: create files in / in steps up
+// to NFILES (or argv[1]), timing NOPEN opens of random names after
+// each step, then remove them.  With the directory index the time
+// should stay flat as the directory grows.  10000 files need a bigger
+// disk than the default, e.g. FSIMGBLKS=8192.
+
+#include <inc/lib.h>
+
+#define NFILES		10000
+#define NOPEN		200
+
+static char path[MAXNAMELEN];
+
+static const char *
+name(uint32_t i)
+{
+	snprintf(path, sizeof(path), "/dirbench.%05u", i);
+	return path;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t nfiles = NFILES, n = 0, first, target, seed = 1, i;
+	nanoseconds_t start, elapsed;
+	int fd;
+
+	if (argc > 1)
+		nfiles = strtol(argv[1], NULL, 0);
+
+	for (target = MAX(nfiles / 8, 1); n < nfiles;
+	     target = MIN(2 * target, nfiles)) {
+		first = n;
+		start = uptime();
+		for (; n < target; n++) {
+			if ((fd = open(name(n), O_WRONLY | O_CREAT)) < 0) {
+				printf("dirbench: create %s: %e\n", path, fd);
+				nfiles = n;
+				break;
+			}
+			close(fd);
+		}
+		elapsed = uptime() - start;
+		if (n == first)
+			break;
+		printf("dirbench: %5u files: create %llu us, ", n,
+		       elapsed / (n - first) / 1000);
+
+		start = uptime();
+		for (i = 0; i < NOPEN; i++) {
+			seed = seed * 1103515245 + 12345;
+			if ((fd = open(name((seed >> 8) % n), O_RDONLY)) < 0)
+				panic("open %s: %e", path, fd);
+			close(fd);
+		}
+		elapsed = uptime() - start;
+		printf("open %llu us\n", elapsed / NOPEN / 1000);
+	}
+
+	for (i = 0; i < n; i++)
+		remove(name(i));
+}
@@ -70,6 +70,8 @@ dumbfork(void)
 
 	// Also copy the stack we are currently running on.
 	duppage(envid, ROUNDDOWN(&addr, PGSIZE));
+	// And the page that holds 'thisenv'.
+	duppage(envid, (void *) UTLS);
 
 	// Start the child environment running
 	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
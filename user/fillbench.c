@@ -0,0 +1,77 @@
+// Measure file write throughput on a nearly full disk: fill it with
+// FILLBLKS-block files, remove every other one until a tenth of the
+// disk is free again, in holes, then time writing a file into that
+// space, and the sync after.  Everything is removed at the end.
+
+#include <inc/lib.h>
+
+#define FILLBLKS	16
+#define PATH		"/fillbench.dat"
+
+static char buf[PGSIZE];
+static char path[MAXNAMELEN];
+
+static const char *
+name(uint32_t i)
+{
+	snprintf(path, sizeof(path), "/fill.%05u", i);
+	return path;
+}
+
+// Write nblocks blocks to path, stopping early if the disk fills up.
+// Return the number of blocks written.
+static uint32_t
+writefile(const char *path, uint32_t nblocks)
+{
+	uint32_t i;
+	int fd, r;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		return 0;
+	for (i = 0; i < nblocks; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			break;
+	close(fd);
+	return i;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cachestat st;
+	nanoseconds_t start, twrite, tsync;
+	uint32_t nfill, nfreed, nblocks, n, i;
+	int r;
+
+	if ((r = fs_cachestat(-1, 0, 0, &st)) < 0)
+		panic("fs_cachestat: %e", r);
+
+	for (nfill = 0; writefile(name(nfill), FILLBLKS) == FILLBLKS; nfill++)
+		;
+	nfill++;
+	nfreed = 0;
+	for (i = 0; i < nfill && nfreed < st.ret_nblocks / 10; i += 2) {
+		remove(name(i));
+		nfreed += FILLBLKS;
+	}
+	sync();
+
+	nblocks = nfreed * 3 / 4;
+	start = uptime();
+	n = writefile(PATH, nblocks);
+	twrite = uptime() - start;
+	start = uptime();
+	sync();
+	tsync = uptime() - start;
+	if (twrite == 0)
+		twrite = 1;
+	printf("fillbench: %u-block disk, %u blocks free in holes: wrote %u blocks, %llu KB/sec, sync %llu ms\n",
+	       st.ret_nblocks, nfreed, n,
+	       (uint64_t) n * BLKSIZE / 1024 * NANOSECONDS_PER_SECOND / twrite,
+	       tsync / NANOSECONDS_PER_MILLISECOND);
+
+	remove(PATH);
+	for (i = 0; i < nfill; i++)
+		remove(name(i));
+	sync();
+}
@@ -0,0 +1,59 @@
+// Measure fork latency against process size.  For each size, the
+// first process maps that much memory and then builds forktree's
+// binary tree of processes, each waiting for its children; reports the
+// time per fork, for the kernel's sys_fork and for the user-level
+// ufork.  Run with e.g. make run-forkbench.
+
+#include <inc/lib.h>
+
+#define DEPTH		3
+#define NFORKS		((1 << (DEPTH + 1)) - 2)
+#define MEMVA		0x20000000
+
+static const uint32_t sizes[] = { 0, 256, 1024, 2560 };	// pages
+
+static void
+forktree(envid_t (*forker)(void), int depth)
+{
+	envid_t kids[2];
+	int i;
+
+	if (depth == DEPTH)
+		return;
+	for (i = 0; i < 2; i++)
+		if ((kids[i] = forker()) == 0) {
+			forktree(forker, depth + 1);
+			exit();
+		} else if (kids[i] < 0)
+			panic("fork: %e", kids[i]);
+	for (i = 0; i < 2; i++)
+		wait(kids[i]);
+}
+
+static nanoseconds_t
+run(envid_t (*forker)(void))
+{
+	nanoseconds_t start = uptime();
+
+	forktree(forker, 0);
+	return (uptime() - start) / NFORKS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t mapped = 0, i;
+	nanoseconds_t k, u;
+	int r;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (; mapped < sizes[i]; mapped++)
+			if ((r = sys_page_alloc(0, (void *) (MEMVA + mapped * PGSIZE),
+						PTE_P | PTE_U | PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+		k = run(fork);
+		u = run(ufork);
+		cprintf("forkbench: %5u KB mapped: sys_fork %llu us, ufork %llu us per fork\n",
+			sizes[i] * PGSIZE / 1024, k / 1000, u / 1000);
+	}
+}
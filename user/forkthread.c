@@ -0,0 +1,60 @@
+// Fork from a threaded program, then check that the forking thread and
+// its sibling still share memory both ways, and that the fork child
+// shares it with them too.
+
+#include <inc/lib.h>
+
+#define TRIES	100000
+
+// Shared between the threads: everything mapped before thread_create.
+static volatile int ping, pong, forked;
+
+// Spin until *p holds v; returns 0 if it never does.
+static bool
+await(volatile int *p, int v)
+{
+	int i;
+
+	for (i = 0; i < TRIES; i++) {
+		if (*p == v)
+			return 1;
+		sys_yield();
+	}
+	return 0;
+}
+
+static void
+worker(void *arg)
+{
+	USED(arg);
+	if (!await(&ping, 1))
+		cprintf("forkthread: worker never saw the parent's write\n");
+	pong = 1;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t tid, child;
+	int r;
+
+	if ((r = thread_create(&tid, worker, NULL)) < 0)
+		panic("thread_create: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		forked = 1;
+		return;
+	}
+	wait(child);
+
+	// A write after the fork must still reach the worker, and the
+	// worker's reply must reach us.
+	ping = 1;
+	if (!await(&pong, 1))
+		panic("forkthread: never saw the worker's write");
+	thread_join(tid);
+	if (!forked)
+		panic("forkthread: fork child's write was not shared");
+	cprintf("forkthread: OK\n");
+}
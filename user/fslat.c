@@ -0,0 +1,98 @@
+// Measure the latency of file server open, stat and read requests,
+// issued the old way (ipc_send, then ipc_recv for the reply) and with
+// ipc_call, which needs half the kernel entries.  Requests are built
+// by hand, as lib/file.c does, so both paths can run side by side.
+// Last, time stat sent as inline IPC words, which maps no page.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER		100
+#define FDVA		((struct Fd *) UTEMP)
+
+static union Fsipc req __attribute__((aligned(PGSIZE)));
+static envid_t fsenv;
+
+static int
+rpc_sendrecv(unsigned type, void *dstva)
+{
+	ipc_send(fsenv, type, &req, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, dstva, NULL);
+}
+
+static int
+rpc_call(unsigned type, void *dstva)
+{
+	return ipc_call(fsenv, type, &req, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+static void
+run(const char *name, int (*rpc)(unsigned, void *))
+{
+	uint64_t t, topen = 0, tstat = 0, tread = 0;
+	int i, r;
+
+	for (i = 0; i < NITER; i++) {
+		strcpy(req.open.req_path, "/motd");
+		req.open.req_omode = O_RDONLY;
+		t = read_tsc();
+		if ((r = rpc(FSREQ_OPEN, FDVA)) < 0)
+			panic("fslat: open: %e", r);
+		topen += read_tsc() - t;
+
+		req.stat.req_fileid = FDVA->fd_file.id;
+		t = read_tsc();
+		if ((r = rpc(FSREQ_STAT, NULL)) < 0)
+			panic("fslat: stat: %e", r);
+		tstat += read_tsc() - t;
+
+		FDVA->fd_offset = 0;
+		req.read.req_fileid = FDVA->fd_file.id;
+		req.read.req_n = 512;
+		t = read_tsc();
+		if ((r = rpc(FSREQ_READ, NULL)) < 0)
+			panic("fslat: read: %e", r);
+		tread += read_tsc() - t;
+
+		// Dropping the Fd page closes the file in the server.
+		sys_page_unmap(0, FDVA);
+	}
+	cprintf("fslat: %s: open %llu, stat %llu, read %llu cycles\n",
+		name, topen / NITER, tstat / NITER, tread / NITER);
+}
+
+static void
+run_inline(void)
+{
+	struct Fsreq_stat sreq;
+	uint64_t t, tstat = 0;
+	int i, r;
+
+	strcpy(req.open.req_path, "/motd");
+	req.open.req_omode = O_RDONLY;
+	if ((r = rpc_call(FSREQ_OPEN, FDVA)) < 0)
+		panic("fslat: open: %e", r);
+	for (i = 0; i < NITER; i++) {
+		sreq.req_fileid = FDVA->fd_file.id;
+		t = read_tsc();
+		r = ipc_call(fsenv, FSREQ_STAT, &sreq,
+			     IPC_INLINE(sizeof(sreq) / 4), NULL, NULL);
+		if (r < 0)
+			panic("fslat: inline stat: %e", r);
+		tstat += read_tsc() - t;
+	}
+	sys_page_unmap(0, FDVA);
+	cprintf("fslat: inline call: stat %llu cycles\n", tstat / NITER);
+}
+
+void
+umain(int argc, char **argv)
+{
+	if ((fsenv = ipc_find_env(ENV_TYPE_FS)) == 0) {
+		cprintf("fslat: no file server running\n");
+		return;
+	}
+	run("send+recv", rpc_sendrecv);
+	run("call", rpc_call);
+	run_inline();
+}
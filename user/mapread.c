@@ -0,0 +1,85 @@
+// Compare reading a file with read(), which copies each block twice
+// (block cache to IPC page in the file server, IPC page to our buffer
+// here), against mapping the block cache pages with readmap.  Both
+// passes run on a warm cache and sum the data, so the difference is
+// the copying.  The file is a quarter of the disk, up to MAXFILEBLKS
+// blocks; use e.g. FSIMGBLKS=8192 for a multi-megabyte one.
+
+#include <inc/lib.h>
+
+#define PATH		"/mapread.dat"
+#define MAXFILEBLKS	2048
+#define MAPVA		((char *) 0x30000000)
+
+static char buf[PGSIZE];
+
+static uint32_t
+sum(const char *p, size_t n)
+{
+	uint32_t s = 0;
+
+	while (n-- > 0)
+		s += *p++;
+	return s;
+}
+
+static void
+report(const char *how, uint32_t nblocks, nanoseconds_t elapsed, uint32_t s)
+{
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("mapread: %s: %llu KB/sec (sum %08x)\n", how,
+	       (uint64_t) nblocks * BLKSIZE / 1024 * NANOSECONDS_PER_SECOND / elapsed, s);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cachestat st;
+	nanoseconds_t start;
+	uint32_t nblocks, i, s;
+	int fd, r;
+
+	if ((r = fs_cachestat(-1, 0, 0, &st)) < 0)
+		panic("fs_cachestat: %e", r);
+	nblocks = MIN(MIN(st.ret_nblocks / 4, st.ret_capacity / 2), MAXFILEBLKS);
+
+	if ((fd = open(PATH, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", PATH, fd);
+	for (i = 0; i < PGSIZE; i++)
+		buf[i] = i * 7;
+	for (i = 0; i < nblocks; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", PATH, r);
+	close(fd);
+	printf("mapread: %u-block file\n", nblocks);
+
+	if ((fd = open(PATH, O_RDONLY)) < 0)
+		panic("open %s: %e", PATH, fd);
+
+	// Warm the cache.
+	while ((r = read(fd, buf, PGSIZE)) > 0)
+		;
+
+	seek(fd, 0);
+	s = 0;
+	start = uptime();
+	while ((r = read(fd, buf, PGSIZE)) > 0)
+		s += sum(buf, r);
+	if (r < 0)
+		panic("read %s: %e", PATH, r);
+	report("read", nblocks, uptime() - start, s);
+
+	s = 0;
+	start = uptime();
+	for (i = 0; i < nblocks; i++) {
+		if ((r = readmap(fd, i * BLKSIZE, MAPVA)) < 0)
+			panic("readmap %s: %e", PATH, r);
+		s += sum(MAPVA, r);
+	}
+	report("readmap", nblocks, uptime() - start, s);
+
+	sys_page_unmap(0, MAPVA);
+	close(fd);
+	remove(PATH);
+}
@@ -0,0 +1,85 @@
+// Compare reading a file up front with mapping it and faulting in only
+// what is touched, then time spawning a program with a large image.
+// The file used for both is /bigbin, whose read-only image spawn maps
+// from the file server's cache instead of copying.
+
+#include <inc/lib.h>
+
+#define PATH		"/bigbin"
+#define NSPAWN		20
+
+static char buf[PGSIZE];
+
+static void
+report(const char *what, nanoseconds_t elapsed)
+{
+	printf("mmapbench: %-26s %6llu us\n", what, elapsed / 1000);
+}
+
+// Read the whole file with read().
+static nanoseconds_t
+readall(off_t size)
+{
+	nanoseconds_t start = uptime();
+	int fd, r;
+
+	if ((fd = open(PATH, O_RDONLY)) < 0)
+		panic("open %s: %e", PATH, fd);
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (r < 0)
+		panic("read %s: %e", PATH, r);
+	close(fd);
+	return uptime() - start;
+}
+
+// Map the file and touch every 'stride'th page of it.
+static nanoseconds_t
+maptouch(off_t size, size_t stride)
+{
+	nanoseconds_t start = uptime();
+	volatile char *p;
+	void *va;
+	off_t off;
+	int fd, r;
+
+	if ((fd = open(PATH, O_RDONLY)) < 0)
+		panic("open %s: %e", PATH, fd);
+	if ((r = mmap(fd, 0, size, PROT_READ, &va)) < 0)
+		panic("mmap %s: %e", PATH, r);
+	close(fd);
+	p = va;
+	for (off = 0; off < size; off += stride * PGSIZE)
+		(void) p[off];
+	munmap(va);
+	return uptime() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *args[] = { "bigbin", NULL };
+	struct Stat st;
+	nanoseconds_t start;
+	int i, r;
+
+	if ((r = stat(PATH, &st)) < 0)
+		panic("stat %s: %e", PATH, r);
+	printf("mmapbench: %s is %d KB\n", PATH, st.st_size / 1024);
+
+	// Warm the cache, so both sides measure the copying and mapping
+	// rather than the disk.
+	readall(st.st_size);
+	report("read all:", readall(st.st_size));
+	report("mmap, touch all:", maptouch(st.st_size, 1));
+	report("mmap, touch 1 page in 16:", maptouch(st.st_size, 16));
+	report("mmap, touch first page:", maptouch(st.st_size, st.st_size / PGSIZE + 1));
+
+	start = uptime();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((r = spawn(PATH, args)) < 0)
+			panic("spawn %s: %e", PATH, r);
+		wait(r);
+	}
+	report("spawn+wait bigbin, each:", (uptime() - start) / NSPAWN);
+}
@@ -0,0 +1,65 @@
+// Ping-pong a counter between two processes, like pingpong.c, and
+// report the average round-trip time in cycles.  Runs once with the
+// old sys_ipc_try_send/sys_yield retry loop and once with the
+// blocking, direct-handoff sys_ipc_send.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	1000
+
+static void
+send_retry(envid_t to_env, uint32_t val)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send(to_env, val, (void *) -1, 0)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("sys_ipc_try_send: %e", r);
+}
+
+static void
+send_block(envid_t to_env, uint32_t val)
+{
+	int r;
+
+	if ((r = sys_ipc_send(to_env, val, (void *) -1, 0)) < 0)
+		panic("sys_ipc_send: %e", r);
+}
+
+static void
+run(const char *name, void (*send)(envid_t, uint32_t))
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t i;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		// Echo every value back until the last round.
+		do {
+			i = ipc_recv(&who, 0, 0);
+			send(who, i);
+		} while (i < NROUNDS - 1);
+		exit();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUNDS; i++) {
+		send(who, i);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("pingpongbench: bad reply");
+	}
+	cprintf("pingpongbench: %s: %llu cycles per round-trip\n",
+		name, (read_tsc() - start) / NROUNDS);
+	wait(who);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("try_send+yield", send_retry);
+	run("blocking send", send_block);
+}
@@ -0,0 +1,125 @@
+// Measure request latency seen by a client of a server env while
+// CPU hogs compete for every CPU.  Like fairness.c, a client sends
+// IPC requests to a server; like stresssched.c, it forks a crowd of
+// environments, here ones that spin forever.  The server stands in
+// for the file system server (ENV_TYPE_FS).  The test runs twice:
+// once with the server in ENV_SCHED_FAIR like everyone else, and
+// once with it in ENV_SCHED_LATENCY.
+// Run with e.g. make run-schedlat CPUS=4.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NREQ		200
+#define SERVER_WORK	10000
+
+static uint64_t lat[NREQ];
+static uint64_t cycles_per_us;
+
+static void
+server(void)
+{
+	envid_t who;
+	uint32_t v;
+	volatile int i;
+
+	while (1) {
+		v = ipc_recv(&who, 0, 0);
+		for (i = 0; i < SERVER_WORK; i++)
+			;
+		ipc_send(who, v, 0, 0);
+	}
+}
+
+static void
+hog(void)
+{
+	while (1)
+		asm volatile("pause");
+}
+
+static void
+calibrate(void)
+{
+	nanoseconds_t t0, t1;
+	uint64_t c0;
+
+	// Start on a tick boundary, then count cycles over 10 ticks.
+	t0 = uptime();
+	while ((t1 = uptime()) == t0)
+		;
+	c0 = read_tsc();
+	while (uptime() < t1 + 100 * NANOSECONDS_PER_MILLISECOND)
+		;
+	cycles_per_us = (read_tsc() - c0) / (100 * 1000);
+	if (cycles_per_us == 0)
+		cycles_per_us = 1;
+}
+
+static void
+sort(uint64_t *a, int n)
+{
+	int i, j;
+	uint64_t x;
+
+	for (i = 1; i < n; i++) {
+		x = a[i];
+		for (j = i; j > 0 && a[j - 1] > x; j--)
+			a[j] = a[j - 1];
+		a[j] = x;
+	}
+}
+
+static void
+run(const char *name, int sched_class, int nhogs)
+{
+	envid_t srv, hogs[2 * SYSINFO_MAXCPU];
+	uint64_t t;
+	int i, r;
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0)
+		server();
+	if ((r = sys_env_set_priority(srv, sched_class, ENV_WEIGHT_DEFAULT)) < 0)
+		panic("sys_env_set_priority: %e", r);
+
+	for (i = 0; i < nhogs; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			hog();
+	}
+
+	for (i = 0; i < NREQ; i++) {
+		t = read_tsc();
+		ipc_send(srv, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("schedlat: bad reply");
+		lat[i] = read_tsc() - t;
+	}
+
+	for (i = 0; i < nhogs; i++)
+		sys_env_destroy(hogs[i]);
+	sys_env_destroy(srv);
+
+	sort(lat, NREQ);
+	cprintf("schedlat: server %s, %d hogs: p50 %llu us, p99 %llu us, max %llu us\n",
+		name, nhogs, lat[NREQ / 2] / cycles_per_us,
+		lat[NREQ * 99 / 100] / cycles_per_us,
+		lat[NREQ - 1] / cycles_per_us);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sysinfo info;
+	int nhogs;
+
+	sys_sysinfo(&info);
+	nhogs = 2 * info.ncpus;
+	calibrate();
+
+	run("fair", ENV_SCHED_FAIR, nhogs);
+	run("latency", ENV_SCHED_LATENCY, nhogs);
+}
@@ -0,0 +1,64 @@
+// Time spawn and count the memory that running instances of one
+// program cost.  First spawns /sh NSH times one after another, reading
+// an empty script so each exits at once, and reports the latency of
+// the first spawn (which builds spawn's view of the program) and of
+// the rest.  Then keeps NSH copies running at the same time, reading
+// from a pipe nobody writes, and reports how many pages each takes.
+
+#include <inc/lib.h>
+
+#define PATH		"/sh"
+#define SCRIPT		"/spawnbench.sh"
+#define NSH		50
+
+static envid_t shs[NSH];
+
+void
+umain(int argc, char **argv)
+{
+	const char *args[] = { "sh", NULL };
+	struct sysinfo before, after;
+	nanoseconds_t start, elapsed, first = 0, rest = 0;
+	struct Stat st;
+	int fd, p[2], i, r;
+
+	if ((r = stat(PATH, &st)) < 0)
+		panic("stat %s: %e", PATH, r);
+
+	// The instances inherit our fd 0.
+	if ((fd = open(SCRIPT, O_RDONLY | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", SCRIPT, fd);
+	dup(fd, 0);
+	close(fd);
+	for (i = 0; i < NSH; i++) {
+		start = uptime();
+		if ((r = spawn(PATH, args)) < 0)
+			panic("spawn %s: %e", PATH, r);
+		elapsed = uptime() - start;
+		wait(r);
+		if (i == 0)
+			first = elapsed;
+		else
+			rest += elapsed;
+	}
+	printf("spawnbench: %s, %d KB: first spawn %llu us, then %llu us each\n",
+	       PATH, st.st_size / 1024, first / 1000, rest / (NSH - 1) / 1000);
+	remove(SCRIPT);
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	dup(p[0], 0);
+	close(p[0]);
+	sys_sysinfo(&before);
+	for (i = 0; i < NSH; i++)
+		if ((shs[i] = spawn(PATH, args)) < 0)
+			panic("spawn %s: %e", PATH, shs[i]);
+	sys_sysinfo(&after);
+	printf("spawnbench: %d running instances: %u pages each\n",
+	       NSH, (before.freepages - after.freepages) / NSH);
+
+	// They share our write end of the pipe, so would never see EOF.
+	for (i = 0; i < NSH; i++)
+		sys_env_destroy(shs[i]);
+	close(p[1]);
+}
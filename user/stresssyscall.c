@@ -0,0 +1,61 @@
+// Measure how syscall throughput scales with the number of CPUs.
+// For k = 1 .. ncpus, fork k workers that each hammer
+// sys_page_alloc/sys_page_unmap on their own address space, and
+// report the aggregate syscalls per second.  Run with e.g.
+// make run-stresssyscall CPUS=8.
+
+#include <inc/lib.h>
+
+#define NITER	20000
+
+static void
+worker(envid_t parent)
+{
+	int i, r;
+
+	for (i = 0; i < NITER; i++) {
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, UTEMP)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	ipc_send(parent, 0, NULL, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sysinfo info;
+	nanoseconds_t start, elapsed;
+	uint64_t nsyscalls;
+	envid_t parent = sys_getenvid();
+	int i, k, r;
+
+	sys_sysinfo(&info);
+	cprintf("stresssyscall: %d CPUs, %d iterations per worker\n",
+		info.ncpus, NITER);
+
+	for (k = 1; k <= info.ncpus; k++) {
+		start = uptime();
+		for (i = 0; i < k; i++) {
+			if ((r = fork()) < 0)
+				panic("fork: %e", r);
+			if (r == 0) {
+				worker(parent);
+				exit();
+			}
+		}
+		// Block in the kernel rather than spinning, so the
+		// workers get every CPU.
+		for (i = 0; i < k; i++)
+			ipc_recv(NULL, NULL, NULL);
+		elapsed = uptime() - start;
+
+		nsyscalls = 2ULL * NITER * k;
+		if (elapsed == 0)
+			elapsed = 1;
+		cprintf("stresssyscall: %d workers: %llu syscalls in %llu ms, %llu syscalls/sec\n",
+			k, nsyscalls, elapsed / NANOSECONDS_PER_MILLISECOND,
+			nsyscalls * NANOSECONDS_PER_SECOND / elapsed);
+	}
+}
@@ -0,0 +1,75 @@
+// Measure sync latency when a small part of the disk is dirty: 0.1%
+// of its blocks, rewritten in a file, then synced.  The file server
+// only looks at its dirty set, so the latency should follow the
+// number of dirty blocks, not the size of the disk.  Compare e.g. the
+// default image with one built with FSIMGBLKS=262144 (1GB).
+
+#include <inc/lib.h>
+
+#define PATH		"/syncbench.dat"
+#define NITER		10
+
+static char buf[PGSIZE];
+
+// Rewrite the file's nblocks blocks, which dirties them and nothing
+// else, since its size stays the same.
+static void
+dirty(uint32_t nblocks)
+{
+	int fd, r;
+	uint32_t i;
+
+	if ((fd = open(PATH, O_WRONLY | O_CREAT)) < 0)
+		panic("open %s: %e", PATH, fd);
+	for (i = 0; i < nblocks; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", PATH, r);
+	close(fd);
+}
+
+// Return the average time sync takes, in microseconds, with
+// nblocks of the file dirty each time.
+static uint64_t
+run(uint32_t nblocks, uint32_t *ndirty)
+{
+	struct Fsret_cachestat st;
+	nanoseconds_t start, elapsed = 0;
+	int i, r;
+
+	*ndirty = 0;
+	for (i = 0; i < NITER; i++) {
+		dirty(nblocks);
+		fs_cachestat(-1, 0, 0, &st);
+		*ndirty += st.ret_dirty;
+		start = uptime();
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+		elapsed += uptime() - start;
+	}
+	*ndirty /= NITER;
+	return elapsed / NITER / 1000;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cachestat st;
+	uint32_t nblocks, ndirty;
+	uint64_t us;
+	int r;
+
+	if ((r = fs_cachestat(-1, 0, 0, &st)) < 0)
+		panic("fs_cachestat: %e", r);
+	nblocks = MAX(st.ret_nblocks / 1000, 1);
+
+	// Create the file, and sync once so that only rewrites follow.
+	dirty(nblocks);
+	sync();
+
+	us = run(0, &ndirty);
+	printf("syncbench: %u-block disk, %u blocks dirty: sync %llu us\n",
+	       st.ret_nblocks, ndirty, us);
+	us = run(nblocks, &ndirty);
+	printf("syncbench: %u-block disk, %u blocks dirty: sync %llu us\n",
+	       st.ret_nblocks, ndirty, us);
+}
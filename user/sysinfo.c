@@ -4,9 +4,10 @@ void
 umain(int argc, char **argv)
 {
 	struct sysinfo info;
-	int fd, len;
+	int fd, len, i;
 	char *fmt =
 		"uptime     \t%llu\n"
+		"ncpus      \t%d\n"
 		"totalpages \t%u\n"
 		"freepages  \t%u\n"
 		"inblocks   \t%llu\n"
@@ -17,8 +18,11 @@ umain(int argc, char **argv)
 	char buf[64];
 
 	sys_sysinfo(&info);
-	printf(fmt, info.uptime,
+	printf(fmt, info.uptime, info.ncpus,
 	       info.totalpages, info.freepages,
 	       info.inblocks, info.outblocks,
 	       info.inpackets, info.outpackets);
+	for (i = 0; i < info.ncpus; i++)
+		printf("cpu%d       \trunq %u\tsteals %llu\n",
+		       i, info.runqlen[i], info.steals[i]);
 }
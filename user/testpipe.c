@@ -2,6 +2,14 @@
 
 char *msg = "Now is the time for all good men to come to the aid of their party.";
 
+#define EMPTYNSEC	(200 * NANOSECONDS_PER_MILLISECOND)
+#define SETTLENSEC	(20 * NANOSECONDS_PER_MILLISECOND)
+// How often a reader asleep on an empty pipe may still be scheduled.
+#define MAXEMPTYRUNS	2
+
+static void pipesleep(void);
+static void pipeforkopen(void);
+
 void
 umain(int argc, char **argv)
 {
@@ -60,5 +68,81 @@ umain(int argc, char **argv)
 	close(p[1]);
 	wait(pid);
 
+	pipesleep();
+	pipeforkopen();
 	cprintf("pipe tests passed\n");
 }
+
+// A forked child holding the write end keeps the pipe open after the
+// parent closes its own copy, until the child is done with it.
+static void
+pipeforkopen(void)
+{
+	char buf[1];
+	int i, pid, p[2];
+
+	binaryname = "pipeforkopen";
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+
+	if (pid == 0) {
+		close(p[0]);
+		nanosleep(EMPTYNSEC);
+		if ((i = write(p[1], "x", 1)) != 1)
+			panic("write: %e", i);
+		exit();
+	}
+	close(p[1]);
+	if (pipeisclosed(p[0]))
+		panic("pipe closed while the child still holds the write end");
+	if ((i = read(p[0], buf, 1)) != 1)
+		panic("read: got %d, want the child's byte", i);
+	if ((i = read(p[0], buf, 1)) != 0)
+		panic("read: got %d, want end of file", i);
+	close(p[0]);
+	wait(pid);
+	cprintf("pipe held open by forked child\n");
+}
+
+// A reader with nothing to read should sleep, not spin: count how many
+// times one gets scheduled while the pipe stays empty for a while,
+// once it has had time to block.
+static void
+pipesleep(void)
+{
+	char buf[1];
+	const volatile struct Env *kid;
+	uint32_t runs;
+	int i, pid, p[2];
+
+	binaryname = "pipesleep";
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+
+	if (pid == 0) {
+		close(p[1]);
+		if ((i = read(p[0], buf, 1)) != 1)
+			panic("read: %e", i);
+		exit();
+	}
+	close(p[0]);
+	kid = &envs[ENVX(pid)];
+	nanosleep(SETTLENSEC);
+	runs = kid->env_runs;
+	nanosleep(EMPTYNSEC);
+	runs = kid->env_runs - runs;
+	if ((i = write(p[1], "x", 1)) != 1)
+		panic("write: %e", i);
+	close(p[1]);
+	wait(pid);
+	cprintf("reader ran %u times in %u ms waiting on an empty pipe\n",
+		runs, (uint32_t) (EMPTYNSEC / NANOSECONDS_PER_MILLISECOND));
+	if (runs > MAXEMPTYRUNS)
+		panic("reader blocked on an empty pipe kept running");
+}
@@ -0,0 +1,101 @@
+// Count the primes below LIMIT by trial division with a pool of 1 to
+// ncpus threads, and report the speedup over one thread.  Workers take
+// CHUNK numbers at a time from a shared cursor, so faster threads take
+// more of the work.  Run with e.g. make run-threadbench CPUS=4.
+
+#include <inc/lib.h>
+
+#define LIMIT		300000
+#define CHUNK		2000
+
+// Shared between the threads: everything mapped before thread_create.
+static struct mutex lock;
+static struct cond alldone;
+static uint32_t next;		// first number not yet handed out
+static uint32_t nprimes;
+static int running;
+
+static bool
+isprime(uint32_t n)
+{
+	uint32_t d;
+
+	if (n < 2)
+		return 0;
+	for (d = 2; d * d <= n; d++)
+		if (n % d == 0)
+			return 0;
+	return 1;
+}
+
+static void
+worker(void *arg)
+{
+	uint32_t lo, n, count;
+
+	USED(arg);
+	for (;;) {
+		mutex_lock(&lock);
+		lo = next;
+		next += CHUNK;
+		mutex_unlock(&lock);
+		if (lo >= LIMIT)
+			break;
+		count = 0;
+		for (n = lo; n < lo + CHUNK && n < LIMIT; n++)
+			count += isprime(n);
+		mutex_lock(&lock);
+		nprimes += count;
+		mutex_unlock(&lock);
+	}
+
+	mutex_lock(&lock);
+	if (--running == 0)
+		cond_signal(&alldone);
+	mutex_unlock(&lock);
+}
+
+static nanoseconds_t
+run(int nthreads)
+{
+	envid_t tids[SYSINFO_MAXCPU];
+	nanoseconds_t start;
+	int i, r;
+
+	next = nprimes = 0;
+	running = nthreads;
+	start = uptime();
+	for (i = 0; i < nthreads; i++)
+		if ((r = thread_create(&tids[i], worker, NULL)) < 0)
+			panic("thread_create: %e", r);
+	mutex_lock(&lock);
+	while (running > 0)
+		cond_wait(&alldone, &lock);
+	mutex_unlock(&lock);
+	start = uptime() - start;
+	for (i = 0; i < nthreads; i++)
+		thread_join(tids[i]);
+	return start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sysinfo info;
+	nanoseconds_t one, t;
+	int n, r;
+
+	if ((r = sys_sysinfo(&info)) < 0)
+		panic("sys_sysinfo: %e", r);
+	mutex_init(&lock);
+	cond_init(&alldone);
+
+	one = run(1);
+	cprintf("threadbench: 1 thread: %llu ms, %u primes below %u\n",
+		one / 1000000, nprimes, LIMIT);
+	for (n = 2; n <= info.ncpus && n <= SYSINFO_MAXCPU; n++) {
+		t = run(n);
+		cprintf("threadbench: %d threads: %llu ms, speedup %llu.%02llux\n",
+			n, t / 1000000, one / t, one * 100 / t % 100);
+	}
+}